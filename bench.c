@@ -0,0 +1,311 @@
+/*
+ * MetroSim benchmark suite. Builds on the metro front end without its main,
+ * linked with libmetrosim, and runs the core headless over a matrix of
+ * engines, network sizes, probabilities and run lengths, followed by
+ * microbenchmarks of the console, the train log and the train queue. Results
+ * are written as JSON, one metric per line, and can be compared against a
+ * saved baseline.
+ */
+#define METRO_BENCH
+#include "metro.c"
+
+#define BENCH_FORMAT 1
+#define BENCH_REGRESSION_ERR 1
+#define BENCH_NAME_LENGTH 128
+
+//Benchmark options
+int bench_quick = 0;
+int bench_repeat = 3;
+double bench_threshold = 10.0;
+char *bench_output = NULL;
+char *bench_baseline = NULL;
+
+static struct argp_option bench_options[] =
+{
+	{"output", 'o', "FILE", 0, "Write the JSON results to FILE instead of standard output."},
+	{"compare", 'c', "FILE", 0, "Compare against a baseline written by an earlier run, exits with 1 on a regression."},
+	{"threshold", 't', "PERCENT", 0, "Change that counts as a regression in compare mode, default 10."},
+	{"repeat", 'r', "N", 0, "Runs per configuration, the fastest one is reported. Default 3."},
+	{"quick", 'q', 0, 0, "Smaller matrix and fewer iterations, for a quick check."},
+	{"workers", 'w', "N", 0, "Workers for the tick engine and regions for the region engine, defaults to one per core."},
+	{0}
+};
+
+static error_t bench_parse_opt(int key, char *arg, struct argp_state *state){
+	switch(key){
+		case 'o':
+			bench_output = arg;
+			break;
+		case 'c':
+			bench_baseline = arg;
+			break;
+		case 't':
+			bench_threshold = atof(arg);
+			break;
+		case 'r':
+			bench_repeat = atoi(arg);
+			if(bench_repeat<1)argp_error(state, "repeat must be at least 1");
+			break;
+		case 'q':
+			bench_quick = 1;
+			break;
+		case 'w':
+			workers = atoi(arg);
+			if(workers<1)argp_error(state, "workers must be at least 1");
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp bench_argp = {bench_options, bench_parse_opt, 0, "MetroSim benchmark suite."};
+
+//One measured value, higher_is_better decides the direction of a regression
+struct Metric{
+	char name[BENCH_NAME_LENGTH];
+	double value;
+	int higher_is_better;
+};
+
+struct Metric *metrics = NULL;
+int metric_count = 0;
+int metric_capacity = 0;
+
+void add_metric(const char *name, double value, int higher_is_better){
+	metrics = grow_array(metrics, &metric_capacity, metric_count, sizeof(struct Metric));
+	struct Metric *m = &metrics[metric_count++];
+	snprintf(m->name, BENCH_NAME_LENGTH, "%s", name);
+	m->value = value;
+	m->higher_is_better = higher_is_better;
+	fprintf(stderr, "%-56s %16.2f\n", name, value);
+}
+
+//Network of n segments in sections of four, every segment follows -p
+struct Topology *bench_topology(int n){
+	if(n==4)return topology_builtin();
+	size_t size = 64+(size_t)n*64;
+	char *text = malloc(size);
+	size_t used = 0;
+	for(int i = 0; i<n/4; i++)used+=snprintf(text+used, size-used, "section S%d\n", i);
+	for(int i = 0; i<n; i++)used+=snprintf(text+used, size-used, "segment G%d S%d p G%d X\n", i, i/4, (i+5)%n);
+	struct Topology *t = topology_parse(text, "bench topology");
+	free(text);
+	return t;
+}
+
+/*
+ * Runs one configuration bench_repeat times with logging off and keeps the
+ * fastest run. Barrier and control latencies are merged over all workers.
+ */
+void bench_simulation(int run_engine, int segments, float p, int length){
+	char prefix[BENCH_NAME_LENGTH];
+	char name[BENCH_NAME_LENGTH];
+	snprintf(prefix, sizeof(prefix), "sim/%s/n%d/p%.2f/s%d", engine_names[run_engine], segments, p, length);
+	double best = -1.0;
+	int events = 0;
+	struct Histogram *phase = calloc(PHASE_COUNT, sizeof(struct Histogram));
+	for(int r = 0; r<bench_repeat; r++){
+		engine = run_engine;
+		struct SimParams params = run_params(p, length, 1000+r);
+		struct Simulation *sim = sim_create(&params);
+		sim->timing = 1;
+		uint64_t start = now_ns();
+		run_simulation(sim);
+		double elapsed = (now_ns()-start)/1e9;
+		if(best<0||elapsed<best){
+			best = elapsed;
+			events = count_arrivals(sim)+sim->released_trains;
+		}
+		for(int w = 0; w<sim->stats_count; w++){
+			for(int k = 0; k<PHASE_COUNT; k++)hist_merge(&phase[k], &sim->stats[w].phase[k]);
+		}
+		sim_destroy(sim);
+	}
+	snprintf(name, sizeof(name), "%s/ticks_per_sec", prefix);
+	add_metric(name, (length+1)/best, 1);
+	snprintf(name, sizeof(name), "%s/events_per_sec", prefix);
+	add_metric(name, events/best, 1);
+	//Barrier waits only exist with more than one worker
+	if(phase[PHASE_BARRIER].count>0){
+		snprintf(name, sizeof(name), "%s/barrier_p50_ns", prefix);
+		add_metric(name, hist_quantile(&phase[PHASE_BARRIER], 0.5), 0);
+		snprintf(name, sizeof(name), "%s/barrier_p99_ns", prefix);
+		add_metric(name, hist_quantile(&phase[PHASE_BARRIER], 0.99), 0);
+	}
+	if(phase[PHASE_CONTROL].count>0){
+		snprintf(name, sizeof(name), "%s/control_p50_ns", prefix);
+		add_metric(name, hist_quantile(&phase[PHASE_CONTROL], 0.5), 0);
+		snprintf(name, sizeof(name), "%s/control_p99_ns", prefix);
+		add_metric(name, hist_quantile(&phase[PHASE_CONTROL], 0.99), 0);
+	}
+	free(phase);
+}
+
+void bench_matrix(){
+	int sizes[] = {4, 64, 1024};
+	float probabilities[] = {0.1f, 0.5f, 0.9f};
+	int lengths[] = {1000, 10000};
+	int engines[] = {ENGINE_TICK, ENGINE_DES, ENGINE_REGIONS};
+	int size_count = bench_quick?2:3;
+	int length_count = bench_quick?1:2;
+	headless = 1;
+	for(int n = 0; n<size_count; n++){
+		topology = bench_topology(sizes[n]);
+		queue_count = topology->segment_count;
+		for(int e = 0; e<ENGINES; e++){
+			for(int l = 0; l<length_count; l++){
+				for(int k = 0; k<3; k++)bench_simulation(engines[e], sizes[n], probabilities[k], lengths[l]);
+			}
+		}
+		topology_free(topology);
+	}
+}
+
+void bench_queue(int iterations){
+	struct TrainQueue q;
+	struct Train t = {0};
+	queue_init(&q);
+	uint64_t start = now_ns();
+	for(int i = 0; i<iterations; i++){
+		t.id = i;
+		queue_push(&q, &t);
+	}
+	for(int i = 0; i<iterations; i++)t = queue_pop(&q);
+	add_metric("micro/queue_fill_drain_ns_per_op", (double)(now_ns()-start)/(2.0*iterations), 0);
+	//Steady state of a short queue, the usual case in a run
+	for(int i = 0; i<8; i++)queue_push(&q, &t);
+	start = now_ns();
+	for(int i = 0; i<iterations; i++){
+		queue_push(&q, &t);
+		t = queue_pop(&q);
+	}
+	add_metric("micro/queue_push_pop_ns_per_op", (double)(now_ns()-start)/(2.0*iterations), 0);
+	queue_free(&q);
+}
+
+//Console ring without ncurses, log_console only needs COLS and the buffers
+void bench_console(int iterations){
+	headless = 0;
+	COLS = 120;
+	console_max_lines = 64;
+	console_lines = malloc(console_max_lines*sizeof(char *));
+	for(int i = 0; i<console_max_lines; i++)console_lines[i] = calloc(COLS-2, 1);
+	console_line_color = calloc(console_max_lines, sizeof(int));
+	uint64_t start = now_ns();
+	for(int i = 0; i<iterations; i++)log_console(GREEN_BLACK, "[SEGMENT %s] %d trains in queue.", "A", i);
+	add_metric("micro/log_console_ns_per_op", (double)(now_ns()-start)/iterations, 0);
+	for(int i = 0; i<console_max_lines; i++)free(console_lines[i]);
+	free(console_lines);
+	free(console_line_color);
+	console_lines = NULL;
+	headless = 1;
+}
+
+//Train log lines into /dev/null, text formatting and the binary ring
+void bench_train_log(int iterations){
+	topology = topology_builtin();
+	queue_count = topology->segment_count;
+	struct SimParams params = run_params(0.5f, iterations, 1);
+	struct Simulation *sim = sim_create(&params);
+	struct Train t = {.id = 1, .length = 1, .destination = 3};
+	sim->train_log = fopen("/dev/null", "w");
+	sim->control_log = fopen("/dev/null", "w");
+	uint64_t start = now_ns();
+	for(int i = 0; i<iterations; i++){
+		t.id = i;
+		log_train_arrival(sim, &t);
+	}
+	fflush(sim->train_log);
+	add_metric("micro/log_train_text_ns_per_op", (double)(now_ns()-start)/iterations, 0);
+	fclose(sim->train_log);
+	fclose(sim->control_log);
+	sim->train_log = NULL;
+	sim->control_log = NULL;
+
+	memcpy(sim->log_header.magic, LOG_MAGIC, 8);
+	sim->log_header.version = LOG_VERSION;
+	sim->log_header.record_size = sizeof(struct LogRecord);
+	sim->event_log = event_log_open("/dev/null", &sim->log_header, 1);
+	start = now_ns();
+	for(int i = 0; i<iterations; i++){
+		t.id = i;
+		log_train_arrival(sim, &t);
+	}
+	event_log_close(sim->event_log);
+	add_metric("micro/log_train_binary_ns_per_op", (double)(now_ns()-start)/iterations, 0);
+	sim->event_log = NULL;
+	sim_destroy(sim);
+	topology_free(topology);
+}
+
+void write_results(FILE *out){
+	fprintf(out, "{\"metrosim_bench\": %d, \"version\": \"%s\", \"quick\": %d, \"workers\": %d, \"cores\": %ld, \"metrics\": [\n", BENCH_FORMAT, PROGRAM_VERSION, bench_quick, workers, sysconf(_SC_NPROCESSORS_ONLN));
+	for(int i = 0; i<metric_count; i++){
+		fprintf(out, "  {\"name\": \"%s\", \"value\": %.3f, \"higher_is_better\": %d}%s\n", metrics[i].name, metrics[i].value, metrics[i].higher_is_better, i+1<metric_count?",":"");
+	}
+	fprintf(out, "]}\n");
+}
+
+/*
+ * Reads the metric lines of a baseline and reports every metric present in
+ * both runs. Returns the number of metrics that got worse by more than the
+ * threshold.
+ */
+int compare_baseline(const char *path){
+	FILE *in = fopen(path, "r");
+	if(in==NULL){
+		fprintf(stderr, "Cannot open baseline %s\n", path);
+		return -1;
+	}
+	char line[512];
+	int regressions = 0;
+	int matched = 0;
+	fprintf(stderr, "\n%-56s %14s %14s %9s\n", "Metric", "Baseline", "Current", "Change");
+	while(fgets(line, sizeof(line), in)!=NULL){
+		char name[BENCH_NAME_LENGTH];
+		double value;
+		int higher;
+		if(sscanf(line, " {\"name\": \"%127[^\"]\", \"value\": %lf, \"higher_is_better\": %d}", name, &value, &higher)!=3)continue;
+		for(int i = 0; i<metric_count; i++){
+			if(strcmp(metrics[i].name, name)!=0)continue;
+			matched++;
+			double change = (value!=0.0)?100.0*(metrics[i].value-value)/value:0.0;
+			int worse = higher?(change<-bench_threshold):(change>bench_threshold);
+			regressions+=worse;
+			fprintf(stderr, "%-56s %14.2f %14.2f %+8.1f%%%s\n", name, value, metrics[i].value, change, worse?"  REGRESSION":"");
+		}
+	}
+	fclose(in);
+	fprintf(stderr, "%d metrics compared, %d regressions beyond %.1f%%\n", matched, regressions, bench_threshold);
+	return regressions;
+}
+
+int main(int argc, char **argv){
+	argp_parse(&bench_argp, argc, argv, 0, 0, 0);
+	if(bench_quick&&bench_repeat==3)bench_repeat = 1;
+	time(&raw_time);
+	time_data = localtime(&raw_time);
+
+	bench_matrix();
+	int iterations = bench_quick?200000:2000000;
+	bench_queue(iterations);
+	bench_console(iterations/4);
+	bench_train_log(iterations);
+
+	FILE *out = stdout;
+	if(bench_output!=NULL&&(out = fopen(bench_output, "w"))==NULL){
+		fprintf(stderr, "Cannot open %s\n", bench_output);
+		return LOG_OPEN_ERR;
+	}
+	write_results(out);
+	if(out!=stdout)fclose(out);
+
+	if(bench_baseline!=NULL){
+		int regressions = compare_baseline(bench_baseline);
+		if(regressions<0)return LOG_OPEN_ERR;
+		if(regressions>0)return BENCH_REGRESSION_ERR;
+	}
+	free(metrics);
+	return 0;
+}
@@ -1,24 +1,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
 #include <locale.h>
 #include <time.h>
 #include <signal.h>
-
-#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <dirent.h>
 #include <ncurses.h>
 #include <menu.h>
 #include <argp.h>
+#include "simulation.h"
 
 //Program definitions
 #define PROGRAM_VERSION "v1.0b"
 
 //Error definitions
 #define MIN_SIZE_MIS -11
-#define ARGP_ERR_UNKNOWN -21
 #define INV_MENU_OPT -31
 #define INV_SETT_OPT_VAL -32
+#define SWEEP_ERR -101
+#define ENGINE_ERR -111
+#define HISTORY_ERR -121
 
 //Window definitions
 #define COLS_MIN 80
@@ -28,10 +37,6 @@
 #define SPLASH_TIME 1
 
 //Color definitions
-#define WHITE_BLACK 0
-#define GREEN_BLACK 1
-#define RED_BLACK 2
-#define YELLOW_BLACK 3
 #define MARKED_TEXT A_STANDOUT
 
 //Menu definitions
@@ -50,6 +55,48 @@
 //Simulation definitions
 #define SIM_TIME_MAX 9999
 
+//Summary and overlay definitions
+#define STATS_OVERLAY_COLS 36
+#define SUMMARY_ROWS_MAX 32
+
+//Checkpoint definitions
+#define CHECKPOINT_MAGIC "MSIMCKPT"
+#define CHECKPOINT_VERSION 4
+
+//What-if definitions
+#define WHAT_IF_MAX 16
+#define DEFAULT_WHAT_IF_HORIZON 1000
+
+//Replication definitions
+#define REPLICATION_METRICS 6
+#define ADAPTIVE_FIRST_RUNS 10
+#define DEFAULT_MAX_REPLICATIONS 1000
+
+//Sweep definitions
+#define SWEEP_P 0
+#define SWEEP_BREAKDOWN 1
+#define SWEEP_BLOCK 2
+#define SWEEP_AXES 3
+#define SWEEP_POINTS_MAX 1000000
+#define SWEEP_ROW_MAX 512
+#define SWEEP_CSV_HEADER "p,breakdown,block,ticks,seed,engine,policy,throughput,wait_p50,wait_p95,wait_p99,blocked_fraction,utilisation,max_queue"
+
+//Log viewer definitions
+#define LOG_INDEX_CHUNK 65536
+#define LOG_INDEX_PUBLISH 4096
+#define LOG_VIEWER_FILES 64
+#define LOG_VIEWER_INPUT 64
+#define LOG_VIEWER_REFRESH_MS 200
+#define NOT_FOUND ((size_t)-1)
+
+//Renderer definitions
+#define DEFAULT_TICK_DELAY 1000
+#define DEFAULT_FRAME_RATE 30
+#define SNAPSHOT_BUFFERS 3
+#define SNAPSHOT_FRESH 4
+#define FRAME_TIMINGS 64
+#define MAP_SEGMENTS 4
+
 //Argp vars
 const char *argp_program_version = "MetroSim v0.1b";
 const char *argp_program_bug_address = "<kyildirim14@ku.edu.tr>";
@@ -57,7 +104,40 @@ static char doc[] = "A simple metro simulation using pthreads to simulate lines.
 
 enum optioncodes{ 
 	OPT_TIME = 's',
-	OPT_PROB = 'p'
+	OPT_PROB = 'p',
+	OPT_HEADLESS = 'H',
+	OPT_ENGINE = 'e',
+	OPT_REPLICATIONS = 'r',
+	OPT_JOBS = 'j',
+	OPT_SEED = 'S',
+	OPT_LOG_FORMAT = 'L',
+	OPT_LOGDUMP = 'D',
+	OPT_TOPOLOGY = 'T',
+	OPT_WORKERS = 'w',
+	OPT_STATS = 'M',
+	OPT_STATS_INTERVAL = 0x100,
+	OPT_STATS_OVERLAY = 0x101,
+	OPT_RELEASE = 0x102,
+	OPT_ADMISSION = 0x103,
+	OPT_COMPARE_POLICIES = 0x104,
+	OPT_CHECKPOINT = 0x105,
+	OPT_CHECKPOINT_EVERY = 0x106,
+	OPT_RESUME = 0x107,
+	OPT_BREAKDOWN = 0x108,
+	OPT_WHAT_IF = 0x109,
+	OPT_WHAT_IF_AT = 0x10a,
+	OPT_WHAT_IF_HORIZON = 0x10b,
+	OPT_TRACE = 0x10c,
+	OPT_TRACE_CONVERT = 0x10d,
+	OPT_SERIES = 0x10e,
+	OPT_TICK_DELAY = 0x10f,
+	OPT_FPS = 0x110,
+	OPT_SWEEP = 0x111,
+	OPT_SWEEP_OUT = 0x112,
+	OPT_UNTIL = 0x113,
+	OPT_MAX_REPLICATIONS = 0x114,
+	OPT_ANTITHETIC = 0x115,
+	OPT_HISTORY = 0x116
 };
 
 static char args_doc[] = "TO-DO Implement";
@@ -65,7 +145,41 @@ static char args_doc[] = "TO-DO Implement";
 static struct argp_option options[] =
 {
 	{"time", OPT_TIME, "TIME", 0, "Simulation time in seconds."},
-	{"probability", OPT_PROB, "PROB", 0, "Probability of a train arriving in unit time."}
+	{"probability", OPT_PROB, "PROB", 0, "Probability of a train arriving in unit time."},
+	{"headless", OPT_HEADLESS, 0, 0, "Run without the ncurses interface and without tick pacing."},
+	{"engine", OPT_ENGINE, "ENGINE", 0, "Simulation engine, tick (default), des or regions. des and regions imply --headless."},
+	{"replications", OPT_REPLICATIONS, "N", 0, "Run N independent headless replications and report confidence intervals."},
+	{"until", OPT_UNTIL, "METRIC:HALF", 0, "Keep adding replications until the 95% confidence half-width of METRIC is at most HALF. METRIC is throughput, wait (mean wait), wait_p99, max_queue, blocked or utilisation. Works with --replications, which sets the first batch (default 10), and --compare-policies."},
+	{"max-replications", OPT_MAX_REPLICATIONS, "N", 0, "Most replications --until runs per policy, default 1000."},
+	{"antithetic", OPT_ANTITHETIC, 0, 0, "Run replications in antithetic pairs, the second run of a pair on the mirrored draws of the first."},
+	{"jobs", OPT_JOBS, "K", 0, "Number of replications or sweep points to run in parallel."},
+	{"stats", OPT_STATS, "FILE", 0, "Time the phases of every tick and write them to FILE in Prometheus text format."},
+	{"stats-interval", OPT_STATS_INTERVAL, "SECONDS", 0, "Seconds between --stats dumps, default 1. The file is also written when the run ends."},
+	{"stats-overlay", OPT_STATS_OVERLAY, 0, 0, "Time the phases of every tick and show their latencies over the console."},
+	{"release", OPT_RELEASE, "POLICY", 0, "Tunnel release policy: longest (default), oldest, weighted or lookahead[:N]."},
+	{"admission", OPT_ADMISSION, "POLICY", 0, "Admission policy: hysteresis[:HIGH[:LOW]] (default, the section's block threshold and 0) or cap:N trains per segment."},
+	{"compare-policies", OPT_COMPARE_POLICIES, "LIST", 0, "Run each RELEASE[/ADMISSION] policy in the comma separated LIST, or all, on the same seeds and rank them."},
+	{"checkpoint", OPT_CHECKPOINT, "FILE", 0, "Checkpoint file, written on SIGUSR1, on c in the ncurses interface and with --checkpoint-every. Defaults to HH:MM:SS-checkpoint.bin."},
+	{"checkpoint-every", OPT_CHECKPOINT_EVERY, "N", 0, "Write a checkpoint every N ticks."},
+	{"resume", OPT_RESUME, "FILE", 0, "Continue the run saved in a checkpoint. -p and -s override the saved values, --seed is ignored."},
+	{"breakdown", OPT_BREAKDOWN, "P", 0, "Probability that an arriving train is broken down, default 0.1."},
+	{"what-if", OPT_WHAT_IF, "LIST", 0, "Comma separated what-if branches, each a / separated list of p=P, release=POLICY, admission=POLICY and breakdown=P."},
+	{"what-if-at", OPT_WHAT_IF_AT, "TICK", 0, "Branch the what-ifs at TICK. They are also branched on SIGUSR2 and on w in the ncurses interface."},
+	{"what-if-horizon", OPT_WHAT_IF_HORIZON, "N", 0, "Ticks every what-if branch runs for, default 1000."},
+	{"trace", OPT_TRACE, "FILE", 0, "Replay the arrivals recorded in FILE, a binary trace or a tick,origin,destination,length,broken CSV, instead of drawing them."},
+	{"trace-convert", OPT_TRACE_CONVERT, "FILE", 0, "Write the --trace CSV to FILE as a binary trace for the current topology and exit."},
+	{"series", OPT_SERIES, "FILE", 0, "Write the queue lengths and tunnel state of every tick to FILE as a columnar binary time series."},
+	{"history", OPT_HISTORY, "FILE", 0, "Keep a 16 byte record of every train and write them to FILE when the run ends."},
+	{"tick-delay", OPT_TICK_DELAY, "MS", 0, "Milliseconds per tick in the ncurses interface, default 1000. 0 runs at full speed."},
+	{"fps", OPT_FPS, "N", 0, "Frame rate cap of the ncurses interface, default 30."},
+	{"sweep", OPT_SWEEP, "LIST", 0, "Run a headless grid of comma separated axes p=FROM:TO:STEP, breakdown=FROM:TO:STEP and block=FROM:TO[:STEP], the section block threshold. Points are run in parallel, one job per core unless --jobs is given."},
+	{"sweep-out", OPT_SWEEP_OUT, "FILE", 0, "Sweep results, one row per point, CSV or JSON lines when FILE ends in .json. Default sweep.csv. Points already in FILE are skipped, so an interrupted sweep resumes."},
+	{"workers", OPT_WORKERS, "N", 0, "Worker threads stepping the segments of a tick engine run, defaults to one per core (one per replication with --replications)."},
+	{"log-format", OPT_LOG_FORMAT, "FORMAT", 0, "Log format, text (default) or binary. Binary logs are written by a background thread."},
+	{"logdump", OPT_LOGDUMP, "FILE", 0, "Convert a binary event log back to the text train and control logs and exit."},
+	{"seed", OPT_SEED, "SEED", 0, "Seed for the random number streams, runs with the same seed are reproducible."},
+	{"topology", OPT_TOPOLOGY, "FILE", 0, "Network description to simulate instead of the built-in A/B/E/F map."},
+	{0}
 };
 
 //Global windows
@@ -73,383 +187,928 @@ WINDOW *metro_container;
 WINDOW *console_container;
 WINDOW *metro_window;
 WINDOW *console_window;
+WINDOW *stats_window;
 
 //Console vars
 int console_max_lines = NULL;
 char **console_lines = NULL;
 int *console_line_color = NULL;
+//Bumped on every console line, so the renderer knows when to repaint
+atomic_ullong console_version = 0;
 int console_line_counter = 0;
+int console_head = 0;
+time_t console_stamp_time = 0;
+char console_stamp[16] = "";
+
+/*
+ * Checkpoint file header. It is followed by one CheckpointSegment and its
+ * queued trains per segment, one CheckpointSection per section, the train
+ * statistics and, for the event engine, the pending events. The state is
+ * the one a run has before it simulates tick.
+ */
+struct CheckpointHeader{
+	char magic[8];
+	uint32_t version;
+	int32_t engine;
+	uint32_t segment_count;
+	uint32_t section_count;
+	uint32_t place_count;
+	uint32_t train_size;
+	uint64_t topology_hash;
+	uint64_t seed;
+	float probability;
+	int32_t simulation_time;
+	int32_t tick;
+	int32_t released_trains;
+	int32_t max_queue_length;
+	int32_t blocked_ticks;
+	int64_t busy_ticks;
+	int32_t event_count;
+	float breakdown;
+	//Policy as indexes into release_policies and admission_policies and their parameters
+	int32_t release;
+	int32_t admission;
+	int32_t lookahead;
+	int32_t high;
+	int32_t low;
+	int32_t cap;
+	//Arrival trace the segment cursors point into, both 0 for random arrivals
+	uint64_t trace_topology_hash;
+	uint64_t trace_records;
+};
 
-//Train struct
-struct Train{
-	int id;
-	int length;
-	int arrival_time;
-	int departure_time;
-	char origin;
-	char destination;
-	int broken;
+//Changes a what-if branch makes to the running simulation
+struct WhatIf{
+	char label[POLICY_NAME_LENGTH];
+	int set_probability;
+	float probability;
+	int set_breakdown;
+	float breakdown;
+	char release[POLICY_NAME_LENGTH/2];
+	char admission[POLICY_NAME_LENGTH/2];
 };
 
-//Train vars
-int train_counter = 1;
-int releasing_segment_id = -1;
-int *queue_status = NULL;
-pthread_mutex_t train_counter_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t probability_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
-int can_release = 1;
-int tunnel_ticks = 0;
+//Outcome of one branch over its horizon, sent back whole through a pipe
+struct BranchResult{
+	int32_t branch;
+	int32_t tick;
+	int32_t horizon;
+	int32_t released_trains;
+	int32_t waiting_trains;
+	int32_t max_queue_length;
+	int32_t blocked_ticks;
+	int32_t wait_p99;
+	double utilisation;
+};
+
+struct CheckpointSegment{
+	uint64_t rng[4];
+	uint64_t mirror;
+	uint64_t trace_next;
+	int32_t arrivals;
+	int32_t queue_count;
+};
+
+struct CheckpointSection{
+	int32_t releasing_segment_id;
+	int32_t can_release;
+	int32_t tunnel_ticks;
+	int32_t allow_trains;
+	int32_t blocked_since;
+	int32_t released_trains;
+	int32_t blocked_ticks;
+	struct Train train_in_tunnel;
+};
+
+//Per segment and per section state shown by the ncurses interface
+struct SegmentView{
+	int count;
+	uint32_t leader;
+	int color;
+};
+
+struct SectionView{
+	uint32_t train;
+	int origin;
+	int destination;
+	int can_release;
+	int releasing_segment_id;
+};
+
+//Display state of one tick, written by the controller and read by the renderer
+struct Snapshot{
+	int tick;
+	int container_color;
+	struct SegmentView *segments;
+	struct SectionView *sections;
+	//Phase latencies, only filled when the renderer asked for them
+	int has_stats;
+	uint64_t p50[PHASE_COUNT];
+	uint64_t p99[PHASE_COUNT];
+};
+
+//Map and console repaint time of one frame, 0 for parts not repainted
+struct FrameTiming{
+	uint64_t draw;
+	uint64_t console;
+};
+
+/*
+ * Triple buffer between the controller and the renderer thread. The
+ * controller fills buffers[back] and swaps it into middle, the renderer
+ * swaps front with middle when SNAPSHOT_FRESH is set. Neither side ever
+ * waits and the renderer always draws the newest complete tick. shown is a
+ * copy of the last snapshot drawn, so a frame repaints only what changed.
+ */
+struct Renderer{
+	struct Snapshot buffers[SNAPSHOT_BUFFERS];
+	int back;
+	atomic_int middle;
+	int front;
+	struct Snapshot shown;
+	time_t shown_time;
+	unsigned long long console_shown;
+	uint64_t p50[PHASE_COUNT];
+	uint64_t p99[PHASE_COUNT];
+	struct Histogram *merged;
+	atomic_int stats_wanted;
+	//Frame timings go back to the controller, which owns the phase histograms
+	struct FrameTiming timings[FRAME_TIMINGS];
+	atomic_uint timing_head;
+	atomic_uint timing_tail;
+	uint64_t pace;
+	atomic_int stop;
+	pthread_t thread;
+};
 
 //Simulation vars
 float probability = 0.5f;
 int simulation_time = 10;
-int queue_count = 4;
-int tick = 0;
-time_t raw_time = NULL;
-struct tm *time_data = NULL;
-pthread_barrier_t tick_barrier;
-pthread_barrier_t main_barrier;
-pthread_t threads[4];
-pthread_mutex_t queue_count_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t tunnel_tick_mutex = PTHREAD_MUTEX_INITIALIZER;
-struct Train queue_leaders[4];
-pthread_mutex_t queue_leader_mutex = PTHREAD_MUTEX_INITIALIZER;
-struct Train train_in_tunnel;
-int total_trains = 0;
-int allow_trains = 1;
+int engine = ENGINE_TICK;
+int workers = 0;
+float breakdown = BROKEN_PROBABILITY;
+//Decision policies of new runs, set by --release and --admission
+struct Policy policy = {"longest/hysteresis", &release_policies[0], &admission_policies[0], DEFAULT_LOOKAHEAD, 0, 0, 0};
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+int headless = 0;
+int replications = 0;
+int jobs = 1;
+int jobs_set = 0;
+uint64_t seed = 0;
+int seed_set = 0;
+int binary_log = 0;
+char *logdump_file = NULL;
+char *topology_file = NULL;
+char *stats_file = NULL;
+double stats_interval = 1.0;
+int stats_overlay = 0;
+char *compare_policies = NULL;
+char *checkpoint_file = NULL;
+int checkpoint_every = 0;
+char *resume_file = NULL;
+int probability_set = 0;
+int simulation_time_set = 0;
+int breakdown_set = 0;
+int release_set = 0;
+int admission_set = 0;
+//Set from signal handlers and the renderer thread
+atomic_int checkpoint_requested = 0;
+char *trace_file = NULL;
+char *series_file = NULL;
+char *history_file = NULL;
+char *trace_convert_file = NULL;
+int until_metric = -1;
+double until_half_width = 0;
+int max_replications = DEFAULT_MAX_REPLICATIONS;
+int antithetic = 0;
+char *sweep_spec = NULL;
+char *sweep_file = "sweep.csv";
+int sweep_json = 0;
+
+//What-if branches, spawned from display_sim and reported when they finish
+struct WhatIf what_ifs[WHAT_IF_MAX];
+int what_if_count = 0;
+int what_if_at = -1;
+int what_if_horizon = DEFAULT_WHAT_IF_HORIZON;
+atomic_int branch_requested = 0;
+int branch_pipe = -1;
+int branch_write_pipe = -1;
+int branches_pending = 0;
+struct BranchResult *branch_results = NULL;
+int branch_result_count = 0;
+
+//Simulation shown by the ncurses interface
+struct Simulation *display_sim = NULL;
 
 //Map vars
-int *segment_colors = NULL;
 int tunnel_color = 1;
-char segment_names[4] = {'A', 'B', 'E', 'F'};
 
-//Logging vars
-FILE *train_log;
-FILE *control_log;
-pthread_mutex_t log_train_mutex = PTHREAD_MUTEX_INITIALIZER;
+//ncurses interface pacing and the thread drawing it
+int tick_delay = DEFAULT_TICK_DELAY;
+int frame_rate = DEFAULT_FRAME_RATE;
+struct Renderer *renderer = NULL;
+atomic_int resize_requested = 0;
 
-void log_control(const char *format, ...){
-	va_list args;
-	va_start(args, format);
-	vfprintf(control_log, format, args);
-	va_end(args);
-}
+void log_console(int color, const char *format, ...);
 
-void log_train(const char *format, ...){
-	pthread_mutex_lock(&log_train_mutex);
-	va_list args;
-	va_start(args, format);
-	vfprintf(train_log, format, args);
-	va_end(args);
-	pthread_mutex_unlock(&log_train_mutex);
+void recolor_lanes(struct Simulation *sim, struct SegmentView *segments){
+	int min = sim->simulation_time;
+	int max = 0;
+	for(int i = 0; i<queue_count; i++){
+		if(sim->queue_status[i]>max)max=sim->queue_status[i];
+		if(sim->queue_status[i]<min)min=sim->queue_status[i];
+	}
+	for(int i = 0; i<queue_count; i++){
+		if(sim->queue_status[i]==max){
+			segments[i].color=RED_BLACK;
+		}else if(sim->queue_status[i]==min){
+			segments[i].color=GREEN_BLACK;
+		}else{
+			segments[i].color=YELLOW_BLACK;
+		}
+		if(min==max)segments[i].color=YELLOW_BLACK;
+		if(max==0)segments[i].color=GREEN_BLACK;
+	}
 }
 
-int get_train_id(){
-	int id = -1;
-	pthread_mutex_lock(&train_counter_mutex);
-	id = train_counter;
-	train_counter++;
-	pthread_mutex_unlock(&train_counter_mutex);
-	return id;
+//Periodic dump for --stats, only the displayed run writes the file, the first one interval after the start
+void stats_maybe_write(struct Simulation *sim){
+	if(stats_file==NULL||sim!=display_sim)return;
+	uint64_t now = now_ns();
+	if(sim->stats_next_dump==0)sim->stats_next_dump = now+(uint64_t)(stats_interval*1e9);
+	if(now<sim->stats_next_dump)return;
+	sim->stats_next_dump = now+(uint64_t)(stats_interval*1e9);
+	stats_write(sim, stats_file);
 }
 
-int get_probability(float p){
-	int r = 0;
-	pthread_mutex_lock(&probability_mutex);
-	float random = (float)rand() / (float)RAND_MAX;
-	if(random<=p)r=1;
-	pthread_mutex_unlock(&probability_mutex);
-	return r;
+//Parameters of a run, the rest comes from the command line
+struct SimParams run_params(float p, int s, uint64_t run_seed){
+	struct SimParams params = {p, s, run_seed, breakdown, policy, engine, workers};
+	return params;
 }
 
-void recolor_lanes(){
-	int min = simulation_time;
-	int max = 0;
-	for(int i = 0; i<queue_count; i++){
-		if(queue_status[i]>max)max=queue_status[i];
-		if(queue_status[i]<min)min=queue_status[i];
+/*
+ * Saves everything a run needs to continue from tick: segment queues and
+ * RNG streams, section and tunnel state, counters, train statistics and the
+ * event calendar. Only called between ticks, while no worker is stepping.
+ * Written to a temporary file and renamed, so a reader never sees half a
+ * checkpoint.
+ */
+int checkpoint_write(struct Simulation *sim, const char *path, int tick){
+	size_t length = strlen(path)+5;
+	char *temporary = malloc(length);
+	snprintf(temporary, length, "%s.tmp", path);
+	FILE *out = fopen(temporary, "wb");
+	if(out==NULL){
+		free(temporary);
+		return LOG_OPEN_ERR;
+	}
+	struct CheckpointHeader header = {0};
+	memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+	header.version = CHECKPOINT_VERSION;
+	header.engine = sim->engine;
+	header.segment_count = topology->segment_count;
+	header.section_count = topology->section_count;
+	header.place_count = topology->place_count;
+	header.train_size = sizeof(struct Train);
+	header.topology_hash = topology_hash();
+	header.seed = sim->seed;
+	header.probability = sim->probability;
+	header.simulation_time = sim->simulation_time;
+	header.tick = tick;
+	header.released_trains = sim->released_trains;
+	header.max_queue_length = sim->max_queue_length;
+	header.blocked_ticks = sim->blocked_ticks;
+	header.busy_ticks = sim->busy_ticks;
+	header.event_count = (sim->engine==ENGINE_DES)?sim->event_count:0;
+	header.breakdown = sim->breakdown;
+	header.release = sim->policy.release-release_policies;
+	header.admission = sim->policy.admission-admission_policies;
+	header.lookahead = sim->policy.lookahead;
+	header.high = sim->policy.high;
+	header.low = sim->policy.low;
+	header.cap = sim->policy.cap;
+	if(arrival_trace!=NULL){
+		const struct TraceHeader *trace = arrival_trace->data;
+		header.trace_topology_hash = trace->topology_hash;
+		header.trace_records = trace->record_count;
 	}
+	fwrite(&header, sizeof(header), 1, out);
 	for(int i = 0; i<queue_count; i++){
-		if(queue_status[i]==max){
-			segment_colors[i]=RED_BLACK;
-		}else if(queue_status[i]==min){
-			segment_colors[i]=GREEN_BLACK;
+		struct SegmentSlot *slot = &sim->slots[i];
+		struct CheckpointSegment segment;
+		memcpy(segment.rng, slot->rng.s, sizeof(segment.rng));
+		segment.mirror = slot->rng.mirror;
+		segment.trace_next = slot->trace_next;
+		segment.arrivals = slot->arrivals;
+		segment.queue_count = slot->queue.count;
+		fwrite(&segment, sizeof(segment), 1, out);
+		for(int k = 0; k<slot->queue.count; k++)fwrite(queue_at(&slot->queue, k), sizeof(struct Train), 1, out);
+	}
+	for(int s = 0; s<topology->section_count; s++){
+		struct Section *section = &sim->sections[s];
+		struct CheckpointSection saved = {section->releasing_segment_id, section->can_release, section->tunnel_ticks, section->allow_trains, section->blocked_since, section->released_trains, section->blocked_ticks, section->train_in_tunnel};
+		fwrite(&saved, sizeof(saved), 1, out);
+	}
+	struct TrainStats *stats = &sim->train_stats;
+	fwrite(&stats->wait, sizeof(struct DelayHistogram), 1, out);
+	fwrite(&stats->tunnel, sizeof(struct DelayHistogram), 1, out);
+	fwrite(stats->wait_by_origin, sizeof(struct DelayHistogram), queue_count, out);
+	fwrite(stats->tunnel_by_origin, sizeof(struct DelayHistogram), queue_count, out);
+	fwrite(stats->wait_by_destination, sizeof(struct DelayHistogram), topology->place_count, out);
+	fwrite(stats->tunnel_by_destination, sizeof(struct DelayHistogram), topology->place_count, out);
+	if(header.event_count>0)fwrite(sim->event_heap, sizeof(struct Event), header.event_count, out);
+	int failed = ferror(out);
+	if(fclose(out)!=0)failed = 1;
+	if(failed||rename(temporary, path)!=0){
+		remove(temporary);
+		free(temporary);
+		return LOG_OPEN_ERR;
+	}
+	free(temporary);
+	return 0;
+}
+
+void checkpoint_signal_handler(int signal){
+	checkpoint_requested = 1;
+}
+
+//Writes a checkpoint of display_sim when asked to or when one is due, tick is the next tick to simulate
+void checkpoint_maybe_write(struct Simulation *sim, int tick){
+	if(sim!=display_sim||checkpoint_file==NULL)return;
+	if(checkpoint_every>0&&sim->next_checkpoint==0)sim->next_checkpoint = (tick/checkpoint_every+1)*checkpoint_every;
+	int due = (checkpoint_every>0&&tick>=sim->next_checkpoint);
+	if(!checkpoint_requested&&!due)return;
+	checkpoint_requested = 0;
+	if(due)sim->next_checkpoint = (tick/checkpoint_every+1)*checkpoint_every;
+	if(checkpoint_write(sim, checkpoint_file, tick)!=0){
+		log_console(RED_BLACK, "[CHECKPOINT] Cannot write %s.", checkpoint_file);
+		if(headless)fprintf(stderr, "Cannot write checkpoint %s\n", checkpoint_file);
+		return;
+	}
+	log_console(GREEN_BLACK, "[CHECKPOINT] Saved tick %d to %s.", tick, checkpoint_file);
+}
+
+//Parses a / separated what-if branch into w, 0 on success. Modifies spec.
+int parse_what_if(char *spec, struct WhatIf *w){
+	memset(w, 0, sizeof(*w));
+	snprintf(w->label, sizeof(w->label), "%s", spec);
+	struct Policy check = policy;
+	for(char *save, *change = strtok_r(spec, "/", &save); change!=NULL; change = strtok_r(NULL, "/", &save)){
+		char *value = strchr(change, '=');
+		if(value==NULL)return -1;
+		*value++ = '\0';
+		char *end;
+		if(strcmp(change, "p")==0){
+			w->probability = strtof(value, &end);
+			if(*end!='\0'||w->probability<0||w->probability>1)return -1;
+			w->set_probability = 1;
+		}else if(strcmp(change, "breakdown")==0){
+			w->breakdown = strtof(value, &end);
+			if(*end!='\0'||w->breakdown<0||w->breakdown>1)return -1;
+			w->set_breakdown = 1;
+		}else if(strcmp(change, "release")==0){
+			if(parse_release(value, &check)!=0)return -1;
+			snprintf(w->release, sizeof(w->release), "%s", value);
+		}else if(strcmp(change, "admission")==0){
+			if(parse_admission(value, &check)!=0)return -1;
+			snprintf(w->admission, sizeof(w->admission), "%s", value);
 		}else{
-			segment_colors[i]=YELLOW_BLACK;
+			return -1;
 		}
-		if(min==max)segment_colors[i]=YELLOW_BLACK;
-		if(max==0)segment_colors[i]=GREEN_BLACK;
 	}
+	return 0;
 }
 
-void decide_releasing_queue(){
-	if(can_release!=1)return;
-	pthread_mutex_lock(&queue_count_mutex);
-	int max_queue=-1;
-	int max_count=0;
-	for(int i = 0; i<queue_count; i++){
-		if(queue_status[i]>max_count){
-			max_queue=i;
-			max_count=queue_status[i];
-		}
+void branch_signal_handler(int signal){
+	branch_requested = 1;
+}
+
+/*
+ * Runs in a forked child: applies the branch's changes to its copy of the
+ * simulation, runs it headless and unlogged for the horizon on a single
+ * worker and sends the outcome back. Only the forking thread exists in the
+ * child, so it never returns into the parent's worker loop.
+ */
+void branch_child(struct Simulation *sim, int branch, int tick, int fd){
+	headless = 1;
+	display_sim = NULL;
+	thread_stats = NULL;
+	sim->worker_limit = 1;
+	sim->decided = NULL;
+	sim->advanced = NULL;
+	sim->console = NULL;
+	sim->timing = 0;
+	//The parent owns the log files and the log writer thread
+	sim->train_log = NULL;
+	sim->control_log = NULL;
+	sim->event_log = NULL;
+	sim->series = NULL;
+	if(branch>0){
+		struct WhatIf *w = &what_ifs[branch-1];
+		if(w->set_probability)sim->probability = w->probability;
+		if(w->set_breakdown)sim->breakdown = w->breakdown;
+		if(w->release[0]!='\0')parse_release(w->release, &sim->policy);
+		if(w->admission[0]!='\0')parse_admission(w->admission, &sim->policy);
 	}
-	releasing_segment_id = max_queue;
-	pthread_mutex_unlock(&queue_count_mutex);
+	//Only the branch's own trains and ticks count
+	int released = sim->released_trains;
+	int blocked = sim->blocked_ticks;
+	long long busy = sim->busy_ticks;
+	memset(&sim->train_stats.wait, 0, sizeof(struct DelayHistogram));
+	sim->max_queue_length = 0;
+	sim->simulation_time = tick+what_if_horizon-1;
+	sim->finished = 0;
+	sim->started = 1;
+	run_simulation(sim);
+	struct BranchResult result = {branch, tick, what_if_horizon};
+	result.released_trains = sim->released_trains-released;
+	result.waiting_trains = count_trains(sim);
+	result.max_queue_length = sim->max_queue_length;
+	result.blocked_ticks = sim->blocked_ticks-blocked;
+	result.wait_p99 = delay_quantile(&sim->train_stats.wait, 0.99);
+	result.utilisation = (double)(sim->busy_ticks-busy)/((double)topology->section_count*what_if_horizon);
+	//Below PIPE_BUF, so results of concurrent branches never interleave
+	if(write(fd, &result, sizeof(result))!=sizeof(result))_exit(1);
+	_exit(0);
 }
 
-void update_tunnel_tick(int update){
-	pthread_mutex_lock(&tunnel_tick_mutex);
-	tunnel_ticks+=update;
-	if(tunnel_ticks<=0){
-		can_release=1;
-		train_in_tunnel.id=NULL;
+/*
+ * Forks the unchanged run and every what-if branch from the state before
+ * tick. Children share the parent's memory copy-on-write and run in
+ * parallel while the parent carries on.
+ */
+void branch_spawn(struct Simulation *sim, int tick){
+	if(branch_pipe==-1){
+		int fds[2];
+		if(pipe(fds)!=0){
+			log_console(RED_BLACK, "[WHAT-IF] Cannot create the branch pipe.");
+			return;
+		}
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		branch_pipe = fds[0];
+		branch_write_pipe = fds[1];
+	}
+	for(int b = 0; b<=what_if_count; b++){
+		pid_t pid = fork();
+		if(pid==0){
+			close(branch_pipe);
+			branch_child(sim, b, tick, branch_write_pipe);
+		}
+		if(pid<0){
+			log_console(RED_BLACK, "[WHAT-IF] Cannot fork branch %d.", b);
+			continue;
+		}
+		branches_pending++;
 	}
-	pthread_mutex_unlock(&tunnel_tick_mutex);
+	log_console(GREEN_BLACK, "[WHAT-IF] Branched %d runs at tick %d for %d ticks.", what_if_count+1, tick, what_if_horizon);
 }
 
-int get_tunnel_ticks(){
-	pthread_mutex_lock(&tunnel_tick_mutex);
-	int rvalue = tunnel_ticks;
-	pthread_mutex_unlock(&tunnel_tick_mutex);
-	return rvalue;
+//Label of a branch, branch 0 is the run as it is
+const char *branch_label(int branch){
+	return branch==0?"as is":what_ifs[branch-1].label;
 }
 
-void update_queue_leader(int segment_id, struct Train t){
-	pthread_mutex_lock(&queue_leader_mutex);
-	queue_leaders[segment_id] = t;
-	pthread_mutex_unlock(&queue_leader_mutex);
+void log_branch_result(struct BranchResult *r){
+	log_console(YELLOW_BLACK, "[WHAT-IF] %s from tick %d: %.4f trains/tick, wait p99 %d, max queue %d, blocked %d, %d waiting.", branch_label(r->branch), r->tick, (double)r->released_trains/r->horizon, r->wait_p99, r->max_queue_length, r->blocked_ticks, r->waiting_trains);
 }
 
-void update_queues(int segment_id, int queued_count){
-	pthread_mutex_lock(&queue_count_mutex);
-	queue_status[segment_id] = queued_count;
-	pthread_mutex_unlock(&queue_count_mutex);
+//Reads finished branches, with block set waits for every branch still running
+void branch_collect(int block){
+	if(branch_pipe==-1)return;
+	if(block){
+		//With the write end closed, reads end once every child has exited
+		close(branch_write_pipe);
+		fcntl(branch_pipe, F_SETFL, 0);
+	}
+	while(branches_pending>0){
+		struct BranchResult result;
+		ssize_t n = read(branch_pipe, &result, sizeof(result));
+		if(n<0&&errno==EINTR)continue;
+		if(n!=sizeof(result))break;
+		branches_pending--;
+		branch_results = realloc(branch_results, (branch_result_count+1)*sizeof(struct BranchResult));
+		branch_results[branch_result_count++] = result;
+		log_branch_result(&result);
+	}
+	while(waitpid(-1, NULL, WNOHANG)>0);
+	if(block){
+		close(branch_pipe);
+		branch_pipe = -1;
+		branch_write_pipe = -1;
+		branches_pending = 0;
+	}
 }
 
-int count_trains(){
-	int count = 0;
-	for(int i = 0; i<queue_count; i++){
-		count+=queue_status[i];
+/*
+ * Branches display_sim when the what-ifs are due, tick is the next tick to
+ * simulate. The event engine skips quiet ticks, so --what-if-at fires on
+ * the first tick at or past it and only once.
+ */
+void branch_maybe_spawn(struct Simulation *sim, int tick){
+	if(sim!=display_sim||what_if_count==0)return;
+	if(branch_requested||(what_if_at>=0&&tick>=what_if_at)){
+		branch_requested = 0;
+		if(what_if_at>=0&&tick>=what_if_at)what_if_at = -1;
+		branch_spawn(sim, tick);
 	}
-	return count;
+	branch_collect(0);
 }
 
-void *segment_handler(int segment_id){
+//Advanced hook of display_sim, tick is the next tick to simulate
+void display_advanced(struct Simulation *sim, int tick){
+	checkpoint_maybe_write(sim, tick);
+	branch_maybe_spawn(sim, tick);
+	//Phase timings are only stable here with timing on
+	if(thread_stats!=NULL)stats_maybe_write(sim);
+}
 
-	//Initialize segment
-	struct Train *queue = malloc(simulation_time*sizeof(struct Train));
-	int queue_counter = 0;
-	float p = probability;
-	//Exception for B
-	if(segment_id==1)p=1-p;
+//Whether a saved train only refers to segments and places of the network
+int checkpoint_train_valid(const struct Train *t){
+	return t->origin<queue_count&&t->destination<topology->place_count;
+}
 
-	for(;;){
-		if(releasing_segment_id==segment_id){
-			struct Train t;
-			t=queue[0];
-			char message[COLS-2];
-			snprintf(message, COLS-2, "[SEGMENT %c] Released train with ID %04d.", segment_names[segment_id], t.id);
-			log_console(GREEN_BLACK, message);
-			queue_counter--;
-			train_in_tunnel = t;
-			printf("%d", t.length+1+(4*t.broken));
-			update_tunnel_tick(t.length+1+1+(4*t.broken));
-			can_release=(t.broken==1)?RED_BLACK:YELLOW_BLACK;
-			memmove(&queue[0], &queue[1], queue_counter*sizeof(struct Train));
-		}
-		if(1==get_probability(p)&&allow_trains==1){
+/*
+ * Builds a simulation from a checkpoint of the same network and engine.
+ * The run continues with the saved parameters unless -p, -s, --breakdown,
+ * --release or --admission were given.
+ * Returns NULL after printing the reason when the file does not fit.
+ */
+struct Simulation *checkpoint_restore(const char *path){
+	FILE *in = fopen(path, "rb");
+	if(in==NULL){
+		printf("Cannot open checkpoint %s\n", path);
+		return NULL;
+	}
+	struct CheckpointHeader header;
+	if(fread(&header, sizeof(header), 1, in)!=1||memcmp(header.magic, CHECKPOINT_MAGIC, 8)!=0||header.version!=CHECKPOINT_VERSION||header.train_size!=sizeof(struct Train)||
+		header.engine<0||header.engine>=ENGINES||header.release<0||header.release>=RELEASE_POLICIES||header.admission<0||header.admission>=ADMISSION_POLICIES){
+		printf("%s is not a MetroSim checkpoint\n", path);
+		fclose(in);
+		return NULL;
+	}
+	if(header.segment_count!=topology->segment_count||header.section_count!=topology->section_count||header.place_count!=topology->place_count||header.topology_hash!=topology_hash()){
+		printf("%s was saved on a different network\n", path);
+		fclose(in);
+		return NULL;
+	}
+	uint64_t trace_topology_hash = 0, trace_records = 0;
+	if(arrival_trace!=NULL){
+		const struct TraceHeader *trace = arrival_trace->data;
+		trace_topology_hash = trace->topology_hash;
+		trace_records = trace->record_count;
+	}
+	if(header.trace_topology_hash!=trace_topology_hash||header.trace_records!=trace_records){
+		if(header.trace_topology_hash==0)printf("%s was saved without an arrival trace\n", path);
+		else if(trace_topology_hash==0)printf("%s was saved with an arrival trace, resume it with --trace\n", path);
+		else printf("%s was saved with a different arrival trace\n", path);
+		fclose(in);
+		return NULL;
+	}
+	if(header.engine!=engine){
+		printf("%s was saved by the %s engine\n", path, engine_names[header.engine]);
+		fclose(in);
+		return NULL;
+	}
+	if(!probability_set)probability = header.probability;
+	if(!simulation_time_set)simulation_time = header.simulation_time;
+	if(!breakdown_set)breakdown = header.breakdown;
+	if(!release_set){
+		policy.release = &release_policies[header.release];
+		policy.lookahead = header.lookahead;
+	}
+	if(!admission_set){
+		policy.admission = &admission_policies[header.admission];
+		policy.high = header.high;
+		policy.low = header.low;
+		policy.cap = header.cap;
+	}
+	policy_name(&policy);
+	if(simulation_time<header.tick){
+		printf("%s is at tick %d, past the end of a %d tick run\n", path, header.tick, simulation_time);
+		fclose(in);
+		return NULL;
+	}
+	seed = header.seed;
+
+	struct SimParams params = run_params(probability, simulation_time, seed);
+	struct Simulation *sim = sim_create(&params);
+	sim->tick = header.tick;
+	sim->released_trains = header.released_trains;
+	sim->max_queue_length = header.max_queue_length;
+	sim->blocked_ticks = header.blocked_ticks;
+	sim->busy_ticks = header.busy_ticks;
+	sim->started = 1;
+	//Every saved index is checked as it is read, a damaged file must not write out of bounds
+	int complete = 1;
+	int valid = 1;
+	for(int i = 0; i<queue_count&&complete&&valid; i++){
+		struct SegmentSlot *slot = &sim->slots[i];
+		struct CheckpointSegment segment;
+		if(fread(&segment, sizeof(segment), 1, in)!=1){
+			complete = 0;
+			break;
+		}
+		if(segment.queue_count<0||segment.arrivals<0||(arrival_trace!=NULL&&(segment.trace_next<arrival_trace->offsets[i]||segment.trace_next>arrival_trace->offsets[i+1]))){
+			valid = 0;
+			break;
+		}
+		memcpy(slot->rng.s, segment.rng, sizeof(segment.rng));
+		slot->rng.mirror = segment.mirror;
+		slot->trace_next = segment.trace_next;
+		slot->arrivals = segment.arrivals;
+		for(int k = 0; k<segment.queue_count; k++){
 			struct Train t;
-			t.id = get_train_id();
-			t.origin = segment_names[segment_id];
-			t.length = 1+get_probability(0.3f);
-			t.broken = get_probability(0.1f);
-			t.destination = segment_names[(segment_id/2+(2+get_probability(0.5f)))%4];
-			t.arrival_time = tick;
-			queue[queue_counter]=t;
-			queue_counter++;
+			if(fread(&t, sizeof(t), 1, in)!=1){
+				complete = 0;
+				break;
+			}
+			if(!checkpoint_train_valid(&t)){
+				valid = 0;
+				break;
+			}
+			queue_push(&slot->queue, &t);
 		}
-		update_queues(segment_id, queue_counter);
-		update_queue_leader(segment_id, queue[0]);//Optimize this
-		char message[COLS-2];
-		snprintf(message, COLS-2, "[SEGMENT %c] %d trains in queue.", segment_names[segment_id], queue_counter);
-		log_console(GREEN_BLACK, message);
-		pthread_barrier_wait(&tick_barrier);
-		pthread_barrier_wait(&main_barrier);
+		//Controller and segment views start out in agreement
+		slot->leader = queue_front(&slot->queue);
+		atomic_store_explicit(&slot->queue_count, slot->queue.count, memory_order_relaxed);
+		sim->queue_status[i] = slot->queue.count;
+		sim->queue_leaders[i] = slot->leader;
 	}
-
+	for(int s = 0; s<topology->section_count&&complete&&valid; s++){
+		struct Section *section = &sim->sections[s];
+		struct CheckpointSection saved;
+		if(fread(&saved, sizeof(saved), 1, in)!=1){
+			complete = 0;
+			break;
+		}
+		int releasing = saved.releasing_segment_id;
+		if((releasing!=-1&&(releasing<0||releasing>=queue_count||topology->segment_section[releasing]!=s))||!checkpoint_train_valid(&saved.train_in_tunnel)){
+			valid = 0;
+			break;
+		}
+		section->releasing_segment_id = saved.releasing_segment_id;
+		section->can_release = saved.can_release;
+		section->tunnel_ticks = saved.tunnel_ticks;
+		section->allow_trains = saved.allow_trains;
+		section->blocked_since = saved.blocked_since;
+		section->released_trains = saved.released_trains;
+		section->blocked_ticks = saved.blocked_ticks;
+		section->train_in_tunnel = saved.train_in_tunnel;
+		publish_control(section, 0);
+	}
+	struct TrainStats *stats = &sim->train_stats;
+	if(complete&&valid){
+		complete = fread(&stats->wait, sizeof(struct DelayHistogram), 1, in)==1&&
+			fread(&stats->tunnel, sizeof(struct DelayHistogram), 1, in)==1&&
+			fread(stats->wait_by_origin, sizeof(struct DelayHistogram), queue_count, in)==(size_t)queue_count&&
+			fread(stats->tunnel_by_origin, sizeof(struct DelayHistogram), queue_count, in)==(size_t)queue_count&&
+			fread(stats->wait_by_destination, sizeof(struct DelayHistogram), topology->place_count, in)==(size_t)topology->place_count&&
+			fread(stats->tunnel_by_destination, sizeof(struct DelayHistogram), topology->place_count, in)==(size_t)topology->place_count;
+	}
+	for(int e = 0; e<header.event_count&&complete&&valid; e++){
+		struct Event event;
+		if(fread(&event, sizeof(event), 1, in)!=1){
+			complete = 0;
+			break;
+		}
+		//Tunnel clears name a section, the other events a segment
+		int targets = event.type==EV_TUNNEL_CLEAR?topology->section_count:queue_count;
+		if(event.type<EV_TUNNEL_CLEAR||event.type>EV_ARRIVAL||event.segment_id<0||event.segment_id>=targets||event.tick<header.tick){
+			valid = 0;
+			break;
+		}
+		event_push(sim, event.tick, event.type, event.segment_id);
+	}
+	fclose(in);
+	if(!valid){
+		printf("%s is not a MetroSim checkpoint\n", path);
+		sim_destroy(sim);
+		return NULL;
+	}
+	if(!complete){
+		printf("%s is truncated\n", path);
+		sim_destroy(sim);
+		return NULL;
+	}
+	return sim;
 }
 
-void log_console(int color, char *message){
+//Adds a line to the console ring, the renderer repaints on the version bump
+void console_append(int color, const char *message){
+	//No console in headless mode
+	if(headless)return;
+	time_t now = time(NULL);
 	pthread_mutex_lock(&log_mutex);
-	time(&raw_time);
-	time_data = localtime(&raw_time);
-	char line[COLS-2];
-	snprintf(line, COLS-2, "[%02d:%02d:%02d]%s",time_data->tm_hour,time_data->tm_min,time_data->tm_sec,message);
-	message = line;
+	//Timestamp is formatted once per second
+	if(now!=console_stamp_time){
+		struct tm stamp;
+		localtime_r(&now, &stamp);
+		snprintf(console_stamp, sizeof(console_stamp), "[%02d:%02d:%02d]", stamp.tm_hour, stamp.tm_min, stamp.tm_sec);
+		console_stamp_time = now;
+	}
+	//Overwrite the oldest line once the ring is full
+	int slot;
 	if(console_line_counter<console_max_lines){
-		memcpy(console_lines[console_line_counter], message, COLS-2);
-		//console_lines[console_line_counter]=message;
-		memcpy(&console_line_color[console_line_counter], &color, sizeof(int));
-		//console_line_color[console_line_counter]=color;
+		slot = (console_head+console_line_counter)%console_max_lines;
 		console_line_counter++;
 	}else{
-		int i = 0;
-		for(i; i<console_max_lines-1; i++){
-			memcpy(console_lines[i], console_lines[i+1], COLS-2);
-			//console_lines[i]=console_lines[i+1];
-			memcpy(&console_line_color[i], &console_line_color[i+1], sizeof(int));
-			//console_line_color[i]=console_line_color[i+1];
-			//memmove(&console_line_color[0], &console_line_color[1], (console_max_lines-1)*sizeof(int));
-		}
-		memcpy(console_lines[console_max_lines-1], message, COLS-2);
-		//console_lines[console_max_lines]=message;
-		memcpy(&console_line_color[console_max_lines-1], &color, sizeof(int));
-		//console_line_color[console_max_lines]=color;
+		slot = console_head;
+		console_head = (console_head+1)%console_max_lines;
 	}
+	snprintf(console_lines[slot], COLS-2, "%s%s", console_stamp, message);
+	console_line_color[slot] = color;
+	atomic_fetch_add_explicit(&console_version, 1, memory_order_relaxed);
 	pthread_mutex_unlock(&log_mutex);
 }
 
-void print_time(){
-	time(&raw_time);
-	time_data = localtime(&raw_time);
+void log_console(int color, const char *format, ...){
+	if(headless)return;
+	char message[COLS-2];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, COLS-2, format, args);
+	va_end(args);
+	console_append(color, message);
+}
+
+//Console hook of display_sim, lines come from the workers and the controller
+void console_hook(int color, const char *line, void *user){
+	console_append(color, line);
+}
+
+void print_time(int tick){
+	time_t now = time(NULL);
+	struct tm local;
+	localtime_r(&now, &local);
 	wmove(metro_container, METRO_LINES+1,2);
-	wprintw(metro_container, "Current time: %02d:%02d:%02d Tick: %d",time_data->tm_hour,time_data->tm_min,time_data->tm_sec,tick);
-	wrefresh(metro_container);
+	wprintw(metro_container, "Current time: %02d:%02d:%02d Tick: %d",local.tm_hour,local.tm_min,local.tm_sec,tick);
+	wnoutrefresh(metro_container);
 }
 
+//Erased rather than cleared, so the terminal only gets the changed cells
 void print_console(){
-	wclear(console_window);
-	int i = 0;
-	for(i;i<console_max_lines;i++){
+	pthread_mutex_lock(&log_mutex);
+	werase(console_window);
+	//Oldest line first, starting at the head of the ring
+	for(int i = 0; i<console_line_counter; i++){
+		int slot = (console_head+i)%console_max_lines;
 		wmove(console_window,i,0);
-		wattron(console_window, COLOR_PAIR(console_line_color[i]));
-		wprintw(console_window, "%s", console_lines[i]);
+		wattron(console_window, COLOR_PAIR(console_line_color[slot]));
+		wprintw(console_window, "%s", console_lines[slot]);
 	}
-	wrefresh(console_window);
+	wnoutrefresh(console_window);
+	pthread_mutex_unlock(&log_mutex);
 }
 
-void draw_map(int *colors){
+/*
+ * List view for loaded topologies, a section line followed by its segments.
+ * Without old every row is drawn, otherwise only the rows that changed.
+ */
+void draw_network(const struct Snapshot *snapshot, const struct Snapshot *old){
+	int row = 0;
+	for(int s = 0; s<topology->section_count&&row<METRO_LINES; s++){
+		const struct SectionView *section = &snapshot->sections[s];
+		int changed = old==NULL||memcmp(section, &old->sections[s], sizeof(struct SectionView))!=0;
+		if(changed){
+			wmove(metro_window, row, 0);
+			wclrtoeol(metro_window);
+			wattron(metro_window, COLOR_PAIR(section->can_release));
+			if(section->train!=0){
+				wprintw(metro_window, "%-*s T(%04u) %s->%s", NAME_LENGTH-1, topology->section_names[s], section->train, topology->place_names[section->origin], topology->place_names[section->destination]);
+			}else{
+				wprintw(metro_window, "%-*s free", NAME_LENGTH-1, topology->section_names[s]);
+			}
+		}
+		row++;
+		for(int k = topology->section_offset[s]; k<topology->section_offset[s+1]&&row<METRO_LINES; k++, row++){
+			int i = topology->section_segments[k];
+			const struct SegmentView *segment = &snapshot->segments[i];
+			//A new releasing segment changes the section line too
+			if(!changed&&memcmp(segment, &old->segments[i], sizeof(struct SegmentView))==0)continue;
+			wmove(metro_window, row, 0);
+			wclrtoeol(metro_window);
+			wattron(metro_window, COLOR_PAIR(segment->color));
+			if(section->releasing_segment_id==i)wattron(metro_window, MARKED_TEXT);
+			wmove(metro_window, row, 2);
+			wprintw(metro_window, "%-*s %4d trains", NAME_LENGTH-1, topology->place_names[i], segment->count);
+			if(segment->leader!=0)wprintw(metro_window, " T(%04u)", segment->leader);
+			wattroff(metro_window, MARKED_TEXT);
+		}
+	}
+	wnoutrefresh(metro_window);
+}
 
-	int i;
+//Built-in map layout of segments A, B, E and F
+struct MapSegment{
+	int leader_y, leader_x;
+	int rail_y, rail_x;
+	const char *rail;
+	//Curve down to the tunnel, drawn five times a step of dy, dx apart
+	int curve_y, curve_x, curve_dy, curve_dx;
+	const char *curve;
+	int count_y, count_x;
+};
 
-	//Segment 1
-	wattron(metro_window, COLOR_PAIR(colors[0]));
-	wmove(metro_window, 0,1);
-	if(queue_leaders[0].id!=NULL){
-		wprintw(metro_window, "T(%04d)", queue_leaders[0].id);
-	}else{
-		wprintw(metro_window, "       ");//Replace with clear
-	}
-	wmove(metro_window, 1,0);
-	if(releasing_segment_id==0)wattron(metro_window, MARKED_TEXT);
-	wprintw(metro_window, "A══════════╗");
-	for(i=0; i<5; i++){
-		wmove(metro_window, 2+i,11+i);
-		wprintw(metro_window, "╚╗");
-	}
-	wattroff(metro_window, MARKED_TEXT);
-	wmove(metro_window, 5,0);
-	wprintw(metro_window, "%d trains", queue_status[0]);
-	wmove(metro_window, 6,0);
-	wprintw(metro_window, "in queue");
+const struct MapSegment map_segments[MAP_SEGMENTS] = {
+	{0, 1, 1, 0, "A══════════╗", 2, 11, 1, 1, "╚╗", 5, 0},
+	{12, 1, 13, 0, "B══════════╝", 12, 11, -1, 1, "╔╝", 8, 0},
+	{0, 40, 1, 36, "╔══════════E", 2, 35, 1, -1, "╔╝", 5, 37},
+	{12, 40, 13, 36, "╚══════════F", 12, 35, -1, -1, "╚╗", 8, 37}
+};
 
-	//Segment 2
-	wattron(metro_window, COLOR_PAIR(colors[1]));
-	wmove(metro_window, 12,1);
-	if(queue_leaders[1].id!=NULL){
-		wprintw(metro_window, "T(%04d)", queue_leaders[1].id);
-	}else{
-		wprintw(metro_window, "       ");//Replace with clear
-	}
-	wmove(metro_window, 13,0);
-	if(releasing_segment_id==1)wattron(metro_window, MARKED_TEXT);
-	wprintw(metro_window, "B══════════╝");
-	for(i=0; i<5; i++){
-		wmove(metro_window, 12-i,11+i);
-		wprintw(metro_window, "╔╝");
+void draw_map_segment(int i, const struct SegmentView *segment, int marked){
+	const struct MapSegment *m = &map_segments[i];
+	char text[16];
+	wattron(metro_window, COLOR_PAIR(segment->color));
+	//Fixed widths overwrite longer old values
+	text[0] = '\0';
+	if(segment->leader!=0)snprintf(text, sizeof(text), "T(%04u)", segment->leader);
+	wmove(metro_window, m->leader_y, m->leader_x);
+	wprintw(metro_window, "%-8s", text);
+	if(marked)wattron(metro_window, MARKED_TEXT);
+	wmove(metro_window, m->rail_y, m->rail_x);
+	wprintw(metro_window, "%s", m->rail);
+	for(int k = 0; k<5; k++){
+		wmove(metro_window, m->curve_y+k*m->curve_dy, m->curve_x+k*m->curve_dx);
+		wprintw(metro_window, "%s", m->curve);
 	}
 	wattroff(metro_window, MARKED_TEXT);
-	wmove(metro_window, 8,0);
-	wprintw(metro_window, "%d trains", queue_status[1]);
-	wmove(metro_window, 9,0);
+	snprintf(text, sizeof(text), "%d trains", segment->count);
+	wmove(metro_window, m->count_y, m->count_x);
+	wprintw(metro_window, "%-11s", text);
+	wmove(metro_window, m->count_y+1, m->count_x);
 	wprintw(metro_window, "in queue");
+}
 
-	//Segment 3
-	wattron(metro_window, COLOR_PAIR(colors[2]));
-	wmove(metro_window, 0,40);
-	if(queue_leaders[2].id!=NULL){
-		wprintw(metro_window, "T(%04d)", queue_leaders[2].id);
-	}else{
-		wprintw(metro_window, "       ");//Replace with clear
-	}
-	wmove(metro_window, 1,36);
-	if(releasing_segment_id==2)wattron(metro_window, MARKED_TEXT);
-	wprintw(metro_window, "╔══════════E");
-	for(i=0; i<5; i++){
-		wmove(metro_window, 2+i,35-i);
-		wprintw(metro_window, "╔╝");
-	}
-	wattroff(metro_window, MARKED_TEXT);
-	wmove(metro_window, 5,37);
-	wprintw(metro_window, "%d trains", queue_status[2]);
-	wmove(metro_window, 6,37);
-	wprintw(metro_window, "in queue");
+void draw_tunnel(const struct SectionView *tunnel){
+	char text[32];
+	wattron(metro_window, COLOR_PAIR(tunnel->can_release));
+	//Trains from A and B are shown above the track, trains from E and F below
+	text[0] = '\0';
+	if(tunnel->train!=0&&tunnel->origin<2)snprintf(text, sizeof(text), "T(%04u)->%s", tunnel->train, topology->place_names[tunnel->destination]);
+	wmove(metro_window, 6, 19);
+	wprintw(metro_window, "%-11s", text);
+	text[0] = '\0';
+	if(tunnel->train!=0&&tunnel->origin>=2)snprintf(text, sizeof(text), "%s<-T(%04u)", topology->place_names[tunnel->destination], tunnel->train);
+	wmove(metro_window, 8, 19);
+	wprintw(metro_window, "%-11s", text);
+	wmove(metro_window, 7,16);
+	wprintw(metro_window, "╠═C━━━━━━━━━━D═╣");
+}
 
-	//Segment 4
-	wattron(metro_window, COLOR_PAIR(colors[3]));
-	wmove(metro_window, 12,40);
-	if(queue_leaders[3].id!=NULL){
-		wprintw(metro_window, "T(%04d)", queue_leaders[3].id);
-	}else{
-		wprintw(metro_window, "       ");//Replace with clear
+//Without old the whole map is drawn, otherwise only the parts that changed
+void draw_map(const struct Snapshot *snapshot, const struct Snapshot *old){
+	//The drawn map only fits the built-in network
+	if(!topology->builtin){
+		draw_network(snapshot, old);
+		return;
 	}
-	wmove(metro_window, 13,36);
-	if(releasing_segment_id==3)wattron(metro_window, MARKED_TEXT);
-	wprintw(metro_window, "╚══════════F");
-	for(i=0; i<5; i++){
-		wmove(metro_window, 12-i,35-i);
-		wprintw(metro_window, "╚╗");
+	const struct SectionView *tunnel = &snapshot->sections[0];
+	for(int i = 0; i<MAP_SEGMENTS; i++){
+		int marked = (tunnel->releasing_segment_id==i);
+		if(old!=NULL&&memcmp(&snapshot->segments[i], &old->segments[i], sizeof(struct SegmentView))==0&&marked==(old->sections[0].releasing_segment_id==i))continue;
+		draw_map_segment(i, &snapshot->segments[i], marked);
 	}
-	wattroff(metro_window, MARKED_TEXT);
-	wmove(metro_window, 8,37);
-	wprintw(metro_window, "%d trains", queue_status[3]);
-	wmove(metro_window, 9,37);
-	wprintw(metro_window, "in queue");
+	if(old==NULL||memcmp(tunnel, &old->sections[0], sizeof(struct SectionView))!=0)draw_tunnel(tunnel);
+	wnoutrefresh(metro_window);
+}
 
-	//Tunnel
-	wattron(metro_window, COLOR_PAIR(can_release));
-	if(train_in_tunnel.id!=NULL){
-		if(train_in_tunnel.origin-'A'<2){
-			wmove(metro_window, 6, 19);
-			wprintw(metro_window, "T(%04d)->%c",train_in_tunnel.id, train_in_tunnel.destination);
-		}else{
-			wmove(metro_window, 8, 19);
-			wprintw(metro_window, "%c<-T(%04d)", train_in_tunnel.destination, train_in_tunnel.id);
-		}
-	}else{
-		//Replace with clear
-		wmove(metro_window, 6, 19);
-		wprintw(metro_window, "          ");
-		wmove(metro_window, 8, 19);
-		wprintw(metro_window, "          ");
+//Human readable duration for the overlay and the summary
+void format_duration(char *out, size_t size, uint64_t ns){
+	if(ns<1000)snprintf(out, size, "%lluns", (unsigned long long)ns);
+	else if(ns<1000000)snprintf(out, size, "%.1fus", ns/1e3);
+	else if(ns<1000000000)snprintf(out, size, "%.1fms", ns/1e6);
+	else snprintf(out, size, "%.2fs", ns/1e9);
+}
+
+//Phase latencies over the right end of the console, merged over workers
+void draw_stats_overlay(const uint64_t *p50_ns, const uint64_t *p99_ns){
+	if(stats_window==NULL)return;
+	werase(stats_window);
+	wattron(stats_window, COLOR_PAIR(YELLOW_BLACK));
+	box(stats_window, 0, 0);
+	wmove(stats_window, 0, 2);
+	wprintw(stats_window, "Phase timings");
+	wmove(stats_window, 1, 2);
+	wprintw(stats_window, "%-14s %8s %8s", "", "p50", "p99");
+	for(int p = 0; p<PHASE_COUNT; p++){
+		char p50[16], p99[16];
+		format_duration(p50, sizeof(p50), p50_ns[p]);
+		format_duration(p99, sizeof(p99), p99_ns[p]);
+		wmove(stats_window, 2+p, 2);
+		wprintw(stats_window, "%-14s %8s %8s", phase_names[p], p50, p99);
 	}
-	wmove(metro_window, 7,16);
-	wprintw(metro_window, "╠═C━━━━━━━━━━D═╣");
-	
-	wrefresh(metro_window);
+	wnoutrefresh(stats_window);
 }
 
+//Border in the color of the admission state, the time line goes over it
 void update_metro_container(int color){
-	//Metro container
-	metro_container = newwin(METRO_LINES+2,COLS,0,0);
 	wattron(metro_container, COLOR_PAIR(color));
 	wborder(metro_container, ACS_VLINE, ACS_VLINE, ACS_HLINE, ACS_HLINE, ACS_ULCORNER, ACS_URCORNER, ACS_LLCORNER, ACS_LRCORNER);
 	wmove(metro_container, 0,2);
 	wprintw(metro_container, "Metro Map");
-	wrefresh(metro_container);
-	draw_map(segment_colors);
-	print_time();
+	wnoutrefresh(metro_container);
 }
 
 int ncurses_init_windows(){
@@ -473,6 +1132,8 @@ int ncurses_init_windows(){
 		strcpy(console_lines[i], "");
 	}
 	console_line_color = malloc(sizeof(int)*console_max_lines);
+	console_line_counter = 0;
+	console_head = 0;
 
 	//Console container
 	console_container = newwin(console_max_lines+2, COLS, METRO_LINES+2, 0);
@@ -484,12 +1145,20 @@ int ncurses_init_windows(){
 
 	//Metro window
 	metro_window = newwin(METRO_LINES,METRO_COLS,1,(COLS-METRO_COLS)/2);
+	//Polled for keys between ticks
+	nodelay(metro_window, TRUE);
 	wrefresh(metro_window);
 
 	//Console window
 	console_window = newwin(console_max_lines, COLS-2, METRO_LINES+3, 1);
 	wrefresh(console_window);
 
+	//Stats overlay, only when it fits over the console
+	stats_window = NULL;
+	if(stats_overlay&&console_max_lines>=PHASE_COUNT+3){
+		stats_window = newwin(PHASE_COUNT+3, STATS_OVERLAY_COLS, METRO_LINES+3, COLS-STATS_OVERLAY_COLS-1);
+	}
+
 
 	refresh();
 }
@@ -517,8 +1186,215 @@ int ncurses_init(){
 }
 
 void sigwinch_handler(int signal){
-	//Init ncurses windows
-	ncurses_init_windows();
+	//The renderer thread re-creates the windows
+	resize_requested = 1;
+}
+
+void snapshot_init(struct Snapshot *snapshot){
+	snapshot->segments = calloc(queue_count, sizeof(struct SegmentView));
+	snapshot->sections = calloc(topology->section_count, sizeof(struct SectionView));
+}
+
+void snapshot_copy(struct Snapshot *dst, const struct Snapshot *src){
+	struct SegmentView *segments = dst->segments;
+	struct SectionView *sections = dst->sections;
+	*dst = *src;
+	dst->segments = segments;
+	dst->sections = sections;
+	memcpy(segments, src->segments, queue_count*sizeof(struct SegmentView));
+	memcpy(sections, src->sections, topology->section_count*sizeof(struct SectionView));
+}
+
+struct Renderer *renderer_create(){
+	struct Renderer *r = calloc(1, sizeof(struct Renderer));
+	for(int i = 0; i<SNAPSHOT_BUFFERS; i++)snapshot_init(&r->buffers[i]);
+	snapshot_init(&r->shown);
+	r->back = 0;
+	atomic_init(&r->middle, 1);
+	r->front = 2;
+	r->merged = malloc(PHASE_COUNT*sizeof(struct Histogram));
+	r->pace = now_ns();
+	return r;
+}
+
+void renderer_destroy(struct Renderer *r){
+	for(int i = 0; i<SNAPSHOT_BUFFERS; i++){
+		free(r->buffers[i].segments);
+		free(r->buffers[i].sections);
+	}
+	free(r->shown.segments);
+	free(r->shown.sections);
+	free(r->merged);
+	free(r);
+}
+
+/*
+ * Controller side, copies the display state of sim into the back buffer and
+ * hands it to the renderer. Costs one pass over the segments and sections,
+ * the phase histograms are only merged when the overlay asked for them.
+ */
+void snapshot_publish(struct Renderer *r, struct Simulation *sim){
+	struct Snapshot *snapshot = &r->buffers[r->back];
+	snapshot->tick = sim->tick;
+	for(int i = 0; i<queue_count; i++){
+		snapshot->segments[i].count = sim->queue_status[i];
+		snapshot->segments[i].leader = sim->queue_leaders[i].id;
+	}
+	recolor_lanes(sim, snapshot->segments);
+	//Red while any section turns trains away
+	snapshot->container_color = GREEN_BLACK;
+	for(int s = 0; s<topology->section_count; s++){
+		struct Section *section = &sim->sections[s];
+		struct SectionView *view = &snapshot->sections[s];
+		view->train = section->train_in_tunnel.id;
+		view->origin = section->train_in_tunnel.origin;
+		view->destination = section->train_in_tunnel.destination;
+		view->can_release = section->can_release;
+		view->releasing_segment_id = section->releasing_segment_id;
+		if(section->allow_trains==0)snapshot->container_color = RED_BLACK;
+	}
+	snapshot->has_stats = 0;
+	if(sim->stats!=NULL&&atomic_exchange(&r->stats_wanted, 0)){
+		stats_merge(sim, r->merged);
+		for(int p = 0; p<PHASE_COUNT; p++){
+			snapshot->p50[p] = hist_quantile(&r->merged[p], 0.5);
+			snapshot->p99[p] = hist_quantile(&r->merged[p], 0.99);
+		}
+		snapshot->has_stats = 1;
+	}
+	r->back = atomic_exchange_explicit(&r->middle, r->back|SNAPSHOT_FRESH, memory_order_acq_rel)&~SNAPSHOT_FRESH;
+}
+
+//Records the renderer's frame timings into the controller's phase histograms
+void frame_timings_collect(struct Renderer *r){
+	unsigned head = atomic_load_explicit(&r->timing_head, memory_order_acquire);
+	unsigned tail = atomic_load_explicit(&r->timing_tail, memory_order_relaxed);
+	for(; tail!=head; tail++){
+		struct FrameTiming *timing = &r->timings[tail%FRAME_TIMINGS];
+		if(thread_stats==NULL)continue;
+		if(timing->draw>0)hist_record(&thread_stats->phase[PHASE_DRAW], timing->draw);
+		if(timing->console>0)hist_record(&thread_stats->phase[PHASE_CONSOLE], timing->console);
+	}
+	atomic_store_explicit(&r->timing_tail, tail, memory_order_release);
+}
+
+void sleep_until(uint64_t ns){
+	struct timespec until = {(time_t)(ns/1000000000ULL), (long)(ns%1000000000ULL)};
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)==EINTR);
+}
+
+//Holds the controller to one tick per --tick-delay, a late tick does not shorten the next
+void pace_tick(struct Renderer *r){
+	if(tick_delay<=0)return;
+	uint64_t now = now_ns();
+	r->pace += (uint64_t)tick_delay*1000000ULL;
+	if(r->pace<now)r->pace = now;
+	sleep_until(r->pace);
+}
+
+/*
+ * One frame of the ncurses interface. Takes the newest snapshot if there is
+ * one and repaints only what changed since the last frame, then ncurses
+ * sends only the changed cells. Keys are read here as well, so the
+ * simulation threads never touch ncurses.
+ */
+void render_frame(struct Renderer *r, int full){
+	if(resize_requested){
+		resize_requested = 0;
+		//The console ring is re-created with the windows
+		pthread_mutex_lock(&log_mutex);
+		endwin();
+		refresh();
+		ncurses_init_windows();
+		pthread_mutex_unlock(&log_mutex);
+		full = 1;
+	}
+	int fresh = 0;
+	if(atomic_load_explicit(&r->middle, memory_order_relaxed)&SNAPSHOT_FRESH){
+		r->front = atomic_exchange_explicit(&r->middle, r->front, memory_order_acq_rel)&~SNAPSHOT_FRESH;
+		fresh = 1;
+	}
+	struct Snapshot *snapshot = &r->buffers[r->front];
+	struct FrameTiming timing = {0, 0};
+	uint64_t start = now_ns();
+	int border = full||snapshot->container_color!=r->shown.container_color;
+	if(border)update_metro_container(snapshot->container_color);
+	if(fresh||full){
+		draw_map(snapshot, full?NULL:&r->shown);
+		timing.draw = now_ns()-start;
+	}
+	time_t now = time(NULL);
+	if(border||snapshot->tick!=r->shown.tick||now!=r->shown_time){
+		print_time(snapshot->tick);
+		r->shown_time = now;
+	}
+	if(fresh)snapshot_copy(&r->shown, snapshot);
+
+	unsigned long long version = atomic_load_explicit(&console_version, memory_order_relaxed);
+	int console = full||version!=r->console_shown;
+	if(console){
+		start = now_ns();
+		print_console();
+		r->console_shown = version;
+		timing.console = now_ns()-start;
+	}
+	if(stats_window!=NULL){
+		int stats = fresh&&snapshot->has_stats;
+		if(stats){
+			memcpy(r->p50, snapshot->p50, sizeof(r->p50));
+			memcpy(r->p99, snapshot->p99, sizeof(r->p99));
+		}
+		//The overlay sits on the console and goes under it on every console repaint
+		if(stats||console)draw_stats_overlay(r->p50, r->p99);
+		atomic_store(&r->stats_wanted, 1);
+	}
+	doupdate();
+
+	unsigned head = atomic_load_explicit(&r->timing_head, memory_order_relaxed);
+	if((timing.draw>0||timing.console>0)&&head-atomic_load_explicit(&r->timing_tail, memory_order_acquire)<FRAME_TIMINGS){
+		r->timings[head%FRAME_TIMINGS] = timing;
+		atomic_store_explicit(&r->timing_head, head+1, memory_order_release);
+	}
+	int key;
+	while((key = wgetch(metro_window))!=ERR){
+		if(key=='c')checkpoint_requested = 1;
+		if(key=='w')branch_requested = 1;
+	}
+}
+
+//Draws at most --fps frames a second until the run ends, then the final state
+void *render_loop(void *arg){
+	struct Renderer *r = arg;
+	uint64_t frame = 1000000000ULL/frame_rate;
+	uint64_t next = now_ns();
+	render_frame(r, 1);
+	while(!atomic_load(&r->stop)){
+		next += frame;
+		uint64_t now = now_ns();
+		if(next<now)next = now;
+		sleep_until(next);
+		render_frame(r, 0);
+	}
+	render_frame(r, 0);
+	return NULL;
+}
+
+void renderer_start(struct Renderer *r){
+	pthread_create(&r->thread, NULL, render_loop, r);
+}
+
+void renderer_stop(struct Renderer *r){
+	atomic_store(&r->stop, 1);
+	pthread_join(r->thread, NULL);
+}
+
+//Decided hook of display_sim, hands the tick to the renderer and paces the run
+void display_decided(struct Simulation *sim){
+	uint64_t start = phase_start();
+	snapshot_publish(renderer, sim);
+	frame_timings_collect(renderer);
+	phase_lap(PHASE_SNAPSHOT, start);
+	pace_tick(renderer);
 }
 
 int get_central_start(char *str){
@@ -664,56 +1540,1385 @@ int init_menu_screen(){
 	return selected_option;
 }
 
-void init_splash_screen(){
-	WINDOW *splash_screen = newwin(LINES, COLS, 0, 0);
-	wattron(splash_screen, COLOR_PAIR(GREEN_BLACK));
-	wborder(splash_screen, ACS_VLINE, ACS_VLINE, ACS_HLINE, ACS_HLINE, ACS_ULCORNER, ACS_URCORNER, ACS_LLCORNER, ACS_LRCORNER);
-	int x = (LINES-12)/2;
-	int y = (COLS-53)/2;
-	wmove(splash_screen, x, y);
-	wprintw(splash_screen, " __  __        _                _____  _            ");
-	wmove(splash_screen, x+1, y);
-	wprintw(splash_screen, "|  \\/  |      | |              / ____|(_)           ");
-	wmove(splash_screen, x+2, y);
-	wprintw(splash_screen, "| \\  / |  ___ | |_  _ __  ___ | (___   _  _ __ ___  ");
-	wmove(splash_screen, x+3, y);
-	wprintw(splash_screen, "| |\\/| | / _ \\| __|| '__|/ _ \\ \\___ \\ | || '_ ` _ \\ ");
-	wmove(splash_screen, x+4, y);
-	wprintw(splash_screen, "| |  | ||  __/| |_ | |  | (_) |____) || || | | | | |");
-	wmove(splash_screen, x+5, y);
-	wprintw(splash_screen, "|_|  |_| \\___| \\__||_|   \\___/|_____/ |_||_| |_| |_|");
-	wmove(splash_screen, x+6, y);
-	wprintw(splash_screen, "                    __     ___   _                  ");
-	wmove(splash_screen, x+7, y);
-	wprintw(splash_screen, "                   /_ |   / _ \\ | |                 ");
-	wmove(splash_screen, x+8, y);
-	wprintw(splash_screen, "             __   __| |  | | | || |__               ");
-	wmove(splash_screen, x+9, y);
-	wprintw(splash_screen, "             \\ \\ / /| |  | | | || '_ \\              ");
-	wmove(splash_screen, x+10, y);
-	wprintw(splash_screen, "              \\ V / | | _| |_| || |_) |             ");
-	wmove(splash_screen, x+11, y);
-	wprintw(splash_screen, "               \\_/  |_|(_)\\___/ |_.__/              ");
-	wrefresh(splash_screen);
-	sleep(SPLASH_TIME);
-	werase(splash_screen);
+/*
+ * Line start offsets of a mapped log, built by a background thread so the
+ * viewer can show a file at once. Offsets are kept in fixed chunks that
+ * never move, lines only grows, so the viewer reads the first lines
+ * entries while the indexer appends.
+ */
+struct LogIndex{
+	const char *data;
+	size_t size;
+	uint64_t **chunks;
+	size_t chunk_count;
+	atomic_size_t lines;
+	atomic_int done;
+	atomic_int stop;
+	pthread_t thread;
+};
+
+uint64_t log_index_line(struct LogIndex *index, size_t line){
+	return index->chunks[line/LOG_INDEX_CHUNK][line%LOG_INDEX_CHUNK];
 }
 
-struct arguments {
-	float p;
-	int s;
+void *log_index_worker(void *arg){
+	struct LogIndex *index = arg;
+	size_t lines = 0;
+	size_t offset = 0;
+	while(offset<index->size&&!atomic_load_explicit(&index->stop, memory_order_relaxed)){
+		size_t chunk = lines/LOG_INDEX_CHUNK;
+		if(index->chunks[chunk]==NULL)index->chunks[chunk] = malloc(LOG_INDEX_CHUNK*sizeof(uint64_t));
+		index->chunks[chunk][lines%LOG_INDEX_CHUNK] = offset;
+		lines++;
+		if(lines%LOG_INDEX_PUBLISH==0)atomic_store_explicit(&index->lines, lines, memory_order_release);
+		const char *newline = memchr(index->data+offset, '\n', index->size-offset);
+		offset = newline!=NULL?(size_t)(newline-index->data)+1:index->size;
+	}
+	atomic_store_explicit(&index->lines, lines, memory_order_release);
+	atomic_store_explicit(&index->done, 1, memory_order_release);
+	return NULL;
+}
+
+void log_index_start(struct LogIndex *index, const char *data, size_t size){
+	index->data = data;
+	index->size = size;
+	//A line holds at least its newline, so this many chunks always suffice
+	index->chunk_count = size/LOG_INDEX_CHUNK+2;
+	index->chunks = calloc(index->chunk_count, sizeof(uint64_t *));
+	atomic_init(&index->lines, 0);
+	atomic_init(&index->done, 0);
+	atomic_init(&index->stop, 0);
+	pthread_create(&index->thread, NULL, log_index_worker, index);
+}
+
+void log_index_stop(struct LogIndex *index){
+	atomic_store(&index->stop, 1);
+	pthread_join(index->thread, NULL);
+	for(size_t i = 0; i<index->chunk_count; i++)free(index->chunks[i]);
+	free(index->chunks);
+}
+
+//Filter and search state of the log viewer
+struct LogView{
+	const char *data;
+	size_t size;
+	struct LogIndex index;
+	int filter_train;
+	char filter_name[NAME_LENGTH];
+	char search[LOG_VIEWER_INPUT];
 };
 
-static error_t parse_opt (int key, char *arg, struct argp_state *state){
+//First occurrence of needle in the n bytes at haystack
+const char *find_text(const char *haystack, size_t n, const char *needle, size_t m){
+	if(m==0)return haystack;
+	while(n>=m){
+		const char *p = memchr(haystack, needle[0], n-m+1);
+		if(p==NULL)return NULL;
+		if(memcmp(p, needle, m)==0)return p;
+		n -= p+1-haystack;
+		haystack = p+1;
+	}
+	return NULL;
+}
 
-	struct arguments *args = state->input;
+size_t view_line_end(struct LogView *v, size_t line){
+	const char *newline = memchr(v->data+line, '\n', v->size-line);
+	return newline!=NULL?(size_t)(newline-v->data):v->size;
+}
 
-	switch(key){
+//Start of the next line, NOT_FOUND after the last one
+size_t view_next_line(struct LogView *v, size_t line){
+	size_t end = view_line_end(v, line);
+	return end+1<v->size?end+1:NOT_FOUND;
+}
+
+//Start of the previous line, NOT_FOUND before the first one
+size_t view_prev_line(struct LogView *v, size_t line){
+	if(line==0)return NOT_FOUND;
+	size_t p = line-1;
+	while(p>0&&v->data[p-1]!='\n')p--;
+	return p;
+}
+
+//Start of the line holding offset
+size_t view_line_start(struct LogView *v, size_t offset){
+	while(offset>0&&v->data[offset-1]!='\n')offset--;
+	return offset;
+}
+
+//Tick of a log line, -1 for lines without one
+int view_line_tick(struct LogView *v, size_t line){
+	size_t end = view_line_end(v, line);
+	const char *tag = find_text(v->data+line, end-line, "[TICK ", 6);
+	if(tag==NULL)return -1;
+	int tick = 0;
+	for(const char *p = tag+6; p<v->data+end&&*p>='0'&&*p<='9'; p++)tick = tick*10+(*p-'0');
+	return tick;
+}
+
+//Whether text occurs in the line followed by one of the terminators
+int view_line_has(struct LogView *v, size_t line, const char *text, const char *terminators){
+	size_t end = view_line_end(v, line);
+	size_t length = strlen(text);
+	for(size_t from = line; from<end;){
+		const char *p = find_text(v->data+from, end-from, text, length);
+		if(p==NULL)return 0;
+		const char *after = p+length;
+		if(after<v->data+end&&strchr(terminators, *after)!=NULL)return 1;
+		from = p+1-v->data;
+	}
+	return 0;
+}
+
+//Filter by train ID or by segment or section name
+int view_line_visible(struct LogView *v, size_t line){
+	char text[NAME_LENGTH+16];
+	if(v->filter_train>0){
+		snprintf(text, sizeof(text), "ID %04d", v->filter_train);
+		return view_line_has(v, line, text, " .,)");
+	}
+	if(v->filter_name[0]!='\0'){
+		snprintf(text, sizeof(text), "[SEGMENT %s", v->filter_name);
+		if(view_line_has(v, line, text, "]"))return 1;
+		snprintf(text, sizeof(text), "[CONTROL %s", v->filter_name);
+		if(view_line_has(v, line, text, "]"))return 1;
+		snprintf(text, sizeof(text), "segment %s", v->filter_name);
+		return view_line_has(v, line, text, " .,");
+	}
+	return 1;
+}
+
+size_t view_next_visible(struct LogView *v, size_t line){
+	while((line = view_next_line(v, line))!=NOT_FOUND&&!view_line_visible(v, line));
+	return line;
+}
+
+size_t view_prev_visible(struct LogView *v, size_t line){
+	while((line = view_prev_line(v, line))!=NOT_FOUND&&!view_line_visible(v, line));
+	return line;
+}
+
+//First visible line at or after from containing the search text
+size_t view_search_forward(struct LogView *v, size_t from){
+	size_t length = strlen(v->search);
+	while(from<v->size){
+		const char *p = find_text(v->data+from, v->size-from, v->search, length);
+		if(p==NULL)return NOT_FOUND;
+		size_t line = view_line_start(v, p-v->data);
+		if(view_line_visible(v, line))return line;
+		from = view_line_end(v, line)+1;
+	}
+	return NOT_FOUND;
+}
+
+//Last visible line before from containing the search text
+size_t view_search_backward(struct LogView *v, size_t from){
+	size_t length = strlen(v->search);
+	for(size_t line = view_prev_visible(v, from); line!=NOT_FOUND; line = view_prev_visible(v, line)){
+		size_t end = view_line_end(v, line);
+		if(find_text(v->data+line, end-line, v->search, length)!=NULL)return line;
+	}
+	return NOT_FOUND;
+}
+
+/*
+ * First indexed line at or past tick, by binary search over the index.
+ * Ticks never go down within a log. Returns NOT_FOUND when the tick is past
+ * the part indexed so far.
+ */
+size_t view_find_tick(struct LogView *v, int tick){
+	size_t lines = atomic_load_explicit(&v->index.lines, memory_order_acquire);
+	size_t lo = 0, hi = lines;
+	while(lo<hi){
+		size_t mid = lo+(hi-lo)/2;
+		if(view_line_tick(v, log_index_line(&v->index, mid))<tick)lo = mid+1;
+		else hi = mid;
+	}
+	if(lo==lines)return NOT_FOUND;
+	return log_index_line(&v->index, lo);
+}
+
+//Line number of a line start, 0 when that part is not indexed yet
+size_t view_line_number(struct LogView *v, size_t line){
+	size_t lines = atomic_load_explicit(&v->index.lines, memory_order_acquire);
+	if(lines==0||log_index_line(&v->index, lines-1)<line)return 0;
+	size_t lo = 0, hi = lines-1;
+	while(lo<hi){
+		size_t mid = lo+(hi-lo+1)/2;
+		if(log_index_line(&v->index, mid)<=line)lo = mid;
+		else hi = mid-1;
+	}
+	return lo+1;
+}
+
+/*
+ * Reads a line of input on the bottom row. With v set the search runs
+ * after every key and the view follows it, the incremental search. Returns
+ * 0 on Enter and -1 on Escape.
+ */
+int view_prompt(WINDOW *w, const char *label, char *input, size_t size, struct LogView *v, size_t *top, size_t origin){
+	size_t length = strlen(input);
+	for(;;){
+		wmove(w, LINES-1, 0);
+		wclrtoeol(w);
+		wattron(w, MARKED_TEXT);
+		wprintw(w, "%s%s", label, input);
+		wattroff(w, MARKED_TEXT);
+		wrefresh(w);
+		int key = wgetch(w);
+		if(key==ERR)continue;
+		if(key==10)return 0;
+		if(key==27)return -1;
+		if(key==127||key==8||key==KEY_BACKSPACE){
+			if(length>0)input[--length] = '\0';
+		}else if(key>=' '&&key<127&&length+1<size){
+			input[length++] = key;
+			input[length] = '\0';
+		}else{
+			continue;
+		}
+		if(v!=NULL){
+			size_t line = length>0?view_search_forward(v, origin):NOT_FOUND;
+			*top = line!=NOT_FOUND?line:origin;
+			return 1;
+		}
+	}
+}
+
+//Header and the visible lines from top, the match highlighted
+void view_draw(WINDOW *w, struct LogView *v, const char *path, size_t top, size_t match, int rows){
+	werase(w);
+	wattron(w, MARKED_TEXT);
+	wmove(w, 0, 0);
+	wprintw(w, " Log Viewer: %.*s", COLS-14, path);
+	wattroff(w, MARKED_TEXT);
+	size_t line = view_line_visible(v, top)?top:view_next_visible(v, top);
+	for(int row = 0; row<rows&&line!=NOT_FOUND; row++){
+		size_t length = view_line_end(v, line)-line;
+		if(length>(size_t)COLS)length = COLS;
+		if(line==match)wattron(w, MARKED_TEXT);
+		mvwaddnstr(w, row+1, 0, v->data+line, length);
+		if(line==match)wattroff(w, MARKED_TEXT);
+		line = view_next_visible(v, line);
+	}
+}
+
+/*
+ * Pager over a mapped log. The file is shown at once, its line index is
+ * built in the background and only needed for line numbers and tick jumps.
+ * Scrolling and search work on byte offsets, so a large log costs no more
+ * to open than a small one.
+ */
+void view_log(const char *path){
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if(fd<0||fstat(fd, &st)!=0||st.st_size==0){
+		if(fd>=0)close(fd);
+		return;
+	}
+	struct LogView v = {0};
+	v.size = st.st_size;
+	v.data = mmap(NULL, v.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(v.data==MAP_FAILED)return;
+	log_index_start(&v.index, v.data, v.size);
+
+	WINDOW *w = newwin(LINES, COLS, 0, 0);
+	keypad(w, TRUE);
+	//Redraw the status line while the index grows
+	wtimeout(w, LOG_VIEWER_REFRESH_MS);
+	size_t top = 0;
+	size_t match = NOT_FOUND;
+	const char *message = "";
+	char input[LOG_VIEWER_INPUT];
+	int rows = LINES-2;
+	for(;;){
+		view_draw(w, &v, path, top, match, rows);
+		size_t lines = atomic_load_explicit(&v.index.lines, memory_order_acquire);
+		int done = atomic_load_explicit(&v.index.done, memory_order_acquire);
+		size_t number = view_line_number(&v, top);
+		char position[32] = "?";
+		if(number>0)snprintf(position, sizeof(position), "%zu", number);
+		wmove(w, LINES-1, 0);
+		wprintw(w, "Line %s/%zu%s", position, lines, done?"":" (indexing)");
+		if(v.filter_train>0)wprintw(w, "  train %04d", v.filter_train);
+		if(v.filter_name[0]!='\0')wprintw(w, "  %s", v.filter_name);
+		wprintw(w, "  %s", message[0]!='\0'?message:"t tick  : line  f filter  / search  n N  q quit");
+		wrefresh(w);
+
+		int key = wgetch(w);
+		if(key==ERR)continue;
+		message = "";
+		size_t next;
+		switch(key){
+			case 'q':
+			case 27:
+				delwin(w);
+				log_index_stop(&v.index);
+				munmap((void *)v.data, v.size);
+				return;
+			case KEY_DOWN:
+			case 'j':
+				if((next = view_next_visible(&v, top))!=NOT_FOUND)top = next;
+				break;
+			case KEY_UP:
+			case 'k':
+				if((next = view_prev_visible(&v, top))!=NOT_FOUND)top = next;
+				break;
+			case KEY_NPAGE:
+			case ' ':
+				for(int i = 0; i<rows&&(next = view_next_visible(&v, top))!=NOT_FOUND; i++)top = next;
+				break;
+			case KEY_PPAGE:
+			case 'b':
+				for(int i = 0; i<rows&&(next = view_prev_visible(&v, top))!=NOT_FOUND; i++)top = next;
+				break;
+			case KEY_HOME:
+			case 'g':
+				top = 0;
+				break;
+			case KEY_END:
+			case 'G':
+				//Last screen, found from the end of the file without the index
+				top = view_line_start(&v, v.size-1);
+				if(!view_line_visible(&v, top)&&(next = view_prev_visible(&v, top))!=NOT_FOUND)top = next;
+				for(int i = 1; i<rows&&(next = view_prev_visible(&v, top))!=NOT_FOUND; i++)top = next;
+				break;
+			case 't':
+				input[0] = '\0';
+				if(view_prompt(w, "Tick: ", input, sizeof(input), NULL, NULL, 0)==0&&input[0]!='\0'){
+					next = view_find_tick(&v, atoi(input));
+					if(next!=NOT_FOUND)top = next;
+					else message = done?"Tick not in this log":"Tick not indexed yet";
+				}
+				break;
+			case ':':
+				input[0] = '\0';
+				if(view_prompt(w, "Line: ", input, sizeof(input), NULL, NULL, 0)==0&&input[0]!='\0'){
+					long number = atol(input);
+					lines = atomic_load_explicit(&v.index.lines, memory_order_acquire);
+					if(number>=1&&(size_t)number<=lines)top = log_index_line(&v.index, number-1);
+					else message = atomic_load(&v.index.done)?"No such line":"Line not indexed yet";
+				}
+				break;
+			case 'f':
+				input[0] = '\0';
+				if(view_prompt(w, "Filter by train ID or segment (empty clears): ", input, sizeof(input), NULL, NULL, 0)==0){
+					v.filter_train = 0;
+					v.filter_name[0] = '\0';
+					char *end;
+					long id = strtol(input, &end, 10);
+					if(input[0]!='\0'&&*end=='\0'&&id>0)v.filter_train = id;
+					else snprintf(v.filter_name, sizeof(v.filter_name), "%s", input);
+				}
+				break;
+			case '/':{
+				size_t origin = top;
+				v.search[0] = '\0';
+				int status;
+				//Every key moves the view to the first match from where the search started
+				while((status = view_prompt(w, "/", v.search, sizeof(v.search), &v, &top, origin))==1){
+					match = v.search[0]!='\0'&&view_search_forward(&v, top)==top?top:NOT_FOUND;
+					view_draw(w, &v, path, top, match, rows);
+				}
+				if(status<0){
+					top = origin;
+					match = NOT_FOUND;
+					v.search[0] = '\0';
+				}else if(v.search[0]!='\0'&&match==NOT_FOUND){
+					message = "Pattern not found";
+				}
+				break;
+			}
+			case 'n':
+			case 'N':
+				if(v.search[0]=='\0')break;
+				next = (key=='n')?view_search_forward(&v, view_line_end(&v, top)+1):view_search_backward(&v, top);
+				if(next!=NOT_FOUND){
+					top = next;
+					match = next;
+				}else{
+					message = "Pattern not found";
+				}
+				break;
+		}
+	}
+}
+
+//Lists the train and control logs of the working directory, newest first
+int compare_log_files(const void *a, const void *b){
+	struct stat x, y;
+	if(stat(*(char *const *)a, &x)!=0||stat(*(char *const *)b, &y)!=0)return 0;
+	if(x.st_mtime!=y.st_mtime)return x.st_mtime>y.st_mtime?-1:1;
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void init_log_viewer(){
+	char *files[LOG_VIEWER_FILES];
+	int count = 0;
+	DIR *dir = opendir(".");
+	struct dirent *entry;
+	while(dir!=NULL&&(entry = readdir(dir))!=NULL&&count<LOG_VIEWER_FILES){
+		size_t length = strlen(entry->d_name);
+		if((length>10&&strcmp(entry->d_name+length-10, "-train.log")==0)||(length>12&&strcmp(entry->d_name+length-12, "-control.log")==0)){
+			files[count++] = strdup(entry->d_name);
+		}
+	}
+	if(dir!=NULL)closedir(dir);
+	qsort(files, count, sizeof(char *), compare_log_files);
+
+	WINDOW *log_menu = newwin(LINES, COLS, 0, 0);
+	keypad(log_menu, TRUE);
+	wattron(log_menu, COLOR_PAIR(GREEN_BLACK));
+	int selected_option = 0;
+	char menu_header[] = "Log Viewer";
+	for(;;){
+		werase(log_menu);
+		wborder(log_menu, ACS_VLINE, ACS_VLINE, ACS_HLINE, ACS_HLINE, ACS_ULCORNER, ACS_URCORNER, ACS_LLCORNER, ACS_LRCORNER);
+		int shown = count<LINES-6?count:LINES-6;
+		int first = selected_option>=shown?selected_option-shown+1:0;
+		int line_start = (LINES-shown-2)/2;
+		wmove(log_menu, line_start, get_central_start(menu_header));
+		wattron(log_menu, A_UNDERLINE);
+		wprintw(log_menu, menu_header);
+		wattroff(log_menu, A_UNDERLINE);
+		line_start+=2;
+		if(count==0){
+			char empty[] = "No logs in this directory";
+			wmove(log_menu, line_start, get_central_start(empty));
+			wprintw(log_menu, "%s", empty);
+		}
+		for(int i = 0; i<shown; i++){
+			wmove(log_menu, line_start+i, get_central_start(files[first+i]));
+			if(first+i==selected_option)wattron(log_menu, MARKED_TEXT);
+			wprintw(log_menu, "%s", files[first+i]);
+			if(first+i==selected_option)wattroff(log_menu, MARKED_TEXT);
+		}
+		wrefresh(log_menu);
+		int key = wgetch(log_menu);
+		if(key=='q'||key==27||(key==10&&count==0))break;
+		if(key==10){
+			view_log(files[selected_option]);
+			continue;
+		}
+		if(key==KEY_UP)selected_option--;
+		if(key==KEY_DOWN)selected_option++;
+		if(count>0){
+			if(selected_option>count-1)selected_option%=count;
+			if(selected_option<0)selected_option+=count;
+		}else{
+			selected_option = 0;
+		}
+	}
+	for(int i = 0; i<count; i++)free(files[i]);
+	delwin(log_menu);
+}
+
+void init_splash_screen(){
+	WINDOW *splash_screen = newwin(LINES, COLS, 0, 0);
+	wattron(splash_screen, COLOR_PAIR(GREEN_BLACK));
+	wborder(splash_screen, ACS_VLINE, ACS_VLINE, ACS_HLINE, ACS_HLINE, ACS_ULCORNER, ACS_URCORNER, ACS_LLCORNER, ACS_LRCORNER);
+	int x = (LINES-12)/2;
+	int y = (COLS-53)/2;
+	wmove(splash_screen, x, y);
+	wprintw(splash_screen, " __  __        _                _____  _            ");
+	wmove(splash_screen, x+1, y);
+	wprintw(splash_screen, "|  \\/  |      | |              / ____|(_)           ");
+	wmove(splash_screen, x+2, y);
+	wprintw(splash_screen, "| \\  / |  ___ | |_  _ __  ___ | (___   _  _ __ ___  ");
+	wmove(splash_screen, x+3, y);
+	wprintw(splash_screen, "| |\\/| | / _ \\| __|| '__|/ _ \\ \\___ \\ | || '_ ` _ \\ ");
+	wmove(splash_screen, x+4, y);
+	wprintw(splash_screen, "| |  | ||  __/| |_ | |  | (_) |____) || || | | | | |");
+	wmove(splash_screen, x+5, y);
+	wprintw(splash_screen, "|_|  |_| \\___| \\__||_|   \\___/|_____/ |_||_| |_| |_|");
+	wmove(splash_screen, x+6, y);
+	wprintw(splash_screen, "                    __     ___   _                  ");
+	wmove(splash_screen, x+7, y);
+	wprintw(splash_screen, "                   /_ |   / _ \\ | |                 ");
+	wmove(splash_screen, x+8, y);
+	wprintw(splash_screen, "             __   __| |  | | | || |__               ");
+	wmove(splash_screen, x+9, y);
+	wprintw(splash_screen, "             \\ \\ / /| |  | | | || '_ \\              ");
+	wmove(splash_screen, x+10, y);
+	wprintw(splash_screen, "              \\ V / | | _| |_| || |_) |             ");
+	wmove(splash_screen, x+11, y);
+	wprintw(splash_screen, "               \\_/  |_|(_)\\___/ |_.__/              ");
+	wrefresh(splash_screen);
+	sleep(SPLASH_TIME);
+	werase(splash_screen);
+}
+
+//Replication vars, run r of policy c is result r*replication_policy_count+c
+struct Replication{
+	double throughput;
+	double max_queue_length;
+	double blocked_ticks;
+	double wait_mean;
+	double wait_p99;
+	double utilisation;
+};
+
+//A replication metric, name is how --until refers to it
+struct ReplicationMetric{
+	const char *name;
+	const char *label;
+	size_t offset;
+};
+
+const struct ReplicationMetric replication_metrics[REPLICATION_METRICS] = {
+	{"throughput", "Throughput (trains/tick)", offsetof(struct Replication, throughput)},
+	{"max_queue", "Max queue length", offsetof(struct Replication, max_queue_length)},
+	{"blocked", "Blocked ticks", offsetof(struct Replication, blocked_ticks)},
+	{"wait", "Mean wait (ticks)", offsetof(struct Replication, wait_mean)},
+	{"wait_p99", "Wait p99 (ticks)", offsetof(struct Replication, wait_p99)},
+	{"utilisation", "Tunnel utilisation", offsetof(struct Replication, utilisation)}
+};
+
+struct Replication *replication_results = NULL;
+struct Policy *replication_policies = NULL;
+int replication_policy_count = 1;
+int replication_count = 0;
+int next_replication = 0;
+uint64_t replication_seed = 0;
+pthread_mutex_t replication_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * One headless run under the given policy. Run r is on seed+r, with
+ * --antithetic runs 2k and 2k+1 are a pair on seed+k, the second mirrored.
+ * Every policy gets the same seeds, so compared policies see the same
+ * arrival streams.
+ */
+void run_replication(struct Policy *run_policy, int run, struct Replication *result){
+	struct SimParams params = run_params(probability, simulation_time, replication_seed+(antithetic?run/2:run));
+	struct Simulation *sim = sim_create(&params);
+	if(antithetic&&run%2==1)sim_antithetic(sim);
+	sim->policy = *run_policy;
+	//Parallel replications already keep the cores busy
+	if(sim->worker_limit<=0)sim->worker_limit = 1;
+	run_simulation(sim);
+	result->throughput = (double)sim->released_trains/(sim->simulation_time+1);
+	result->max_queue_length = sim->max_queue_length;
+	result->blocked_ticks = sim->blocked_ticks;
+	result->wait_mean = sim->train_stats.wait.count>0?(double)sim->train_stats.wait.sum/sim->train_stats.wait.count:0.0;
+	result->wait_p99 = delay_quantile(&sim->train_stats.wait, 0.99);
+	result->utilisation = (double)sim->busy_ticks/((double)topology->section_count*(sim->simulation_time+1));
+	sim_destroy(sim);
+}
+
+void *replication_worker(void *arg){
+	for(;;){
+		pthread_mutex_lock(&replication_mutex);
+		int i = next_replication++;
+		pthread_mutex_unlock(&replication_mutex);
+		if(i>=replication_count*replication_policy_count)break;
+		run_replication(&replication_policies[i%replication_policy_count], i/replication_policy_count, &replication_results[i]);
+	}
+	return NULL;
+}
+
+//Two sided 95% Student t quantiles for 1 to 30 degrees of freedom
+double t_quantile(int df){
+	static const double table[30] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+	};
+	if(df<1)return 0.0;
+	if(df<=30)return table[df-1];
+	return 1.960;
+}
+
+/*
+ * Mean, 95% confidence half-width and standard deviation of a metric over
+ * count runs, taking every stride-th result. Antithetic pairs are averaged
+ * first, only the pairs are independent.
+ */
+void metric_interval(const struct Replication *results, int count, int stride, size_t offset, double *mean, double *half, double *sd){
+	int group = antithetic?2:1;
+	int n = count/group;
+	double sum = 0.0, sum_sq = 0.0;
+	for(int k = 0; k<n; k++){
+		double v = 0.0;
+		for(int g = 0; g<group; g++)v+=*(const double *)((const char *)&results[(k*group+g)*stride]+offset)/group;
+		sum+=v;
+		sum_sq+=v*v;
+	}
+	*mean = n>0?sum/n:0.0;
+	double var = (n>1)?(sum_sq-n*(*mean)*(*mean))/(n-1):0.0;
+	if(var<0)var=0;
+	*half = t_quantile(n-1)*sqrt(var/n);
+	*sd = sqrt(var);
+}
+
+void print_metric(const struct ReplicationMetric *m){
+	double mean, half, sd;
+	metric_interval(replication_results, replication_count, 1, m->offset, &mean, &half, &sd);
+	printf("%-26s %12.4f  [%12.4f, %12.4f] %12.4f\n", m->label, mean, mean-half, mean+half, sd);
+}
+
+/*
+ * Runs replications of every policy on --jobs threads, starting with
+ * replication_count runs each. With --until, batches are added until the
+ * metric's half-width is on target for every policy or --max-replications
+ * is reached. A half-width shrinks with the square root of the runs, so the
+ * next batch is sized from the widest interval so far. Returns whether the
+ * target was reached.
+ */
+int run_replication_batches(){
+	int group = antithetic?2:1;
+	int runs = (replication_count+group-1)/group*group;
+	int done = 0;
+	pthread_t *threads = malloc(jobs*sizeof(pthread_t));
+	for(;;){
+		replication_results = realloc(replication_results, runs*replication_policy_count*sizeof(struct Replication));
+		next_replication = done*replication_policy_count;
+		replication_count = runs;
+		for(int i = 0; i<jobs; i++)pthread_create(&threads[i], NULL, replication_worker, NULL);
+		for(int i = 0; i<jobs; i++)pthread_join(threads[i], NULL);
+		done = runs;
+		if(until_metric<0)break;
+		int wanted = runs;
+		for(int c = 0; c<replication_policy_count; c++){
+			double mean, half, sd;
+			metric_interval(replication_results+c, runs, replication_policy_count, replication_metrics[until_metric].offset, &mean, &half, &sd);
+			if(half<=until_half_width)continue;
+			double units = (runs/group)*(half/until_half_width)*(half/until_half_width);
+			int estimate = (int)ceil(units*1.1)*group;
+			if(estimate>wanted)wanted = estimate;
+		}
+		if(wanted==runs)break;
+		//Early variance estimates are rough, grow at most twofold per batch
+		if(wanted>2*runs)wanted = 2*runs;
+		if(wanted<runs+group)wanted = runs+group;
+		if(wanted>max_replications)wanted = max_replications/group*group;
+		//At the cap, or an odd cap leaves no room for another antithetic pair
+		if(wanted<=runs){
+			free(threads);
+			return 0;
+		}
+		runs = wanted;
+	}
+	free(threads);
+	return 1;
+}
+
+//Stopping line of an adaptive run
+void print_until(int reached){
+	const struct ReplicationMetric *m = &replication_metrics[until_metric];
+	if(reached){
+		printf("Stopped after %d runs, %s half-width at most %g\n", replication_count, m->name, until_half_width);
+	}else{
+		printf("Stopped after %d runs at --max-replications %d before the %s half-width reached %g\n", replication_count, max_replications, m->name, until_half_width);
+	}
+}
+
+int run_replications(){
+	struct timespec wall_start, wall_end;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	replication_seed = seed;
+	replication_policies = &policy;
+	replication_policy_count = 1;
+	replication_count = replications;
+	int reached = run_replication_batches();
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	double elapsed = (wall_end.tv_sec-wall_start.tv_sec)+(wall_end.tv_nsec-wall_start.tv_nsec)/1e9;
+
+	printf("MetroSim %s replications, n=%d jobs=%d engine=%s s=%d p=%f seed=%llu%s\n", PROGRAM_VERSION, replication_count, jobs, engine_names[engine], simulation_time, probability, (unsigned long long)seed, antithetic?" antithetic":"");
+	printf("%-26s %12s  %-29s %12s\n", "Metric", "Mean", "95% confidence interval", "Std dev");
+	for(int m = 0; m<REPLICATION_METRICS; m++)print_metric(&replication_metrics[m]);
+	if(until_metric>=0)print_until(reached);
+	printf("Wall time: %.3f s\n", elapsed);
+
+	free(replication_results);
+	replication_results = NULL;
+	return 0;
+}
+
+//Comparison vars
+struct PolicyRank{
+	struct Policy policy;
+	int index;
+	struct Replication mean;
+};
+
+struct Policy *compare_list = NULL;
+int compare_count = 0;
+
+//Appends a RELEASE[/ADMISSION] entry to the comparison, spec is modified
+int add_compare_policy(char *spec){
+	if(compare_count==POLICY_LIST_MAX){
+		printf("At most %d policies can be compared\n", POLICY_LIST_MAX);
+		return POLICY_ERR;
+	}
+	struct Policy *p = &compare_list[compare_count];
+	*p = policy;
+	char *admission = strchr(spec, '/');
+	if(admission!=NULL)*admission++ = '\0';
+	if(parse_release(spec, p)!=0||(admission!=NULL&&parse_admission(admission, p)!=0)){
+		printf("Unknown policy '%s%s%s'\n", spec, admission!=NULL?"/":"", admission!=NULL?admission:"");
+		return POLICY_ERR;
+	}
+	compare_count++;
+	return 0;
+}
+
+//Higher throughput first, then lower wait p99, then busier tunnels
+int compare_ranks(const void *a, const void *b){
+	const struct Replication *x = &((const struct PolicyRank *)a)->mean;
+	const struct Replication *y = &((const struct PolicyRank *)b)->mean;
+	if(x->throughput!=y->throughput)return x->throughput>y->throughput?-1:1;
+	if(x->wait_p99!=y->wait_p99)return x->wait_p99<y->wait_p99?-1:1;
+	if(x->utilisation!=y->utilisation)return x->utilisation>y->utilisation?-1:1;
+	return 0;
+}
+
+/*
+ * The --until metric of every policy with its half-width, and its paired
+ * difference from the first ranked policy. The policies ran on the same
+ * seeds, so the difference has a narrower interval than either metric.
+ */
+void print_compare_differences(struct PolicyRank *ranks){
+	const struct ReplicationMetric *m = &replication_metrics[until_metric];
+	struct Replication *differences = calloc(replication_count, sizeof(struct Replication));
+	printf("%-4s %-28s %14s %10s %14s %10s\n", "Rank", "Policy", m->name, "+/-", "vs rank 1", "+/-");
+	for(int c = 0; c<compare_count; c++){
+		double mean, half, sd;
+		metric_interval(replication_results+ranks[c].index, replication_count, compare_count, m->offset, &mean, &half, &sd);
+		for(int r = 0; r<replication_count; r++){
+			const char *own = (const char *)&replication_results[r*compare_count+ranks[c].index];
+			const char *best = (const char *)&replication_results[r*compare_count+ranks[0].index];
+			*(double *)((char *)&differences[r]+m->offset) = *(const double *)(own+m->offset)-*(const double *)(best+m->offset);
+		}
+		double difference, difference_half;
+		metric_interval(differences, replication_count, 1, m->offset, &difference, &difference_half, &sd);
+		printf("%-4d %-28s %14.4f %10.4f %14.4f %10.4f\n", c+1, ranks[c].policy.name, mean, half, difference, difference_half);
+	}
+	free(differences);
+}
+
+/*
+ * Runs every RELEASE[/ADMISSION] entry of list on the same seeds, -r runs
+ * each or one, spread over --jobs threads, and prints them ranked. Entries
+ * start from the --release and --admission policy, all compares the release
+ * policies under the current admission policy.
+ */
+int run_policy_comparison(const char *list){
+	char *specs = strdup(list);
+	compare_list = calloc(POLICY_LIST_MAX, sizeof(struct Policy));
+	compare_count = 0;
+	int status = 0;
+	for(char *save, *spec = strtok_r(specs, ",", &save); spec!=NULL&&status==0; spec = strtok_r(NULL, ",", &save)){
+		if(strcmp(spec, "all")==0){
+			for(size_t i = 0; i<RELEASE_POLICIES&&status==0; i++){
+				char name[POLICY_NAME_LENGTH];
+				snprintf(name, sizeof(name), "%s", release_policies[i].name);
+				status = add_compare_policy(name);
+			}
+		}else{
+			status = add_compare_policy(spec);
+		}
+	}
+	free(specs);
+	if(status==0&&compare_count==0){
+		printf("No policies to compare\n");
+		status = POLICY_ERR;
+	}
+	if(status!=0){
+		free(compare_list);
+		return status;
+	}
+
+	struct timespec wall_start, wall_end;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	replication_seed = seed;
+	replication_policies = compare_list;
+	replication_policy_count = compare_count;
+	replication_count = replications>0?replications:1;
+	int reached = run_replication_batches();
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	double elapsed = (wall_end.tv_sec-wall_start.tv_sec)+(wall_end.tv_nsec-wall_start.tv_nsec)/1e9;
+
+	int runs = replication_count;
+	struct PolicyRank *ranks = calloc(compare_count, sizeof(struct PolicyRank));
+	for(int c = 0; c<compare_count; c++){
+		ranks[c].policy = compare_list[c];
+		ranks[c].index = c;
+		for(int r = 0; r<runs; r++){
+			struct Replication *result = &replication_results[r*compare_count+c];
+			ranks[c].mean.throughput += result->throughput/runs;
+			ranks[c].mean.max_queue_length += result->max_queue_length/runs;
+			ranks[c].mean.blocked_ticks += result->blocked_ticks/runs;
+			ranks[c].mean.wait_mean += result->wait_mean/runs;
+			ranks[c].mean.wait_p99 += result->wait_p99/runs;
+			ranks[c].mean.utilisation += result->utilisation/runs;
+		}
+	}
+	qsort(ranks, compare_count, sizeof(struct PolicyRank), compare_ranks);
+
+	printf("MetroSim %s policy comparison, runs=%d jobs=%d engine=%s s=%d p=%f seed=%llu%s\n", PROGRAM_VERSION, runs, jobs, engine_names[engine], simulation_time, probability, (unsigned long long)seed, antithetic?" antithetic":"");
+	printf("%-4s %-28s %12s %10s %11s %10s %10s\n", "Rank", "Policy", "Throughput", "Wait p99", "Utilisation", "Max queue", "Blocked");
+	for(int c = 0; c<compare_count; c++){
+		struct Replication *m = &ranks[c].mean;
+		printf("%-4d %-28s %12.4f %10.1f %10.1f%% %10.1f %10.1f\n", c+1, ranks[c].policy.name, m->throughput, m->wait_p99, 100*m->utilisation, m->max_queue_length, m->blocked_ticks);
+	}
+	if(until_metric>=0){
+		print_compare_differences(ranks);
+		print_until(reached);
+	}
+	printf("Wall time: %.3f s\n", elapsed);
+
+	free(ranks);
+	free(replication_results);
+	replication_results = NULL;
+	free(compare_list);
+	return 0;
+}
+//Sweep vars, the last axis changes fastest from one point to the next
+struct SweepAxis{
+	double from;
+	double step;
+	int count;
+};
+
+const char *sweep_axis_names[SWEEP_AXES] = {"p", "breakdown", "block"};
+struct SweepAxis sweep_axes[SWEEP_AXES];
+int sweep_axis_set[SWEEP_AXES];
+int *sweep_pending = NULL;
+int sweep_pending_count = 0;
+int next_sweep = 0;
+uint64_t sweep_seed = 0;
+//Block threshold reported when the block axis is not swept, -1 when sections differ or none applies
+int sweep_block = -1;
+FILE *sweep_out = NULL;
+
+//Parses NAME=FROM[:TO[:STEP]] into its axis, 0 on success. Modifies spec.
+int parse_sweep_axis(char *spec){
+	char *value = strchr(spec, '=');
+	if(value==NULL)return -1;
+	*value++ = '\0';
+	int a = 0;
+	while(a<SWEEP_AXES&&strcmp(spec, sweep_axis_names[a])!=0)a++;
+	if(a==SWEEP_AXES)return -1;
+	//Block thresholds step by one unless told otherwise
+	double v[3] = {0, 0, a==SWEEP_BLOCK?1:0};
+	int n = 0;
+	char *end = value;
+	for(char *p = value; n<3; p = end+1){
+		v[n++] = strtod(p, &end);
+		if(end==p||(*end!='\0'&&*end!=':'))return -1;
+		if(*end=='\0')break;
+	}
+	if(*end!='\0')return -1;
+	if(n==1)v[1] = v[0];
+	if(v[1]<v[0]||(v[1]>v[0]&&v[2]<=0))return -1;
+	if(a!=SWEEP_BLOCK&&(v[0]<0||v[1]>1))return -1;
+	if(a==SWEEP_BLOCK&&(v[0]<1||v[0]!=floor(v[0])||v[2]!=floor(v[2])))return -1;
+	sweep_axes[a].from = v[0];
+	sweep_axes[a].step = v[2]>0?v[2]:1;
+	//The end is included when the steps land on it up to rounding
+	sweep_axes[a].count = (int)floor((v[1]-v[0])/sweep_axes[a].step+1e-9)+1;
+	sweep_axis_set[a] = 1;
+	return 0;
+}
+
+//Values of every axis at a grid point
+void sweep_point(int point, double *values){
+	for(int a = SWEEP_AXES-1; a>=0; a--){
+		values[a] = sweep_axes[a].from+(point%sweep_axes[a].count)*sweep_axes[a].step;
+		point /= sweep_axes[a].count;
+	}
+}
+
+//Leading columns of a point's row, the part a resumed sweep matches on. Returns its length.
+int sweep_key(int point, char *key, size_t size){
+	double v[SWEEP_AXES];
+	sweep_point(point, v);
+	const char *run_engine = engine_names[engine];
+	int block_value = sweep_axis_set[SWEEP_BLOCK]?(int)lround(v[SWEEP_BLOCK]):sweep_block;
+	char block[16] = "";
+	if(block_value>=0){
+		snprintf(block, sizeof(block), "%d", block_value);
+	}else if(sweep_json){
+		snprintf(block, sizeof(block), "null");
+	}
+	if(sweep_json){
+		return snprintf(key, size, "{\"p\": %g, \"breakdown\": %g, \"block\": %s, \"ticks\": %d, \"seed\": %llu, \"engine\": \"%s\", \"policy\": \"%s\", ", v[SWEEP_P], v[SWEEP_BREAKDOWN], block, simulation_time, (unsigned long long)sweep_seed, run_engine, policy.name);
+	}
+	return snprintf(key, size, "%g,%g,%s,%d,%llu,%s,%s,", v[SWEEP_P], v[SWEEP_BREAKDOWN], block, simulation_time, (unsigned long long)sweep_seed, run_engine, policy.name);
+}
+
+/*
+ * Runs grid points until none are left. Each thread keeps one simulation
+ * and resets it between points, so queues, histograms and the event heap
+ * are allocated once per thread rather than once per point.
+ */
+void *sweep_worker(void *arg){
+	struct Simulation *sim = NULL;
+	char row[SWEEP_ROW_MAX];
+	for(;;){
+		pthread_mutex_lock(&replication_mutex);
+		int i = next_sweep++;
+		pthread_mutex_unlock(&replication_mutex);
+		if(i>=sweep_pending_count)break;
+		int point = sweep_pending[i];
+		double v[SWEEP_AXES];
+		sweep_point(point, v);
+		struct SimParams params = run_params(v[SWEEP_P], simulation_time, sweep_seed);
+		params.breakdown = v[SWEEP_BREAKDOWN];
+		params.policy.high = (int)lround(v[SWEEP_BLOCK]);
+		if(sim==NULL){
+			sim = sim_create(&params);
+		}else{
+			sim_reset(sim, &params);
+		}
+		//Points already run in parallel
+		if(sim->worker_limit<=0)sim->worker_limit = 1;
+		run_simulation(sim);
+		int length = sweep_key(point, row, sizeof(row));
+		double ticks = sim->simulation_time+1;
+		double throughput = sim->released_trains/ticks;
+		double blocked = sim->blocked_ticks/(topology->section_count*ticks);
+		double utilisation = sim->busy_ticks/(topology->section_count*ticks);
+		int p50 = delay_quantile(&sim->train_stats.wait, 0.5);
+		int p95 = delay_quantile(&sim->train_stats.wait, 0.95);
+		int p99 = delay_quantile(&sim->train_stats.wait, 0.99);
+		if(sweep_json){
+			snprintf(row+length, sizeof(row)-length, "\"throughput\": %.6f, \"wait_p50\": %d, \"wait_p95\": %d, \"wait_p99\": %d, \"blocked_fraction\": %.6f, \"utilisation\": %.6f, \"max_queue\": %d}\n", throughput, p50, p95, p99, blocked, utilisation, sim->max_queue_length);
+		}else{
+			snprintf(row+length, sizeof(row)-length, "%.6f,%d,%d,%d,%.6f,%.6f,%d\n", throughput, p50, p95, p99, blocked, utilisation, sim->max_queue_length);
+		}
+		//Whole rows only, so an interrupted sweep leaves at most one cut short
+		pthread_mutex_lock(&replication_mutex);
+		fputs(row, sweep_out);
+		fflush(sweep_out);
+		pthread_mutex_unlock(&replication_mutex);
+	}
+	if(sim!=NULL)sim_destroy(sim);
+	return NULL;
+}
+
+int compare_rows(const void *a, const void *b){
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//Finds a row starting with key, rows sorted by compare_rows
+int sweep_row_exists(char **rows, int count, const char *key, size_t length){
+	int low = 0, high = count;
+	while(low<high){
+		int mid = (low+high)/2;
+		int c = strncmp(rows[mid], key, length);
+		if(c==0)return 1;
+		if(c<0){
+			low = mid+1;
+		}else{
+			high = mid;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Opens the results file for appending and lists the points it does not
+ * have yet. A row cut short by an interruption is dropped. Unseeded sweeps
+ * continue with the seed of the rows already written. 0 on success.
+ */
+int sweep_open(const char *path, int points){
+	char *data = NULL;
+	size_t size = 0;
+	FILE *in = fopen(path, "r");
+	if(in!=NULL){
+		fseek(in, 0, SEEK_END);
+		size = ftell(in);
+		rewind(in);
+		data = malloc(size+1);
+		if(fread(data, 1, size, in)!=size){
+			fclose(in);
+			free(data);
+			printf("Cannot read sweep results %s\n", path);
+			return LOG_OPEN_ERR;
+		}
+		fclose(in);
+		while(size>0&&data[size-1]!='\n')size--;
+		data[size] = '\0';
+		if(truncate(path, size)!=0){
+			free(data);
+			printf("Cannot truncate sweep results %s\n", path);
+			return LOG_OPEN_ERR;
+		}
+	}
+	char **rows = malloc((size/2+1)*sizeof(char *));
+	int row_count = 0;
+	char *line = data;
+	if(!sweep_json&&size>0){
+		//CSV results start with the header of this format
+		char *newline = strchr(data, '\n');
+		*newline = '\0';
+		if(strcmp(data, SWEEP_CSV_HEADER)!=0){
+			printf("%s is not a sweep results file\n", path);
+			free(rows);
+			free(data);
+			return SWEEP_ERR;
+		}
+		line = newline+1;
+	}
+	for(char *newline; line<data+size; line = newline+1){
+		newline = strchr(line, '\n');
+		*newline = '\0';
+		rows[row_count++] = line;
+	}
+	if(row_count>0&&!seed_set){
+		unsigned long long row_seed;
+		const char *field = sweep_json?strstr(rows[0], "\"seed\": "):rows[0];
+		//The seed is the fifth CSV column, the block column before it may be empty
+		for(int c = 0; !sweep_json&&c<4&&field!=NULL; c++){
+			field = strchr(field, ',');
+			if(field!=NULL)field++;
+		}
+		int found = field!=NULL&&sscanf(field, sweep_json?"\"seed\": %llu":"%llu", &row_seed)==1;
+		if(found)sweep_seed = row_seed;
+	}
+	qsort(rows, row_count, sizeof(char *), compare_rows);
+	sweep_pending = malloc(points*sizeof(int));
+	sweep_pending_count = 0;
+	char key[SWEEP_ROW_MAX];
+	for(int i = 0; i<points; i++){
+		size_t length = sweep_key(i, key, sizeof(key));
+		if(!sweep_row_exists(rows, row_count, key, length))sweep_pending[sweep_pending_count++] = i;
+	}
+	free(rows);
+	free(data);
+	sweep_out = fopen(path, "a");
+	if(sweep_out==NULL){
+		printf("Cannot open sweep results %s\n", path);
+		return LOG_OPEN_ERR;
+	}
+	if(!sweep_json&&size==0)fprintf(sweep_out, "%s\n", SWEEP_CSV_HEADER);
+	return 0;
+}
+
+/*
+ * Runs every point of the --sweep grid headless on --jobs threads, one per
+ * core by default, and appends a row per point to the results file. The
+ * axes not swept take the run's -p, --breakdown and --admission threshold.
+ * Every point uses the same seed, so points differ only in their parameters.
+ */
+int run_sweep(const char *spec){
+	char *specs = strdup(spec);
+	memset(sweep_axis_set, 0, sizeof(sweep_axis_set));
+	int status = 0;
+	for(char *save, *axis = strtok_r(specs, ",", &save); axis!=NULL&&status==0; axis = strtok_r(NULL, ",", &save)){
+		char *copy = strdup(axis);
+		if(parse_sweep_axis(copy)!=0){
+			printf("Invalid sweep axis '%s', expected p=FROM:TO:STEP, breakdown=FROM:TO:STEP or block=FROM:TO[:STEP]\n", axis);
+			status = SWEEP_ERR;
+		}
+		free(copy);
+	}
+	free(specs);
+	if(status!=0)return status;
+	double fixed[SWEEP_AXES] = {probability, breakdown, policy.high};
+	for(int a = 0; a<SWEEP_AXES; a++){
+		if(!sweep_axis_set[a])sweep_axes[a] = (struct SweepAxis){fixed[a], 1, 1};
+	}
+	//A fixed block column shows the threshold the runs use, the topology's when no --admission HIGH is set
+	if(policy.admission->accept==admission_cap_accept){
+		sweep_block = -1;
+	}else if(policy.high>0){
+		sweep_block = policy.high;
+	}else{
+		sweep_block = topology->block_threshold[0];
+		for(int s = 1; s<topology->section_count; s++){
+			if(topology->block_threshold[s]!=sweep_block)sweep_block = -1;
+		}
+	}
+	if(sweep_axis_set[SWEEP_BLOCK]){
+		if(policy.admission->accept==admission_cap_accept){
+			printf("The block axis needs the hysteresis admission policy\n");
+			return SWEEP_ERR;
+		}
+		if(sweep_axes[SWEEP_BLOCK].from<=policy.low){
+			printf("Block thresholds must be above the admission low mark %d\n", policy.low);
+			return SWEEP_ERR;
+		}
+	}
+	long long points = 1;
+	for(int a = 0; a<SWEEP_AXES; a++)points *= sweep_axes[a].count;
+	if(points>SWEEP_POINTS_MAX){
+		printf("Sweep of %lld points is over the limit of %d\n", points, SWEEP_POINTS_MAX);
+		return SWEEP_ERR;
+	}
+
+	sweep_seed = seed;
+	status = sweep_open(sweep_file, points);
+	if(status!=0)return status;
+	int threads = jobs_set?jobs:(int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads>sweep_pending_count)threads = sweep_pending_count;
+
+	struct timespec wall_start, wall_end;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	pthread_t *pool = malloc(threads*sizeof(pthread_t));
+	for(int i = 0; i<threads; i++)pthread_create(&pool[i], NULL, sweep_worker, NULL);
+	for(int i = 0; i<threads; i++)pthread_join(pool[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	double elapsed = (wall_end.tv_sec-wall_start.tv_sec)+(wall_end.tv_nsec-wall_start.tv_nsec)/1e9;
+	fclose(sweep_out);
+
+	printf("MetroSim %s sweep, points=%lld jobs=%d engine=%s s=%d seed=%llu policy=%s\n", PROGRAM_VERSION, points, threads, engine_names[engine], simulation_time, (unsigned long long)sweep_seed, policy.name);
+	for(int a = 0; a<SWEEP_AXES; a++){
+		struct SweepAxis *x = &sweep_axes[a];
+		printf("%-10s %g to %g, %d values\n", sweep_axis_names[a], x->from, x->from+(x->count-1)*x->step, x->count);
+	}
+	printf("Ran %d points, %lld were already in %s\n", sweep_pending_count, points-sweep_pending_count, sweep_file);
+	printf("Wall time: %.3f s\n", elapsed);
+	free(pool);
+	free(sweep_pending);
+	return 0;
+}
+
+/*
+ * Converts a binary event log into the text train and control logs a text
+ * run would have written. HH:MM:SS-events.bin becomes HH:MM:SS-train.log and
+ * HH:MM:SS-control.log, other names get the suffixes appended.
+ */
+int logdump(const char *path){
+	FILE *in = fopen(path, "rb");
+	if(in==NULL){
+		printf("Cannot open event log %s\n", path);
+		return LOG_OPEN_ERR;
+	}
+	struct LogHeader header;
+	if(fread(&header, sizeof(header), 1, in)!=1||memcmp(header.magic, LOG_MAGIC, 8)!=0||header.version!=LOG_VERSION||header.record_size!=sizeof(struct LogRecord)){
+		printf("%s is not a MetroSim event log\n", path);
+		fclose(in);
+		return LOG_FORMAT_ERR;
+	}
+	//Only the name tables are needed to render records
+	struct Topology names = {0};
+	names.place_count = header.place_count;
+	names.section_count = header.section_count;
+	names.place_names = malloc(header.place_count*NAME_LENGTH+1);
+	names.section_names = malloc(header.section_count*NAME_LENGTH+1);
+	if(fread(names.place_names, NAME_LENGTH, header.place_count, in)!=header.place_count||fread(names.section_names, NAME_LENGTH, header.section_count, in)!=header.section_count){
+		printf("%s is truncated\n", path);
+		fclose(in);
+		return LOG_FORMAT_ERR;
+	}
+	size_t base_length = strlen(path);
+	const char *suffix = "-events.bin";
+	if(base_length>=strlen(suffix)&&strcmp(path+base_length-strlen(suffix), suffix)==0)base_length-=strlen(suffix);
+	char *train_file = malloc(base_length+16);
+	char *control_file = malloc(base_length+16);
+	snprintf(train_file, base_length+16, "%.*s-train.log", (int)base_length, path);
+	snprintf(control_file, base_length+16, "%.*s-control.log", (int)base_length, path);
+	FILE *train = fopen(train_file, "w");
+	FILE *control = fopen(control_file, "w");
+	if(train==NULL||control==NULL){
+		printf("Cannot create %s and %s\n", train_file, control_file);
+		return LOG_OPEN_ERR;
+	}
+	setvbuf(train, NULL, _IOFBF, LOG_WRITE_BUFFER);
+	setvbuf(control, NULL, _IOFBF, LOG_WRITE_BUFFER);
+
+	struct LogRecord *records = malloc(LOG_RING_CAPACITY*sizeof(struct LogRecord));
+	long long total = 0;
+	//Seconds wrap after about 18 hours, later offsets are rebuilt from the order
+	int64_t wrap = 0;
+	int last_seconds = 0;
+	time_t stamp_time = -1;
+	struct tm stamp;
+	size_t n;
+	while((n = fread(records, sizeof(struct LogRecord), LOG_RING_CAPACITY, in))>0){
+		for(size_t i = 0; i<n; i++){
+			if(records[i].seconds<last_seconds)wrap+=65536;
+			last_seconds = records[i].seconds;
+			time_t t = header.start_time+wrap+records[i].seconds;
+			if(t!=stamp_time){
+				localtime_r(&t, &stamp);
+				stamp_time = t;
+			}
+			write_log_record(train, control, &names, &header, &records[i], &stamp);
+		}
+		total+=n;
+	}
+	printf("Converted %lld records into %s and %s\n", total, train_file, control_file);
+	free(records);
+	free(names.place_names);
+	free(names.section_names);
+	fclose(in);
+	fclose(train);
+	fclose(control);
+	free(train_file);
+	free(control_file);
+	return 0;
+}
+
+struct arguments {
+	float p;
+	int s;
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state){
+
+	struct arguments *args = state->input;
+
+	switch(key){
 		case 'p':
 			probability = atof(arg);
+			probability_set = 1;
 			break;
 		case 's':
 			simulation_time = atoi(arg);
+			simulation_time_set = 1;
+			break;
+		case 'H':
+			headless = 1;
+			break;
+		case 'e':
+			if(strcmp(arg, "tick")==0){
+				engine = ENGINE_TICK;
+			}else if(strcmp(arg, "des")==0){
+				engine = ENGINE_DES;
+				headless = 1;
+			}else if(strcmp(arg, "regions")==0){
+				engine = ENGINE_REGIONS;
+				headless = 1;
+			}else{
+				argp_error(state, "unknown engine '%s'", arg);
+			}
+			break;
+		case 'r':
+			replications = atoi(arg);
+			if(replications<1)argp_error(state, "replications must be at least 1");
+			headless = 1;
+			break;
+		case 'j':
+			jobs = atoi(arg);
+			if(jobs<1)argp_error(state, "jobs must be at least 1");
+			jobs_set = 1;
+			break;
+		case 'L':
+			if(strcmp(arg, "text")==0){
+				binary_log = 0;
+			}else if(strcmp(arg, "binary")==0){
+				binary_log = 1;
+			}else{
+				argp_error(state, "unknown log format '%s'", arg);
+			}
+			break;
+		case 'D':
+			logdump_file = arg;
+			break;
+		case 'S':
+			seed = strtoull(arg, NULL, 0);
+			seed_set = 1;
+			break;
+		case 'T':
+			topology_file = arg;
+			break;
+		case 'M':
+			stats_file = arg;
+			break;
+		case OPT_STATS_INTERVAL:
+			stats_interval = atof(arg);
+			if(stats_interval<=0)argp_error(state, "stats interval must be positive");
+			break;
+		case OPT_STATS_OVERLAY:
+			stats_overlay = 1;
+			break;
+		case OPT_RELEASE:
+			if(parse_release(arg, &policy)!=0)argp_error(state, "unknown release policy '%s'", arg);
+			release_set = 1;
+			break;
+		case OPT_ADMISSION:
+			if(parse_admission(arg, &policy)!=0)argp_error(state, "unknown admission policy '%s'", arg);
+			admission_set = 1;
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_file = arg;
+			break;
+		case OPT_CHECKPOINT_EVERY:
+			checkpoint_every = atoi(arg);
+			if(checkpoint_every<1)argp_error(state, "checkpoint interval must be at least 1");
+			break;
+		case OPT_RESUME:
+			resume_file = arg;
+			break;
+		case OPT_BREAKDOWN:
+			breakdown = atof(arg);
+			if(breakdown<0||breakdown>1)argp_error(state, "breakdown probability must be between 0 and 1");
+			breakdown_set = 1;
+			break;
+		case OPT_WHAT_IF:
+			what_if_count = 0;
+			for(char *save, *spec = strtok_r(arg, ",", &save); spec!=NULL; spec = strtok_r(NULL, ",", &save)){
+				if(what_if_count==WHAT_IF_MAX)argp_error(state, "at most %d what-if branches", WHAT_IF_MAX);
+				char label[POLICY_NAME_LENGTH];
+				snprintf(label, sizeof(label), "%s", spec);
+				if(parse_what_if(spec, &what_ifs[what_if_count++])!=0)argp_error(state, "unknown what-if '%s'", label);
+			}
+			break;
+		case OPT_WHAT_IF_AT:
+			what_if_at = atoi(arg);
+			break;
+		case OPT_WHAT_IF_HORIZON:
+			what_if_horizon = atoi(arg);
+			if(what_if_horizon<1)argp_error(state, "what-if horizon must be at least 1");
+			break;
+		case OPT_SERIES:
+			series_file = arg;
+			break;
+		case OPT_HISTORY:
+			history_file = arg;
+			break;
+		case OPT_TICK_DELAY:
+			tick_delay = atoi(arg);
+			if(tick_delay<0)argp_error(state, "tick delay must not be negative");
+			break;
+		case OPT_UNTIL:{
+			char *colon = strchr(arg, ':');
+			char *end = NULL;
+			until_metric = -1;
+			for(int m = 0; colon!=NULL&&m<REPLICATION_METRICS; m++){
+				if((size_t)(colon-arg)==strlen(replication_metrics[m].name)&&strncmp(arg, replication_metrics[m].name, colon-arg)==0)until_metric = m;
+			}
+			if(until_metric>=0)until_half_width = strtod(colon+1, &end);
+			if(until_metric<0||*end!='\0'||until_half_width<=0)argp_error(state, "invalid --until '%s', expected METRIC:HALF_WIDTH", arg);
+			headless = 1;
+			break;
+		}
+		case OPT_MAX_REPLICATIONS:
+			max_replications = atoi(arg);
+			if(max_replications<2)argp_error(state, "max replications must be at least 2");
+			break;
+		case OPT_ANTITHETIC:
+			antithetic = 1;
+			break;
+		case OPT_SWEEP:
+			sweep_spec = arg;
+			headless = 1;
+			break;
+		case OPT_SWEEP_OUT:
+			sweep_file = arg;
+			sweep_json = strlen(arg)>=5&&strcmp(arg+strlen(arg)-5, ".json")==0;
+			break;
+		case OPT_FPS:
+			frame_rate = atoi(arg);
+			if(frame_rate<1)argp_error(state, "frame rate must be at least 1");
+			break;
+		case OPT_TRACE:
+			trace_file = arg;
+			break;
+		case OPT_TRACE_CONVERT:
+			trace_convert_file = arg;
+			break;
+		case OPT_COMPARE_POLICIES:
+			compare_policies = arg;
+			headless = 1;
+			break;
+		case 'w':
+			workers = atoi(arg);
+			if(workers<1)argp_error(state, "workers must be at least 1");
 			break;
 		default:
 			return ARGP_ERR_UNKNOWN;
@@ -723,6 +2928,77 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state){
 
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
+void print_delay_row(const char *name, struct DelayHistogram *wait, struct DelayHistogram *tunnel){
+	printf("%-15s %9u %6d %6d %6d %8d %6d %6d\n", name, wait->count, delay_quantile(wait, 0.5), delay_quantile(wait, 0.95), delay_quantile(wait, 0.99), delay_quantile(tunnel, 0.5), delay_quantile(tunnel, 0.95), delay_quantile(tunnel, 0.99));
+}
+
+//Wait and tunnel quantiles in ticks, per origin and destination for small networks
+void print_train_stats(struct TrainStats *stats){
+	printf("Train wait:        p50 %d, p95 %d, p99 %d, max %u ticks\n", delay_quantile(&stats->wait, 0.5), delay_quantile(&stats->wait, 0.95), delay_quantile(&stats->wait, 0.99), stats->wait.max);
+	printf("Tunnel time:       p50 %d, p95 %d, p99 %d, max %u ticks\n", delay_quantile(&stats->tunnel, 0.5), delay_quantile(&stats->tunnel, 0.95), delay_quantile(&stats->tunnel, 0.99), stats->tunnel.max);
+	if(topology->place_count>SUMMARY_ROWS_MAX){
+		printf("Per origin and destination quantiles are exported with --stats\n");
+		return;
+	}
+	printf("%-15s %9s %6s %6s %6s %8s %6s %6s\n", "Origin", "Released", "Wait50", "95", "99", "Tunnel50", "95", "99");
+	for(int i = 0; i<topology->segment_count; i++)print_delay_row(topology->place_names[i], &stats->wait_by_origin[i], &stats->tunnel_by_origin[i]);
+	printf("%-15s %9s %6s %6s %6s %8s %6s %6s\n", "Destination", "Released", "Wait50", "95", "99", "Tunnel50", "95", "99");
+	for(int i = 0; i<topology->place_count; i++){
+		if(stats->wait_by_destination[i].count>0)print_delay_row(topology->place_names[i], &stats->wait_by_destination[i], &stats->tunnel_by_destination[i]);
+	}
+}
+
+void print_summary(struct Simulation *sim, struct timespec *start, struct timespec *end){
+	double elapsed = (end->tv_sec-start->tv_sec)+(end->tv_nsec-start->tv_nsec)/1e9;
+	printf("MetroSim %s headless run, s=%d p=%f seed=%llu\n", PROGRAM_VERSION, sim->simulation_time, sim->probability, (unsigned long long)sim->seed);
+	printf("Ticks simulated:   %d\n", sim->tick+1);
+	printf("Trains arrived:    %d\n", count_arrivals(sim));
+	printf("Trains released:   %d\n", sim->released_trains);
+	printf("Trains waiting:    %d\n", count_trains(sim));
+	printf("Max queue length:  %d\n", sim->max_queue_length);
+	printf("Blocked ticks:     %d\n", sim->blocked_ticks);
+	if(topology->section_count>1){
+		for(int s = 0; s<topology->section_count; s++){
+			printf("  Section %-*s released %d, blocked ticks %d\n", NAME_LENGTH-1, topology->section_names[s], sim->sections[s].released_trains, sim->sections[s].blocked_ticks);
+		}
+	}
+	printf("Wall time:         %.3f s (%.0f ticks/s)\n", elapsed, elapsed>0?(sim->tick+1)/elapsed:0.0);
+	if(sim->history!=NULL)printf("Train history:     %llu released trains, %.1f MB\n", (unsigned long long)sim->history->count, sim->history->count*sizeof(struct TrainRecord)/1e6);
+	print_train_stats(&sim->train_stats);
+	if(sim->stats!=NULL){
+		struct Histogram *merged = malloc(PHASE_COUNT*sizeof(struct Histogram));
+		stats_merge(sim, merged);
+		printf("%-14s %12s %10s %10s %10s\n", "Phase", "Count", "p50", "p99", "Max");
+		for(int p = 0; p<PHASE_COUNT; p++){
+			if(merged[p].count==0)continue;
+			char p50[16], p99[16], max[16];
+			format_duration(p50, sizeof(p50), hist_quantile(&merged[p], 0.5));
+			format_duration(p99, sizeof(p99), hist_quantile(&merged[p], 0.99));
+			format_duration(max, sizeof(max), merged[p].max);
+			printf("%-14s %12llu %10s %10s %10s\n", phase_names[p], (unsigned long long)merged[p].count, p50, p99, max);
+		}
+		free(merged);
+	}
+}
+
+//Branch points in order, the unchanged run first
+int compare_branch_results(const void *a, const void *b){
+	const struct BranchResult *x = a, *y = b;
+	if(x->tick!=y->tick)return x->tick<y->tick?-1:1;
+	return x->branch-y->branch;
+}
+
+void print_branch_results(){
+	if(branch_result_count==0)return;
+	qsort(branch_results, branch_result_count, sizeof(struct BranchResult), compare_branch_results);
+	printf("%-32s %6s %7s %12s %8s %9s %8s %8s %11s\n", "What-if", "Tick", "Horizon", "Throughput", "Wait p99", "Max queue", "Blocked", "Waiting", "Utilisation");
+	for(int i = 0; i<branch_result_count; i++){
+		struct BranchResult *r = &branch_results[i];
+		printf("%-32s %6d %7d %12.4f %8d %9d %8d %8d %10.1f%%\n", branch_label(r->branch), r->tick, r->horizon, (double)r->released_trains/r->horizon, r->wait_p99, r->max_queue_length, r->blocked_ticks, r->waiting_trains, 100*r->utilisation);
+	}
+}
+
+#ifndef METRO_BENCH
 int main(int argc, char **argv){
 
 	struct arguments args;
@@ -732,120 +3008,234 @@ int main(int argc, char **argv){
 	//probability=args.p;
 	//simulation_time=args.s;
 
-	//Start&Config ncurses
-	int ncurses_status = ncurses_init();
-	//Handle init errors for ncurses
-	if(ncurses_status<0){
-		//Print error code
-		printf("Ncurses: Error %d\n", ncurses_status);
-		//Print error description
-		if(ncurses_status == MIN_SIZE_MIS)printf("Minimum size mismatch, this program requires a terminal that is at least %dx%d\n", COLS_MIN,LINES_MIN);
-		//Return with error code
-		return ncurses_status;
-	}
-
-	//Splash screen
-	init_splash_screen();
-
-	int menu_option = init_menu_screen();
-	//Menu
-	while(menu_option!=MENU_START){
-		switch(menu_option){
-			case MENU_START:
-				break;
-			case MENU_SETTINGS:
-				clear();
-				refresh();
-				init_settings_menu();
-				//init settings menu
-				break;
-			case MENU_LOGS:
-				//switch to log viewer
-				break;
-			case MENU_HELP:
-				//show help
-				break;
-			case MENU_EXIT:
-				clear();
-				refresh();
-				exit(0);
-			default:
-				exit(INV_MENU_OPT);
+	//Log lines are formatted with the start time until a run refreshes it
+	time(&raw_time);
+	time_data = localtime(&raw_time);
+
+	//Unseeded runs pick a seed and report it so they can be reproduced
+	if(!seed_set)seed = (uint64_t)time(NULL)^((uint64_t)getpid()<<32);
+
+	if(logdump_file!=NULL)return logdump(logdump_file);
+
+	//Network to simulate, the built-in map unless a file is given
+	topology = (topology_file!=NULL)?topology_load(topology_file):topology_builtin();
+	if(topology==NULL)return TOPOLOGY_ERR;
+	queue_count = topology->segment_count;
+
+	//Recorded arrivals replace the drawn ones for every run
+	if(trace_file!=NULL){
+		arrival_trace = trace_load(trace_file);
+		if(arrival_trace==NULL)return TRACE_ERR;
+		if(trace_convert_file!=NULL){
+			if(trace_write(arrival_trace, trace_convert_file)!=0){
+				printf("Cannot write trace %s\n", trace_convert_file);
+				return LOG_OPEN_ERR;
+			}
+			printf("Wrote %llu arrivals to %s\n", (unsigned long long)((const struct TraceHeader *)arrival_trace->data)->record_count, trace_convert_file);
+			return 0;
 		}
-		menu_option=init_menu_screen();
+	}else if(trace_convert_file!=NULL){
+		printf("--trace-convert needs a --trace CSV to convert\n");
+		return TRACE_ERR;
 	}
 
-	//Open files
-	time(&raw_time);
-	time_data = localtime(&raw_time);
-	char train_log_file[19];
-	snprintf(train_log_file, 19, "%02d:%02d:%02d-train.log", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
-	char control_log_file[21];
-	snprintf(control_log_file, 21, "%02d:%02d:%02d-control.log", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
-	train_log = fopen(train_log_file, "w");
-	control_log = fopen(control_log_file, "w");
+	//Regions are never on one tick together, so there is no state to save, branch or record
+	if(engine==ENGINE_REGIONS&&(series_file!=NULL||checkpoint_every>0||resume_file!=NULL||what_if_count>0)){
+		printf("--engine regions cannot be used with --series, --checkpoint-every, --resume or --what-if\n");
+		return ENGINE_ERR;
+	}
 
-	//Init ncurses windows
-	ncurses_init_windows();
+	//Checkpoints do not hold the history, a resumed one would miss the trains released before it
+	if(history_file!=NULL&&resume_file!=NULL){
+		printf("--history cannot be used with --resume\n");
+		return CHECKPOINT_ERR;
+	}
+	//A segment takes at most one train a tick, so IDs stay below (ticks+1)*segments and origins stay recoverable
+	if(history_file!=NULL&&(uint64_t)(simulation_time+1)*topology->segment_count>UINT32_MAX){
+		printf("--history needs train IDs below 2^32, %d segments allow at most %llu ticks\n", topology->segment_count, (unsigned long long)(UINT32_MAX/topology->segment_count-1));
+		return HISTORY_ERR;
+	}
 
-	signal(SIGWINCH, sigwinch_handler);
+	if(sweep_spec!=NULL)return run_sweep(sweep_spec);
+	if(until_metric>=0&&replications==0)replications = ADAPTIVE_FIRST_RUNS;
+	if(compare_policies!=NULL)return run_policy_comparison(compare_policies);
+	if(replications>0)return run_replications();
 
-	//Init train queues
-	queue_status = calloc(queue_count, sizeof(int));
-	segment_colors = malloc(queue_count*sizeof(int));
+	//Saved runs are restored before the menus so they show the saved settings
+	struct Simulation *resumed = NULL;
+	if(resume_file!=NULL){
+		resumed = checkpoint_restore(resume_file);
+		if(resumed==NULL)return CHECKPOINT_ERR;
+	}
 
-	//Initial colors
-	for (int i = 0; i < queue_count; i++)segment_colors[i]=1;
+	if(!headless){
+		//Start&Config ncurses
+		int ncurses_status = ncurses_init();
+		//Handle init errors for ncurses
+		if(ncurses_status<0){
+			//Print error code
+			printf("Ncurses: Error %d\n", ncurses_status);
+			//Print error description
+			if(ncurses_status == MIN_SIZE_MIS)printf("Minimum size mismatch, this program requires a terminal that is at least %dx%d\n", COLS_MIN,LINES_MIN);
+			//Return with error code
+			return ncurses_status;
+		}
 
-	draw_map(segment_colors);
+		//Splash screen
+		init_splash_screen();
 
-	pthread_barrier_init(&tick_barrier, NULL, 5);
-	pthread_barrier_init(&main_barrier, NULL, 5);
-	for(int i = 0; i<4; i++){
-		pthread_create(&threads[i], NULL, segment_handler, i);
+		int menu_option = init_menu_screen();
+		//Menu
+		while(menu_option!=MENU_START){
+			switch(menu_option){
+				case MENU_START:
+					break;
+				case MENU_SETTINGS:
+					clear();
+					refresh();
+					init_settings_menu();
+					//init settings menu
+					break;
+				case MENU_LOGS:
+					clear();
+					refresh();
+					init_log_viewer();
+					break;
+				case MENU_HELP:
+					//show help
+					break;
+				case MENU_EXIT:
+					clear();
+					refresh();
+					exit(0);
+				default:
+					exit(INV_MENU_OPT);
+			}
+			menu_option=init_menu_screen();
+		}
 	}
 
-	log_control("[%02d:%02d:%02d][CONTROL] Starting simulation with s=%d p=%f\n", time_data->tm_hour, time_data->tm_min, time_data->tm_sec, simulation_time, probability);
+	//Create simulation with the final settings
+	struct Simulation *sim = resumed;
+	if(sim==NULL){
+		struct SimParams params = run_params(probability, simulation_time, seed);
+		sim = sim_create(&params);
+	}else{
+		sim->probability = probability;
+		if(simulation_time>=sim->tick)sim->simulation_time = simulation_time;
+	}
+	sim->timing = (stats_file!=NULL||stats_overlay);
+	if(history_file!=NULL&&sim->history==NULL)sim->history = history_create();
+	display_sim = sim;
+	sim->advanced = display_advanced;
 
-	for(;;){
-		pthread_barrier_wait(&tick_barrier);
-		int num_trains = count_trains();
-		if(num_trains>=10&&allow_trains==1){
-			allow_trains=0;
-			update_metro_container(RED_BLACK);
-			log_control("[%02d:%02d:%02d][CONTROL] Blocking incoming trains as total number of trains reached %d.\n", time_data->tm_hour, time_data->tm_min, time_data->tm_sec, num_trains);
-		}
-		if(num_trains==0){
-			allow_trains=1;
-			update_metro_container(GREEN_BLACK);
-			log_control("[%02d:%02d:%02d][CONTROL] Allowing incoming trains as total number of trains reached %d.\n", time_data->tm_hour, time_data->tm_min, time_data->tm_sec, num_trains);
-		}
-		releasing_segment_id = -1;
-		decide_releasing_queue();
-		char line[COLS-2];
-		if(releasing_segment_id!=-1){
-			log_control("[%02d:%02d:%02d][CONTROL] Signalling segment %c to release train with ID %04d.\n", time_data->tm_hour, time_data->tm_min, time_data->tm_sec, segment_names[releasing_segment_id], queue_leaders[releasing_segment_id].id);
-			snprintf(line, COLS-2, "[CONTROL] Signalling segment %c to release train with ID %04d.", segment_names[releasing_segment_id], queue_leaders[releasing_segment_id].id);
-		}else{
-			log_control("[%02d:%02d:%02d][CONTROL] Cannot release train, tunnel is busy.\n", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
-			snprintf(line, COLS-2, "[CONTROL] Cannot release train, tunnel is busy.");
+	//Open files
+	time(&raw_time);
+	time_data = localtime(&raw_time);
+	struct LogHeader *header = &sim->log_header;
+	memcpy(header->magic, LOG_MAGIC, 8);
+	header->version = LOG_VERSION;
+	header->record_size = sizeof(struct LogRecord);
+	header->start_time = raw_time;
+	header->seed = seed;
+	header->simulation_time = simulation_time;
+	header->probability = probability;
+	header->engine = engine;
+	header->place_count = topology->place_count;
+	header->section_count = topology->section_count;
+	if(binary_log){
+		char event_log_file[20];
+		snprintf(event_log_file, 20, "%02d:%02d:%02d-events.bin", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
+		sim->event_log = event_log_open(event_log_file, header, 1);
+		if(sim->event_log==NULL){
+			if(!headless)endwin();
+			printf("Cannot open event log %s\n", event_log_file);
+			return LOG_OPEN_ERR;
 		}
-		log_console(can_release, line);
-		recolor_lanes();
-		sleep(1);
-		print_console();
-		draw_map(segment_colors);
-		if(tick==simulation_time)break;
-		tick++;
-		print_time();
-		update_tunnel_tick(-1);
-		pthread_barrier_wait(&main_barrier);	
+	}else{
+		char train_log_file[19];
+		snprintf(train_log_file, 19, "%02d:%02d:%02d-train.log", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
+		char control_log_file[21];
+		snprintf(control_log_file, 21, "%02d:%02d:%02d-control.log", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
+		sim->train_log = fopen(train_log_file, "w");
+		sim->control_log = fopen(control_log_file, "w");
+	}
+
+	if(series_file!=NULL){
+		sim->series = series_open(series_file);
+		if(sim->series==NULL){
+			if(!headless)endwin();
+			printf("Cannot open time series %s\n", series_file);
+			return LOG_OPEN_ERR;
+		}
+	}
+
+	//Checkpoints can be asked for at any time, so they always have a file
+	char default_checkpoint_file[24];
+	if(checkpoint_file==NULL){
+		snprintf(default_checkpoint_file, 24, "%02d:%02d:%02d-checkpoint.bin", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
+		checkpoint_file = default_checkpoint_file;
 	}
-	log_control("[%02d:%02d:%02d][CONTROL] Simulation successfully ended.\n", time_data->tm_hour, time_data->tm_min, time_data->tm_sec);
+	signal(SIGUSR1, checkpoint_signal_handler);
+	signal(SIGUSR2, branch_signal_handler);
+
+	if(!headless){
+		//Init ncurses windows
+		ncurses_init_windows();
+
+		signal(SIGWINCH, sigwinch_handler);
+
+		//The renderer draws from snapshots, starting with the state before the first tick
+		renderer = renderer_create();
+		snapshot_publish(renderer, sim);
+		renderer_start(renderer);
+		sim->decided = display_decided;
+		sim->console = console_hook;
+	}
+
+	struct timespec wall_start, wall_end;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+	log_event(sim, LOG_START, 0, 0, 0, NULL);
+	run_simulation(sim);
+	log_event(sim, LOG_END, 0, 0, 0, NULL);
+	if(renderer!=NULL)renderer_stop(renderer);
+	branch_collect(1);
 
 	//Close files
-	fclose(control_log);
-	fclose(train_log);
+	if(sim->event_log!=NULL){
+		event_log_close(sim->event_log);
+	}else{
+		fclose(sim->control_log);
+		fclose(sim->train_log);
+	}
+	if(sim->series!=NULL&&series_close(sim->series)!=0){
+		if(!headless)endwin();
+		printf("Cannot write time series %s\n", series_file);
+		return LOG_OPEN_ERR;
+	}
+	sim->series = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	if(stats_file!=NULL&&stats_write(sim, stats_file)!=0){
+		if(!headless)endwin();
+		printf("Cannot write stats file %s\n", stats_file);
+		return LOG_OPEN_ERR;
+	}
+	if(history_file!=NULL&&history_write(sim, history_file)!=0){
+		if(!headless)endwin();
+		printf("Cannot write train history %s\n", history_file);
+		return LOG_OPEN_ERR;
+	}
+
+	if(headless){
+		print_summary(sim, &wall_start, &wall_end);
+		print_branch_results();
+		sim_destroy(sim);
+		return 0;
+	}
+
+	//Branches that finished after the last tick
+	if(branch_result_count>0)print_console();
 
 	//Debug stop
 	wmove(metro_container, METRO_LINES+1, COLS-2-17);
@@ -856,6 +3246,8 @@ int main(int argc, char **argv){
 	//Stop ncurses
 	endwin();
 
+	renderer_destroy(renderer);
+	sim_destroy(sim);
 	return 0;
-
-}
\ No newline at end of file
+}
+#endif
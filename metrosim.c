@@ -0,0 +1,2571 @@
+/*
+ * MetroSim simulation core: topology, trains, decision policies, both
+ * engines, logs and statistics. Built into libmetrosim, the API for
+ * embedding it is at the end of this file.
+ */
+#include "simulation.h"
+
+//Simulation vars
+int queue_count = 4;
+time_t raw_time = 0;
+struct tm *time_data = NULL;
+struct Topology *topology = NULL;
+struct Trace *arrival_trace = NULL;
+
+//Phase names as exported, indexed by PHASE_*
+const char *phase_names[PHASE_COUNT] = {"step", "barrier", "control", "collect", "decide", "snapshot", "draw_map", "print_console"};
+
+//Engine names as given to --engine, indexed by ENGINE_*
+const char *engine_names[ENGINES] = {"tick", "des", "regions"};
+
+//Stats of the worker running on this thread, NULL when timing is off
+__thread struct WorkerStats *thread_stats = NULL;
+
+//Built-in network, segment B takes the complement of the arrival probability
+const char *default_topology =
+	"section CD\n"
+	"segment A CD p F E\n"
+	"segment B CD 1-p F E\n"
+	"segment E CD p A F\n"
+	"segment F CD p A F\n";
+
+/*
+ * Renders one record in the text log format, shared by text logging and
+ * --logdump. Only the names of the topology are used. Control lines name
+ * their section when the network has more than one.
+ */
+void write_log_record(FILE *train, FILE *control, struct Topology *t, struct LogHeader *h, struct LogRecord *r, struct tm *tm){
+	char control_tag[NAME_LENGTH+8] = "CONTROL";
+	if(t->section_count>1&&r->type>=LOG_BLOCK&&r->type<=LOG_BUSY)snprintf(control_tag, sizeof(control_tag), "CONTROL %s", t->section_names[r->destination]);
+	switch(r->type){
+		case LOG_ARRIVAL:
+			fprintf(train, "[%02d:%02d:%02d][TICK %u][SEGMENT %s] Train with ID %04u arrived (length %d, broken %d, destination %s).\n", tm->tm_hour, tm->tm_min, tm->tm_sec, r->tick, t->place_names[r->segment], r->train_id, r->length, r->broken, t->place_names[r->destination]);
+			break;
+		case LOG_RELEASE:
+			fprintf(train, "[%02d:%02d:%02d][TICK %u][SEGMENT %s] Released train with ID %04u towards %s.\n", tm->tm_hour, tm->tm_min, tm->tm_sec, r->tick, t->place_names[r->segment], r->train_id, t->place_names[r->destination]);
+			break;
+		case LOG_START:
+			fprintf(control, "[%02d:%02d:%02d][CONTROL] Starting %ssimulation with s=%d p=%f seed=%llu\n", tm->tm_hour, tm->tm_min, tm->tm_sec, h->engine==ENGINE_DES?"event driven ":"", h->simulation_time, h->probability, (unsigned long long)h->seed);
+			break;
+		case LOG_BLOCK:
+			fprintf(control, "[%02d:%02d:%02d][TICK %u][%s] Blocking incoming trains as total number of trains reached %u.\n", tm->tm_hour, tm->tm_min, tm->tm_sec, r->tick, control_tag, r->train_id);
+			break;
+		case LOG_ALLOW:
+			fprintf(control, "[%02d:%02d:%02d][TICK %u][%s] Allowing incoming trains as total number of trains reached %u.\n", tm->tm_hour, tm->tm_min, tm->tm_sec, r->tick, control_tag, r->train_id);
+			break;
+		case LOG_SIGNAL:
+			fprintf(control, "[%02d:%02d:%02d][TICK %u][%s] Signalling segment %s to release train with ID %04u.\n", tm->tm_hour, tm->tm_min, tm->tm_sec, r->tick, control_tag, t->place_names[r->segment], r->train_id);
+			break;
+		case LOG_BUSY:
+			fprintf(control, "[%02d:%02d:%02d][TICK %u][%s] Cannot release train, tunnel is busy.\n", tm->tm_hour, tm->tm_min, tm->tm_sec, r->tick, control_tag);
+			break;
+		case LOG_END:
+			fprintf(control, "[%02d:%02d:%02d][CONTROL] Simulation successfully ended.\n", tm->tm_hour, tm->tm_min, tm->tm_sec);
+			break;
+	}
+}
+
+void *event_log_writer(void *arg){
+	struct EventLog *log = arg;
+	for(;;){
+		int stopping = atomic_load(&log->stop);
+		int written = 0;
+		for(int i = 0; i<log->producers; i++){
+			struct LogRing *ring = &log->rings[i];
+			uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+			if(head==tail)continue;
+			//At most two contiguous slices per drain
+			uint64_t start = tail&(LOG_RING_CAPACITY-1);
+			uint64_t count = head-tail;
+			uint64_t first = LOG_RING_CAPACITY-start;
+			if(first>count)first = count;
+			fwrite(&ring->records[start], sizeof(struct LogRecord), first, log->file);
+			if(count>first)fwrite(ring->records, sizeof(struct LogRecord), count-first, log->file);
+			atomic_store_explicit(&ring->tail, head, memory_order_release);
+			written = 1;
+		}
+		if(!written){
+			//Producers are done once stop is set, so an empty pass after it is final
+			if(stopping)break;
+			struct timespec idle = {0, 1000000};
+			nanosleep(&idle, NULL);
+		}
+	}
+	return NULL;
+}
+
+struct EventLog *event_log_open(const char *path, struct LogHeader *header, int producers){
+	FILE *file = fopen(path, "wb");
+	if(file==NULL)return NULL;
+	setvbuf(file, NULL, _IOFBF, LOG_WRITE_BUFFER);
+	fwrite(header, sizeof(struct LogHeader), 1, file);
+	//Name tables follow the header so the log can be rendered without the topology file
+	fwrite(topology->place_names, NAME_LENGTH, topology->place_count, file);
+	fwrite(topology->section_names, NAME_LENGTH, topology->section_count, file);
+	struct EventLog *log = calloc(1, sizeof(struct EventLog));
+	log->file = file;
+	log->producers = producers;
+	log->rings = calloc(producers, sizeof(struct LogRing));
+	for(int i = 0; i<producers; i++){
+		log->rings[i].records = malloc(LOG_RING_CAPACITY*sizeof(struct LogRecord));
+	}
+	pthread_create(&log->writer, NULL, event_log_writer, log);
+	return log;
+}
+
+//Called only by the producer that owns the ring, blocks while the ring is full
+void event_log_append(struct EventLog *log, int producer, struct LogRecord *r){
+	struct LogRing *ring = &log->rings[producer];
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	while(head-atomic_load_explicit(&ring->tail, memory_order_acquire)==LOG_RING_CAPACITY)sched_yield();
+	ring->records[head&(LOG_RING_CAPACITY-1)] = *r;
+	atomic_store_explicit(&ring->head, head+1, memory_order_release);
+}
+
+void event_log_close(struct EventLog *log){
+	atomic_store(&log->stop, 1);
+	pthread_join(log->writer, NULL);
+	fclose(log->file);
+	for(int i = 0; i<log->producers; i++)free(log->rings[i].records);
+	free(log->rings);
+	free(log);
+}
+
+void series_column(struct SeriesWriter *w, int c, const char *prefix, const char *name, int type, int width, uint64_t *offset){
+	struct SeriesColumn *column = &w->columns[c];
+	snprintf(column->name, SERIES_NAME_LENGTH, "%s%s", prefix, name);
+	column->type = type;
+	column->width = width;
+	column->offset = *offset;
+	*offset += width;
+}
+
+struct SeriesWriter *series_open(const char *path){
+	FILE *file = fopen(path, "wb");
+	if(file==NULL)return NULL;
+	struct SeriesWriter *w = calloc(1, sizeof(struct SeriesWriter));
+	w->file = file;
+	struct SeriesHeader *h = &w->header;
+	memcpy(h->magic, SERIES_MAGIC, 8);
+	h->version = SERIES_VERSION;
+	h->segment_count = topology->segment_count;
+	h->section_count = topology->section_count;
+	h->column_count = 1+topology->segment_count+4*topology->section_count;
+	w->columns = calloc(h->column_count, sizeof(struct SeriesColumn));
+	uint64_t offset = 0;
+	int c = 0;
+	series_column(w, c++, "", "tick", SERIES_INT32, 4, &offset);
+	for(int i = 0; i<topology->segment_count; i++)series_column(w, c++, "queue.", topology->place_names[i], SERIES_UINT16, 2, &offset);
+	for(int s = 0; s<topology->section_count; s++)series_column(w, c++, "tunnel_train.", topology->section_names[s], SERIES_UINT32, 4, &offset);
+	for(int s = 0; s<topology->section_count; s++)series_column(w, c++, "tunnel_ticks.", topology->section_names[s], SERIES_UINT8, 1, &offset);
+	for(int s = 0; s<topology->section_count; s++)series_column(w, c++, "can_release.", topology->section_names[s], SERIES_UINT8, 1, &offset);
+	for(int s = 0; s<topology->section_count; s++)series_column(w, c++, "allow_trains.", topology->section_names[s], SERIES_UINT8, 1, &offset);
+	h->row_bytes = offset;
+	//Blocks of a few MB, a multiple of 8 rows so that every column starts aligned
+	uint64_t rows = SERIES_BLOCK_BYTES/h->row_bytes;
+	if(rows>SERIES_BLOCK_ROWS_MAX)rows = SERIES_BLOCK_ROWS_MAX;
+	rows &= ~(uint64_t)7;
+	h->block_rows = rows<8?8:rows;
+	h->header_size = sizeof(struct SeriesHeader)+h->column_count*sizeof(struct SeriesColumn);
+	w->block = calloc(h->block_rows, h->row_bytes);
+	fwrite(h, sizeof(*h), 1, file);
+	fwrite(w->columns, sizeof(struct SeriesColumn), h->column_count, file);
+	//Blocks start 8 byte aligned
+	static const char padding[8] = {0};
+	w->offset = h->header_size;
+	if(w->offset%8!=0){
+		fwrite(padding, 1, 8-w->offset%8, file);
+		w->offset += 8-w->offset%8;
+	}
+	return w;
+}
+
+void series_flush(struct SeriesWriter *w){
+	if(w->rows==0)return;
+	struct SeriesHeader *h = &w->header;
+	size_t size = (size_t)h->block_rows*h->row_bytes;
+	fwrite(w->block, 1, size, w->file);
+	if(h->block_count==(uint64_t)w->index_capacity){
+		w->index_capacity = w->index_capacity?2*w->index_capacity:64;
+		w->index = realloc(w->index, w->index_capacity*sizeof(struct SeriesBlock));
+	}
+	struct SeriesBlock *b = &w->index[h->block_count++];
+	b->offset = w->offset;
+	b->first_tick = *(int32_t *)w->block;
+	b->last_tick = ((int32_t *)w->block)[w->rows-1];
+	b->rows = w->rows;
+	b->reserved = 0;
+	w->offset += size;
+	h->row_count += w->rows;
+	w->rows = 0;
+	memset(w->block, 0, size);
+}
+
+//Appends the state at the end of the current tick, called by the controller only
+void series_record(struct Simulation *sim){
+	struct SeriesWriter *w = sim->series;
+	int rows = w->header.block_rows;
+	int r = w->rows;
+	char *block = w->block;
+	struct SeriesColumn *column = w->columns;
+	((int32_t *)(block+rows*(column++)->offset))[r] = sim->tick;
+	for(int i = 0; i<queue_count; i++){
+		int length = sim->queue_status[i];
+		((uint16_t *)(block+rows*(column++)->offset))[r] = length>UINT16_MAX?UINT16_MAX:length;
+	}
+	for(int s = 0; s<topology->section_count; s++)((uint32_t *)(block+rows*(column++)->offset))[r] = sim->sections[s].train_in_tunnel.id;
+	for(int s = 0; s<topology->section_count; s++){
+		int ticks = sim->sections[s].tunnel_ticks;
+		((uint8_t *)(block+rows*(column++)->offset))[r] = ticks>UINT8_MAX?UINT8_MAX:ticks;
+	}
+	for(int s = 0; s<topology->section_count; s++)((uint8_t *)(block+rows*(column++)->offset))[r] = sim->sections[s].can_release;
+	for(int s = 0; s<topology->section_count; s++)((uint8_t *)(block+rows*(column++)->offset))[r] = sim->sections[s].allow_trains;
+	if(++w->rows==rows)series_flush(w);
+}
+
+//Writes the last block and the index, then completes the header. 0 on success.
+int series_close(struct SeriesWriter *w){
+	series_flush(w);
+	struct SeriesHeader *h = &w->header;
+	h->index_offset = w->offset;
+	fwrite(w->index, sizeof(struct SeriesBlock), h->block_count, w->file);
+	int failed = ferror(w->file);
+	if(fseek(w->file, 0, SEEK_SET)!=0||fwrite(h, sizeof(*h), 1, w->file)!=1)failed = 1;
+	if(fclose(w->file)!=0)failed = 1;
+	free(w->columns);
+	free(w->block);
+	free(w->index);
+	free(w);
+	return failed?LOG_OPEN_ERR:0;
+}
+
+int sim_logging(struct Simulation *sim){
+	return sim->event_log!=NULL||sim->control_log!=NULL;
+}
+
+/*
+ * Records an event in the binary log or renders it to the text logs.
+ * Control events pass their section, train events the train itself.
+ */
+void log_event(struct Simulation *sim, int type, int section_id, int segment_id, uint32_t train_id, struct Train *t){
+	if(!sim_logging(sim))return;
+	struct LogRecord r = {0};
+	r.tick = sim->tick;
+	r.type = type;
+	r.segment = segment_id;
+	r.destination = section_id;
+	r.train_id = train_id;
+	if(t!=NULL){
+		r.tick = (type==LOG_ARRIVAL)?t->arrival_time:sim->tick;
+		r.segment = t->origin;
+		r.train_id = t->id;
+		r.destination = t->destination;
+		r.length = t->length;
+		r.broken = t->broken;
+	}
+	if(sim->region!=NULL){
+		region_log_append(sim->region, &r);
+	}else if(sim->event_log!=NULL){
+		r.seconds = (uint16_t)(raw_time-sim->log_header.start_time);
+		event_log_append(sim->event_log, 0, &r);
+	}else{
+		write_log_record(sim->train_log, sim->control_log, topology, &sim->log_header, &r, time_data);
+	}
+}
+
+//Only the controller writes the train log, in segment order
+void log_train_arrival(struct Simulation *sim, struct Train *t){
+	log_event(sim, LOG_ARRIVAL, 0, 0, 0, t);
+}
+
+void log_train_release(struct Simulation *sim, struct Train *t){
+	log_event(sim, LOG_RELEASE, 0, 0, 0, t);
+}
+
+uint64_t splitmix64(uint64_t *x){
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+	z = (z^(z>>27))*0x94d049bb133111ebULL;
+	return z^(z>>31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k){
+	return (x<<k)|(x>>(64-k));
+}
+
+static inline uint64_t rng_next(struct Rng *rng){
+	uint64_t *s = rng->s;
+	uint64_t result = rotl(s[1]*5, 7)*9;
+	uint64_t t = s[1]<<17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+//Uniform double in [0,1) from the top 53 bits, a mirrored stream gives 1-2^-53-u instead of u
+static inline double rng_uniform(struct Rng *rng){
+	return ((rng_next(rng)>>11)^rng->mirror)*0x1.0p-53;
+}
+
+//Batch of n uniforms, keeps the state in registers across the block
+static inline void rng_fill(struct Rng *rng, double *out, int n){
+	struct Rng local = *rng;
+	for(int i = 0; i<n; i++)out[i] = rng_uniform(&local);
+	*rng = local;
+}
+
+//Advances the stream by 2^128 draws, giving non-overlapping streams
+void rng_jump(struct Rng *rng){
+	static const uint64_t jump[] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+	uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	for(int i = 0; i<4; i++){
+		for(int b = 0; b<64; b++){
+			if(jump[i]&((uint64_t)1<<b)){
+				s0 ^= rng->s[0];
+				s1 ^= rng->s[1];
+				s2 ^= rng->s[2];
+				s3 ^= rng->s[3];
+			}
+			rng_next(rng);
+		}
+	}
+	rng->s[0] = s0;
+	rng->s[1] = s1;
+	rng->s[2] = s2;
+	rng->s[3] = s3;
+}
+
+void rng_seed_streams(struct Rng *streams, int count, uint64_t seed){
+	uint64_t x = seed;
+	for(int i = 0; i<4; i++)streams[0].s[i] = splitmix64(&x);
+	streams[0].mirror = 0;
+	for(int i = 1; i<count; i++){
+		streams[i] = streams[i-1];
+		rng_jump(&streams[i]);
+	}
+}
+
+//Midpoint of the values that fall into bucket i
+uint64_t log_bucket_value(int i, int bits){
+	int half = 1<<(bits-1);
+	if(i<2*half)return i;
+	int shift = i/half-1;
+	uint64_t sub = i-shift*half;
+	return (sub<<shift)+((1ULL<<shift)>>1);
+}
+
+uint64_t hist_value(int i){
+	return log_bucket_value(i, HIST_SUB_BITS);
+}
+
+void hist_merge(struct Histogram *dst, struct Histogram *src){
+	for(int i = 0; i<HIST_BUCKETS; i++)dst->buckets[i]+=src->buckets[i];
+	dst->count+=src->count;
+	dst->sum+=src->sum;
+	if(src->max>dst->max)dst->max = src->max;
+}
+
+//Value at quantile q in [0,1], 0 for an empty histogram
+uint64_t hist_quantile(struct Histogram *h, double q){
+	if(h->count==0)return 0;
+	uint64_t rank = (uint64_t)ceil(q*h->count);
+	if(rank<1)rank = 1;
+	uint64_t seen = 0;
+	for(int i = 0; i<HIST_BUCKETS; i++){
+		seen+=h->buckets[i];
+		if(seen>=rank)return hist_value(i)<h->max?hist_value(i):h->max;
+	}
+	return h->max;
+}
+
+static inline void delay_record(struct DelayHistogram *h, int ticks){
+	if(ticks<0)ticks = 0;
+	h->buckets[log_bucket(ticks, DELAY_SUB_BITS)]++;
+	h->count++;
+	h->sum+=ticks;
+	if((uint32_t)ticks>h->max)h->max = ticks;
+}
+
+void delay_merge(struct DelayHistogram *dst, struct DelayHistogram *src){
+	for(int i = 0; i<DELAY_BUCKETS; i++)dst->buckets[i]+=src->buckets[i];
+	dst->count+=src->count;
+	dst->sum+=src->sum;
+	if(src->max>dst->max)dst->max = src->max;
+}
+
+//Delay at quantile q in [0,1], 0 for an empty histogram
+int delay_quantile(struct DelayHistogram *h, double q){
+	if(h->count==0)return 0;
+	uint64_t rank = (uint64_t)ceil(q*h->count);
+	if(rank<1)rank = 1;
+	uint64_t seen = 0;
+	for(int i = 0; i<DELAY_BUCKETS; i++){
+		seen+=h->buckets[i];
+		if(seen>=rank){
+			uint64_t v = log_bucket_value(i, DELAY_SUB_BITS);
+			return v<h->max?(int)v:(int)h->max;
+		}
+	}
+	return h->max;
+}
+
+void queue_init(struct TrainQueue *q){
+	q->data = malloc(QUEUE_INITIAL_CAPACITY*sizeof(struct Train));
+	q->head = 0;
+	q->count = 0;
+	q->capacity = QUEUE_INITIAL_CAPACITY;
+}
+
+void queue_free(struct TrainQueue *q){
+	free(q->data);
+	q->data = NULL;
+}
+
+void queue_push(struct TrainQueue *q, struct Train *t){
+	if(q->count==q->capacity){
+		//Double and unwrap so the contents start at index 0
+		struct Train *data = malloc(2*q->capacity*sizeof(struct Train));
+		int first = q->capacity-q->head;
+		memcpy(data, &q->data[q->head], first*sizeof(struct Train));
+		memcpy(&data[first], q->data, q->head*sizeof(struct Train));
+		free(q->data);
+		q->data = data;
+		q->head = 0;
+		q->capacity *= 2;
+	}
+	q->data[(q->head+q->count)&(q->capacity-1)] = *t;
+	q->count++;
+}
+
+struct Train queue_pop(struct TrainQueue *q){
+	struct Train t = q->data[q->head];
+	q->head = (q->head+1)&(q->capacity-1);
+	q->count--;
+	return t;
+}
+
+//Front of the queue, or an empty train (ID 0) when there is none
+struct Train queue_front(struct TrainQueue *q){
+	if(q->count==0){
+		struct Train empty = {0};
+		return empty;
+	}
+	return q->data[q->head];
+}
+
+//k-th train from the front, k must be below count
+struct Train *queue_at(struct TrainQueue *q, int k){
+	return &q->data[(q->head+k)&(q->capacity-1)];
+}
+
+//Index of name in a sorted name index, or -1
+int find_name(char (*names)[NAME_LENGTH], int *sorted, int count, const char *name){
+	int lo = 0, hi = count-1;
+	while(lo<=hi){
+		int mid = (lo+hi)/2;
+		int c = strcmp(names[sorted[mid]], name);
+		if(c==0)return sorted[mid];
+		if(c<0)lo = mid+1;
+		else hi = mid-1;
+	}
+	return -1;
+}
+
+//Orders NamedIndex entries by name, ties by index so the sort is stable
+int compare_names(const void *a, const void *b){
+	const struct NamedIndex *x = a;
+	const struct NamedIndex *y = b;
+	int order = strcmp(x->name, y->name);
+	return order!=0?order:x->index-y->index;
+}
+
+/*
+ * Builds a name index sorted by name, used to resolve references while
+ * loading. The names are sorted alongside their indices, so no state is
+ * shared with other threads loading at the same time.
+ */
+int *sorted_name_index(char (*names)[NAME_LENGTH], int count){
+	struct NamedIndex *entries = malloc((count+1)*sizeof(struct NamedIndex));
+	for(int i = 0; i<count; i++){
+		entries[i].name = names[i];
+		entries[i].index = i;
+	}
+	qsort(entries, count, sizeof(struct NamedIndex), compare_names);
+	int *sorted = malloc((count+1)*sizeof(int));
+	for(int i = 0; i<count; i++)sorted[i] = entries[i].index;
+	free(entries);
+	return sorted;
+}
+
+void *grow_array(void *data, int *capacity, int count, size_t size){
+	if(count<*capacity)return data;
+	*capacity = *capacity?2**capacity:16;
+	return realloc(data, *capacity*size);
+}
+
+void topology_free(struct Topology *t){
+	if(t==NULL)return;
+	free(t->place_names);
+	free(t->section_names);
+	free(t->rate_kind);
+	free(t->rate);
+	free(t->segment_section);
+	free(t->destination_offset);
+	free(t->destinations);
+	free(t->destination_cumulative);
+	free(t->section_offset);
+	free(t->section_segments);
+	free(t->block_threshold);
+	free(t);
+}
+
+//Line 0 is for errors found after reading the whole file
+int topology_error(const char *source, int line, const char *message, const char *token){
+	if(line>0)printf("%s:%d: %s '%s'\n", source, line, message, token);
+	else printf("%s: %s '%s'\n", source, message, token);
+	return TOPOLOGY_ERR;
+}
+
+/*
+ * Parses a network description. Blank lines and text after '#' are ignored,
+ * every other line declares a section or a segment:
+ *
+ *   section NAME [block=N]
+ *   segment NAME SECTION RATE DEST[:WEIGHT]...
+ *
+ * RATE is the per-tick arrival probability, either a number or p / 1-p to
+ * follow the -p option. Destinations are drawn with the given weights
+ * (default 1), names that are not segments become exits. Sections may be
+ * declared after the segments that use them. Returns NULL after printing
+ * the offending line.
+ */
+struct Topology *topology_parse(char *text, const char *source){
+	struct Topology *t = calloc(1, sizeof(struct Topology));
+	int place_capacity = 0, section_capacity = 0, destination_capacity = 0;
+	char (*section_refs)[NAME_LENGTH] = NULL;
+	int *section_lines = NULL;
+	char (*destination_refs)[NAME_LENGTH] = NULL;
+	double *weights = NULL;
+	int destination_count = 0;
+	int status = 0;
+	int line = 0;
+	char *next = text;
+	int segment_capacity = 0;
+
+	while(next!=NULL&&status==0){
+		char *current = next;
+		next = strchr(current, '\n');
+		if(next!=NULL)*next++ = '\0';
+		line++;
+		char *comment = strchr(current, '#');
+		if(comment!=NULL)*comment = '\0';
+		char *save;
+		char *keyword = strtok_r(current, " \t\r", &save);
+		if(keyword==NULL)continue;
+		if(strcmp(keyword, "section")!=0&&strcmp(keyword, "segment")!=0){
+			status = topology_error(source, line, "unknown keyword", keyword);
+			break;
+		}
+		char *name = strtok_r(NULL, " \t\r", &save);
+		if(name==NULL){
+			status = topology_error(source, line, "missing name after", keyword);
+			break;
+		}
+		if(strlen(name)>=NAME_LENGTH){
+			status = topology_error(source, line, "name too long", name);
+			break;
+		}
+		if(strcmp(keyword, "section")==0){
+			t->section_names = grow_array(t->section_names, &section_capacity, t->section_count, NAME_LENGTH);
+			t->block_threshold = realloc(t->block_threshold, section_capacity*sizeof(int));
+			int s = t->section_count++;
+			//Name tables are written to logs and histories whole, so no heap bytes may follow the name
+			memset(t->section_names[s], 0, NAME_LENGTH);
+			strcpy(t->section_names[s], name);
+			t->block_threshold[s] = DEFAULT_BLOCK_THRESHOLD;
+			char *option;
+			while((option = strtok_r(NULL, " \t\r", &save))!=NULL){
+				if(strncmp(option, "block=", 6)==0&&atoi(option+6)>0){
+					t->block_threshold[s] = atoi(option+6);
+				}else{
+					status = topology_error(source, line, "unknown section option", option);
+					break;
+				}
+			}
+		}else if(strcmp(keyword, "segment")==0){
+			char *section = strtok_r(NULL, " \t\r", &save);
+			char *rate = strtok_r(NULL, " \t\r", &save);
+			if(section==NULL||rate==NULL){
+				status = topology_error(source, line, "expected section and rate for segment", name);
+				break;
+			}
+			if(t->segment_count==MAX_PLACES){
+				status = topology_error(source, line, "too many segments at", name);
+				break;
+			}
+			int i = t->segment_count;
+			if(i==segment_capacity){
+				t->place_names = grow_array(t->place_names, &place_capacity, i, NAME_LENGTH);
+				segment_capacity = place_capacity;
+				section_refs = realloc(section_refs, segment_capacity*NAME_LENGTH);
+				section_lines = realloc(section_lines, segment_capacity*sizeof(int));
+				t->rate_kind = realloc(t->rate_kind, segment_capacity*sizeof(int));
+				t->rate = realloc(t->rate, segment_capacity*sizeof(float));
+				t->destination_offset = realloc(t->destination_offset, (segment_capacity+1)*sizeof(int));
+			}
+			t->segment_count++;
+			memset(t->place_names[i], 0, NAME_LENGTH);
+			strcpy(t->place_names[i], name);
+			snprintf(section_refs[i], NAME_LENGTH, "%s", section);
+			section_lines[i] = line;
+			t->rate[i] = 0.0f;
+			if(strcmp(rate, "p")==0){
+				t->rate_kind[i] = RATE_P;
+			}else if(strcmp(rate, "1-p")==0){
+				t->rate_kind[i] = RATE_ONE_MINUS_P;
+			}else{
+				char *end;
+				t->rate_kind[i] = RATE_FIXED;
+				t->rate[i] = strtof(rate, &end);
+				if(*end!='\0'||t->rate[i]<0.0f||t->rate[i]>1.0f){
+					status = topology_error(source, line, "rate must be p, 1-p or a probability, got", rate);
+					break;
+				}
+			}
+			t->destination_offset[i] = destination_count;
+			char *destination;
+			while((destination = strtok_r(NULL, " \t\r", &save))!=NULL){
+				double weight = 1.0;
+				char *colon = strchr(destination, ':');
+				if(colon!=NULL){
+					*colon = '\0';
+					char *end;
+					weight = strtod(colon+1, &end);
+					if(*end!='\0'||!(weight>0.0)){
+						status = topology_error(source, line, "weight must be positive for destination", destination);
+						break;
+					}
+				}
+				if(strlen(destination)>=NAME_LENGTH){
+					status = topology_error(source, line, "name too long", destination);
+					break;
+				}
+				destination_refs = grow_array(destination_refs, &destination_capacity, destination_count, NAME_LENGTH);
+				weights = realloc(weights, destination_capacity*sizeof(double));
+				strcpy(destination_refs[destination_count], destination);
+				weights[destination_count++] = weight;
+			}
+			if(status==0&&destination_count==t->destination_offset[i])status = topology_error(source, line, "no destinations for segment", name);
+		}
+	}
+	if(status==0&&t->segment_count==0)status = topology_error(source, 0, "no segments in", source);
+
+	//Resolve sections and lay segments out per section
+	int *sorted = NULL;
+	if(status==0){
+		sorted = sorted_name_index(t->section_names, t->section_count);
+		for(int s = 1; s<t->section_count&&status==0; s++){
+			if(strcmp(t->section_names[sorted[s-1]], t->section_names[sorted[s]])==0)status = topology_error(source, 0, "duplicate section", t->section_names[sorted[s]]);
+		}
+		t->segment_section = malloc(t->segment_count*sizeof(int));
+		for(int i = 0; i<t->segment_count&&status==0; i++){
+			t->segment_section[i] = find_name(t->section_names, sorted, t->section_count, section_refs[i]);
+			if(t->segment_section[i]<0)status = topology_error(source, section_lines[i], "unknown section", section_refs[i]);
+		}
+		free(sorted);
+		sorted = NULL;
+	}
+	if(status==0){
+		t->section_offset = calloc(t->section_count+1, sizeof(int));
+		t->section_segments = malloc(t->segment_count*sizeof(int));
+		for(int i = 0; i<t->segment_count; i++)t->section_offset[t->segment_section[i]+1]++;
+		for(int s = 0; s<t->section_count; s++){
+			if(t->section_offset[s+1]==0)status = topology_error(source, 0, "no segments in section", t->section_names[s]);
+			t->section_offset[s+1]+=t->section_offset[s];
+		}
+		int *fill = malloc(t->section_count*sizeof(int));
+		memcpy(fill, t->section_offset, t->section_count*sizeof(int));
+		for(int i = 0; i<t->segment_count; i++)t->section_segments[fill[t->segment_section[i]]++] = i;
+		free(fill);
+	}
+
+	//Resolve destinations, unknown names are appended as exits
+	if(status==0){
+		t->destination_offset[t->segment_count] = destination_count;
+		t->place_count = t->segment_count;
+		sorted = sorted_name_index(t->place_names, t->place_count);
+		for(int i = 1; i<t->segment_count&&status==0; i++){
+			if(strcmp(t->place_names[sorted[i-1]], t->place_names[sorted[i]])==0)status = topology_error(source, 0, "duplicate segment", t->place_names[sorted[i]]);
+		}
+		int segment_places = t->place_count;
+		t->destinations = malloc((destination_count+1)*sizeof(int));
+		t->destination_cumulative = malloc((destination_count+1)*sizeof(double));
+		for(int d = 0; d<destination_count&&status==0; d++){
+			int place = find_name(t->place_names, sorted, segment_places, destination_refs[d]);
+			for(int e = segment_places; e<t->place_count&&place<0; e++){
+				if(strcmp(t->place_names[e], destination_refs[d])==0)place = e;
+			}
+			if(place<0){
+				if(t->place_count==MAX_PLACES){
+					status = topology_error(source, 0, "too many places at", destination_refs[d]);
+					break;
+				}
+				t->place_names = grow_array(t->place_names, &place_capacity, t->place_count, NAME_LENGTH);
+				place = t->place_count++;
+				memset(t->place_names[place], 0, NAME_LENGTH);
+				strcpy(t->place_names[place], destination_refs[d]);
+			}
+			t->destinations[d] = place;
+		}
+		for(int i = 0; i<t->segment_count&&status==0; i++){
+			double total = 0.0, running = 0.0;
+			for(int d = t->destination_offset[i]; d<t->destination_offset[i+1]; d++)total+=weights[d];
+			for(int d = t->destination_offset[i]; d<t->destination_offset[i+1]; d++){
+				running+=weights[d];
+				t->destination_cumulative[d] = running/total;
+			}
+		}
+		free(sorted);
+	}
+
+	free(section_refs);
+	free(section_lines);
+	free(destination_refs);
+	free(weights);
+	if(status!=0){
+		topology_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+struct Topology *topology_load(const char *path){
+	FILE *file = fopen(path, "r");
+	if(file==NULL){
+		printf("Cannot open topology %s\n", path);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+	char *text = malloc(size+1);
+	text[fread(text, 1, size, file)] = '\0';
+	fclose(file);
+	struct Topology *t = topology_parse(text, path);
+	free(text);
+	return t;
+}
+
+struct Topology *topology_builtin(){
+	char *text = strdup(default_topology);
+	struct Topology *t = topology_parse(text, "built-in topology");
+	free(text);
+	t->builtin = 1;
+	return t;
+}
+
+//Arrival probability of a segment for this run's -p
+float segment_rate(struct Simulation *sim, int segment_id){
+	switch(topology->rate_kind[segment_id]){
+		case RATE_P:
+			return sim->probability;
+		case RATE_ONE_MINUS_P:
+			return 1-sim->probability;
+	}
+	return topology->rate[segment_id];
+}
+
+//Walks the cumulative weights of the segment's destinations, u is uniform in [0,1)
+int draw_destination(int segment_id, double u){
+	int d = topology->destination_offset[segment_id];
+	int last = topology->destination_offset[segment_id+1]-1;
+	while(d<last&&u>=topology->destination_cumulative[d])d++;
+	return topology->destinations[d];
+}
+
+//Segment local counters interleave, so IDs are unique without a shared counter
+//Unsigned, so IDs past UINT32_MAX wrap instead of overflowing, main refuses --history runs that could get there
+uint32_t get_train_id(struct Simulation *sim, int segment_id){
+	return (uint32_t)sim->slots[segment_id].arrivals++*(uint32_t)queue_count+segment_id+1;
+}
+
+int count_arrivals(struct Simulation *sim){
+	int count = 0;
+	for(int i = 0; i<queue_count; i++)count+=sim->slots[i].arrivals;
+	return count;
+}
+
+//Builds a train from one tick's batch of draws
+void make_train(struct Simulation *sim, int segment_id, double *draws, struct Train *t){
+	t->id = get_train_id(sim, segment_id);
+	t->origin = segment_id;
+	t->length = 1+(draws[1]<LENGTH_PROBABILITY);
+	t->broken = (draws[2]<sim->breakdown);
+	t->destination = draw_destination(segment_id, draws[3]);
+	t->arrival_time = sim->tick;
+}
+
+/*
+ * Next trace record of a segment due by this tick, or NULL. A segment takes
+ * at most one train a tick, so records for a tick that is already taken
+ * arrive on the next one.
+ */
+const struct TraceRecord *trace_due(struct Simulation *sim, int segment_id, int tick){
+	uint64_t next = sim->slots[segment_id].trace_next;
+	if(next>=arrival_trace->offsets[segment_id+1])return NULL;
+	const struct TraceRecord *r = &arrival_trace->records[next];
+	return (int)r->tick<=tick?r:NULL;
+}
+
+//Builds a train from a trace record, the record's tick only decides when
+void make_trace_train(struct Simulation *sim, int segment_id, const struct TraceRecord *r, struct Train *t){
+	t->id = get_train_id(sim, segment_id);
+	t->origin = segment_id;
+	t->length = r->length;
+	t->broken = r->broken;
+	t->destination = r->destination;
+	t->arrival_time = sim->tick;
+}
+
+struct TrainHistory *history_create(){
+	struct TrainHistory *h = calloc(1, sizeof(struct TrainHistory));
+	h->first = h->current = malloc(sizeof(struct HistoryChunk));
+	h->first->next = NULL;
+	h->first->count = 0;
+	return h;
+}
+
+//Empties the history for a new run, the chunks are kept for it
+void history_reset(struct TrainHistory *h){
+	for(struct HistoryChunk *c = h->first; c!=NULL; c = c->next)c->count = 0;
+	h->current = h->first;
+	h->count = 0;
+}
+
+void train_record(struct Train *t, uint32_t departure_time, struct TrainRecord *r){
+	r->id = t->id;
+	r->arrival_time = t->arrival_time;
+	r->departure_time = departure_time;
+	r->destination = t->destination;
+	r->length = t->length;
+	r->broken = t->broken;
+	r->reserved = 0;
+}
+
+//Records a released train, a new chunk is only allocated when the kept ones are full
+void history_append(struct TrainHistory *h, struct Train *t){
+	struct HistoryChunk *c = h->current;
+	if(c->count==HISTORY_CHUNK_RECORDS){
+		if(c->next==NULL){
+			c->next = malloc(sizeof(struct HistoryChunk));
+			c->next->next = NULL;
+			c->next->count = 0;
+		}
+		c = h->current = c->next;
+	}
+	train_record(t, t->departure_time, &c->records[c->count++]);
+	h->count++;
+}
+
+//Appends the records of src to dst, used to gather the histories of regions
+void history_append_all(struct TrainHistory *dst, struct TrainHistory *src){
+	for(struct HistoryChunk *c = src->first; c!=NULL&&c->count>0; c = c->next){
+		for(int done = 0; done<c->count;){
+			struct HistoryChunk *d = dst->current;
+			if(d->count==HISTORY_CHUNK_RECORDS){
+				if(d->next==NULL){
+					d->next = malloc(sizeof(struct HistoryChunk));
+					d->next->next = NULL;
+					d->next->count = 0;
+				}
+				d = dst->current = d->next;
+			}
+			int n = c->count-done;
+			if(n>HISTORY_CHUNK_RECORDS-d->count)n = HISTORY_CHUNK_RECORDS-d->count;
+			memcpy(&d->records[d->count], &c->records[done], n*sizeof(struct TrainRecord));
+			d->count += n;
+			dst->count += n;
+			done += n;
+		}
+	}
+}
+
+void history_free(struct TrainHistory *h){
+	if(h==NULL)return;
+	while(h->first!=NULL){
+		struct HistoryChunk *next = h->first->next;
+		free(h->first);
+		h->first = next;
+	}
+	free(h);
+}
+
+/*
+ * Writes the released trains of the history and the trains still queued,
+ * in segment order, to path. 0 on success.
+ */
+int history_write(struct Simulation *sim, const char *path){
+	FILE *out = fopen(path, "wb");
+	if(out==NULL)return LOG_OPEN_ERR;
+	setvbuf(out, NULL, _IOFBF, LOG_WRITE_BUFFER);
+	struct HistoryHeader header = {0};
+	memcpy(header.magic, HISTORY_MAGIC, 8);
+	header.version = HISTORY_VERSION;
+	header.record_size = sizeof(struct TrainRecord);
+	header.record_count = sim->history->count;
+	for(int i = 0; i<queue_count; i++)header.record_count += sim->slots[i].queue.count;
+	header.seed = sim->seed;
+	header.segment_count = topology->segment_count;
+	header.place_count = topology->place_count;
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(topology->place_names, NAME_LENGTH, topology->place_count, out);
+	for(struct HistoryChunk *c = sim->history->first; c!=NULL&&c->count>0; c = c->next){
+		fwrite(c->records, sizeof(struct TrainRecord), c->count, out);
+	}
+	for(int i = 0; i<queue_count; i++){
+		struct TrainQueue *queue = &sim->slots[i].queue;
+		for(int k = 0; k<queue->count; k++){
+			struct TrainRecord r;
+			train_record(queue_at(queue, k), HISTORY_QUEUED, &r);
+			fwrite(&r, sizeof(r), 1, out);
+		}
+	}
+	int failed = ferror(out);
+	if(fclose(out)!=0)failed = 1;
+	return failed?LOG_OPEN_ERR:0;
+}
+
+//Ticks a train keeps its section's tunnel busy
+int tunnel_duration(struct Train *t){
+	return t->length+1+1+(4*t->broken);
+}
+
+//Longest queue of the section, ties go to the segment declared first
+int release_longest(struct Simulation *sim, int section_id){
+	int max_queue=-1;
+	int max_count=0;
+	for(int k = topology->section_offset[section_id]; k<topology->section_offset[section_id+1]; k++){
+		int i = topology->section_segments[k];
+		if(sim->queue_status[i]>max_count){
+			max_queue=i;
+			max_count=sim->queue_status[i];
+		}
+	}
+	return max_queue;
+}
+
+//Leader that has waited longest, first come first served across segments
+int release_oldest(struct Simulation *sim, int section_id){
+	int oldest=-1;
+	for(int k = topology->section_offset[section_id]; k<topology->section_offset[section_id+1]; k++){
+		int i = topology->section_segments[k];
+		if(sim->queue_status[i]==0)continue;
+		if(oldest==-1||sim->queue_leaders[i].arrival_time<sim->queue_leaders[oldest].arrival_time)oldest=i;
+	}
+	return oldest;
+}
+
+//Most queued trains per tick of tunnel time the leader needs
+int release_weighted(struct Simulation *sim, int section_id){
+	int best=-1;
+	int best_count=0, best_duration=1;
+	for(int k = topology->section_offset[section_id]; k<topology->section_offset[section_id+1]; k++){
+		int i = topology->section_segments[k];
+		if(sim->queue_status[i]==0)continue;
+		int duration = tunnel_duration(&sim->queue_leaders[i]);
+		//count/duration compared without division
+		if(best==-1||sim->queue_status[i]*best_duration>best_count*duration){
+			best=i;
+			best_count=sim->queue_status[i];
+			best_duration=duration;
+		}
+	}
+	return best;
+}
+
+/*
+ * Tries every non-empty segment as the first release and plays the next
+ * lookahead-1 releases forward with the longest queue rule, assuming no new
+ * arrivals. Each release costs the trains still queued in the section the
+ * ticks it holds the tunnel; the first release of the cheapest plan wins.
+ * Reads the segment queues, which only the controller touches between steps.
+ */
+int release_lookahead(struct Simulation *sim, int section_id){
+	int first = topology->section_offset[section_id];
+	int size = topology->section_offset[section_id+1]-first;
+	int *popped = sim->scratch;
+	int queued = count_section_trains(sim, section_id);
+	int best=-1;
+	long best_cost=0;
+	for(int c = 0; c<size; c++){
+		int candidate = topology->section_segments[first+c];
+		if(sim->queue_status[candidate]==0)continue;
+		memset(popped, 0, size*sizeof(int));
+		int left = queued;
+		long cost = 0;
+		int pick = c;
+		for(int step = 0; step<sim->policy.lookahead&&pick!=-1; step++){
+			int segment = topology->section_segments[first+pick];
+			struct Train *t = queue_at(&sim->slots[segment].queue, popped[pick]++);
+			left--;
+			cost += (long)left*tunnel_duration(t);
+			//Greedy continuation, longest remaining queue first
+			pick = -1;
+			int max_count = 0;
+			for(int k = 0; k<size; k++){
+				int remaining = sim->queue_status[topology->section_segments[first+k]]-popped[k];
+				if(remaining>max_count){
+					pick = k;
+					max_count = remaining;
+				}
+			}
+		}
+		if(best==-1||cost<best_cost){
+			best = candidate;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+const struct ReleasePolicy release_policies[] = {
+	{"longest", release_longest},
+	{"oldest", release_oldest},
+	{"weighted", release_weighted},
+	{"lookahead", release_lookahead}
+};
+
+/*
+ * Blocks the section once it holds high trains and lets trains in again
+ * once it is down to low, the original rule is high at the section's
+ * threshold and low at 0.
+ */
+int admission_hysteresis_update(struct Simulation *sim, int section_id, int num_trains){
+	int high = sim->policy.high>0?sim->policy.high:topology->block_threshold[section_id];
+	if(num_trains>=high)return ADMIT_BLOCK;
+	if(num_trains<=sim->policy.low)return ADMIT_ALLOW;
+	return ADMIT_KEEP;
+}
+
+int admission_hysteresis_accept(struct Simulation *sim, int segment_id, int queue_count){
+	return 1;
+}
+
+//Sections never block, each segment turns arrivals away at cap trains
+int admission_cap_update(struct Simulation *sim, int section_id, int num_trains){
+	//A section blocked under an earlier policy is opened again
+	return sim->sections[section_id].allow_trains?ADMIT_KEEP:ADMIT_ALLOW;
+}
+
+//Called from the workers, only reads the policy
+int admission_cap_accept(struct Simulation *sim, int segment_id, int queue_count){
+	return queue_count<sim->policy.cap;
+}
+
+const struct AdmissionPolicy admission_policies[] = {
+	{"hysteresis", admission_hysteresis_update, admission_hysteresis_accept},
+	{"cap", admission_cap_update, admission_cap_accept}
+};
+
+//Label of a policy as given on the command line
+void policy_name(struct Policy *p){
+	char release[POLICY_NAME_LENGTH/2], admission[POLICY_NAME_LENGTH/2];
+	if(p->release->choose==release_lookahead){
+		snprintf(release, sizeof(release), "lookahead:%d", p->lookahead);
+	}else{
+		snprintf(release, sizeof(release), "%s", p->release->name);
+	}
+	if(p->admission->accept==admission_cap_accept){
+		snprintf(admission, sizeof(admission), "cap:%d", p->cap);
+	}else if(p->high>0){
+		snprintf(admission, sizeof(admission), "hysteresis:%d:%d", p->high, p->low);
+	}else{
+		snprintf(admission, sizeof(admission), "hysteresis");
+	}
+	snprintf(p->name, sizeof(p->name), "%s/%s", release, admission);
+}
+
+//Parses longest, oldest, weighted or lookahead[:N] into p, 0 on success
+int parse_release(const char *spec, struct Policy *p){
+	const char *colon = strchr(spec, ':');
+	size_t length = colon!=NULL?(size_t)(colon-spec):strlen(spec);
+	for(size_t i = 0; i<sizeof(release_policies)/sizeof(release_policies[0]); i++){
+		if(strlen(release_policies[i].name)!=length||strncmp(spec, release_policies[i].name, length)!=0)continue;
+		if(colon!=NULL){
+			//Only lookahead takes a depth
+			if(release_policies[i].choose!=release_lookahead)return -1;
+			char *end;
+			long depth = strtol(colon+1, &end, 10);
+			if(*end!='\0'||depth<1)return -1;
+			p->lookahead = depth;
+		}
+		p->release = &release_policies[i];
+		policy_name(p);
+		return 0;
+	}
+	return -1;
+}
+
+//Parses hysteresis[:HIGH[:LOW]] or cap:N into p, 0 on success
+int parse_admission(const char *spec, struct Policy *p){
+	int high = 0, low = 0, cap = 0;
+	char end;
+	if(strcmp(spec, "hysteresis")==0||sscanf(spec, "hysteresis:%d%c", &high, &end)==1||sscanf(spec, "hysteresis:%d:%d%c", &high, &low, &end)==2){
+		if(high<0||low<0||(high>0&&low>=high))return -1;
+		p->admission = &admission_policies[0];
+		p->high = high;
+		p->low = low;
+	}else if(sscanf(spec, "cap:%d%c", &cap, &end)==1&&cap>0){
+		p->admission = &admission_policies[1];
+		p->cap = cap;
+	}else{
+		return -1;
+	}
+	policy_name(p);
+	return 0;
+}
+
+void decide_releasing_queue(struct Simulation *sim, int section_id){
+	struct Section *section = &sim->sections[section_id];
+	if(section->can_release!=1)return;
+	section->releasing_segment_id = sim->policy.release->choose(sim, section_id);
+}
+
+//Queueing delay of a train released on its departure_time
+void record_departure(struct Simulation *sim, struct Train *t){
+	struct TrainStats *stats = &sim->train_stats;
+	int wait = t->departure_time-t->arrival_time;
+	delay_record(&stats->wait, wait);
+	delay_record(&stats->wait_by_origin[t->origin], wait);
+	delay_record(&stats->wait_by_destination[t->destination], wait);
+	if(sim->history!=NULL)history_append(sim->history, t);
+}
+
+//Time in the tunnel of a train leaving it on this tick
+void record_tunnel_exit(struct Simulation *sim, struct Train *t){
+	struct TrainStats *stats = &sim->train_stats;
+	int tunnel = sim->tick-t->departure_time;
+	delay_record(&stats->tunnel, tunnel);
+	delay_record(&stats->tunnel_by_origin[t->origin], tunnel);
+	delay_record(&stats->tunnel_by_destination[t->destination], tunnel);
+}
+
+//Tunnel state is only touched by the controller
+void update_tunnel_tick(struct Simulation *sim, struct Section *section, int update){
+	section->tunnel_ticks+=update;
+	if(section->tunnel_ticks<=0){
+		if(section->train_in_tunnel.id!=0)record_tunnel_exit(sim, &section->train_in_tunnel);
+		section->tunnel_ticks=0;
+		section->can_release=1;
+		section->train_in_tunnel.id=0;
+	}
+}
+
+//Puts a released train in its section, returns how many ticks it occupies it
+int enter_tunnel(struct Simulation *sim, struct Train *t){
+	struct Section *section = &sim->sections[topology->segment_section[t->origin]];
+	int duration = tunnel_duration(t);
+	int busy = sim->simulation_time-sim->tick+1;
+	section->train_in_tunnel = *t;
+	update_tunnel_tick(sim, section, duration);
+	record_departure(sim, t);
+	section->can_release = (t->broken==1)?RED_BLACK:YELLOW_BLACK;
+	section->released_trains++;
+	sim->released_trains++;
+	//Utilisation only counts tunnel time inside the run
+	sim->busy_ticks += duration<busy?duration:busy;
+	return duration;
+}
+
+void publish_control(struct Section *section, unsigned int flags){
+	unsigned int word = (unsigned int)(section->releasing_segment_id+1)&CONTROL_RELEASE_MASK;
+	if(section->allow_trains)word |= CONTROL_ALLOW;
+	atomic_store_explicit(&section->control, word|flags, memory_order_release);
+}
+
+//Reads a segment slot into the controller's view and puts its released train in the tunnel
+void collect_segment(struct Simulation *sim, int segment_id){
+	struct SegmentSlot *slot = &sim->slots[segment_id];
+	sim->queue_status[segment_id] = atomic_load_explicit(&slot->queue_count, memory_order_acquire);
+	sim->queue_leaders[segment_id] = slot->leader;
+	if(slot->has_released){
+		enter_tunnel(sim, &slot->released);
+		log_train_release(sim, &slot->released);
+	}
+}
+
+//Collects every segment and logs the tick's trains in segment order
+void collect_segments(struct Simulation *sim){
+	for(int i = 0; i<queue_count; i++)collect_segment(sim, i);
+	for(int i = 0; i<queue_count; i++){
+		if(sim->slots[i].has_arrived)log_train_arrival(sim, &sim->slots[i].arrived);
+	}
+}
+
+int count_trains(struct Simulation *sim){
+	int count = 0;
+	for(int i = 0; i<queue_count; i++){
+		count+=sim->queue_status[i];
+	}
+	return count;
+}
+
+int count_section_trains(struct Simulation *sim, int section_id){
+	int count = 0;
+	for(int k = topology->section_offset[section_id]; k<topology->section_offset[section_id+1]; k++){
+		count+=sim->queue_status[topology->section_segments[k]];
+	}
+	return count;
+}
+
+//Formats a console line for the simulation's console hook, free without one
+void sim_console(struct Simulation *sim, int color, const char *format, ...){
+	if(sim->console==NULL)return;
+	char line[CONSOLE_LINE_MAX];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, CONSOLE_LINE_MAX, format, args);
+	va_end(args);
+	sim->console(color, line, sim->console_user);
+}
+
+//Advances one segment by a tick, only touches the segment's own slot
+void segment_step(struct Simulation *sim, int segment_id, float p){
+	struct SegmentSlot *slot = &sim->slots[segment_id];
+	struct TrainQueue *queue = &slot->queue;
+	struct Section *section = &sim->sections[topology->segment_section[segment_id]];
+	unsigned int control = atomic_load_explicit(&section->control, memory_order_acquire);
+	double draws[DRAWS_PER_TICK];
+
+	//Fixed number of draws per tick keeps the stream independent of state
+	if(arrival_trace==NULL)rng_fill(&slot->rng, draws, DRAWS_PER_TICK);
+	slot->has_arrived = 0;
+	slot->has_released = 0;
+	if((int)(control&CONTROL_RELEASE_MASK)-1==segment_id){
+		slot->released = queue_pop(queue);
+		slot->released.departure_time = sim->tick;
+		slot->has_released = 1;
+		sim_console(sim, GREEN_BLACK, "[SEGMENT %s] Released train with ID %04u.", topology->place_names[segment_id], slot->released.id);
+	}
+	if(arrival_trace!=NULL){
+		//Replayed trains are turned away like drawn ones, their record is used up either way
+		const struct TraceRecord *r = trace_due(sim, segment_id, sim->tick);
+		if(r!=NULL){
+			slot->trace_next++;
+			if((control&CONTROL_ALLOW)&&sim->policy.admission->accept(sim, segment_id, queue->count)){
+				make_trace_train(sim, segment_id, r, &slot->arrived);
+				queue_push(queue, &slot->arrived);
+				slot->has_arrived = 1;
+			}
+		}
+	}else if(draws[0]<p&&(control&CONTROL_ALLOW)&&sim->policy.admission->accept(sim, segment_id, queue->count)){
+		//tick only changes in the controller phase
+		make_train(sim, segment_id, draws, &slot->arrived);
+		queue_push(queue, &slot->arrived);
+		slot->has_arrived = 1;
+	}
+	slot->leader = queue_front(queue);
+	atomic_store_explicit(&slot->queue_count, queue->count, memory_order_release);
+	sim_console(sim, GREEN_BLACK, "[SEGMENT %s] %d trains in queue.", topology->place_names[segment_id], queue->count);
+}
+
+//A task is a block of TASK_SEGMENTS contiguous segments
+void run_segment_task(struct Simulation *sim, int task){
+	int end = (task+1)*TASK_SEGMENTS;
+	if(end>queue_count)end = queue_count;
+	for(int i = task*TASK_SEGMENTS; i<end; i++)segment_step(sim, i, segment_rate(sim, i));
+}
+
+void deque_init(struct TaskDeque *d, int capacity){
+	long size = 1;
+	while(size<capacity)size<<=1;
+	d->tasks = calloc(size, sizeof(_Atomic int));
+	d->mask = size-1;
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+}
+
+void deque_push(struct TaskDeque *d, int task){
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	atomic_store_explicit(&d->tasks[b&d->mask], task, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+}
+
+//Owner side, returns -1 when the deque is empty
+int deque_pop(struct TaskDeque *d){
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed)-1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	int task = -1;
+	if(t<=b){
+		task = atomic_load_explicit(&d->tasks[b&d->mask], memory_order_relaxed);
+		if(t==b){
+			//Last task, race the thieves for it
+			if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1, memory_order_seq_cst, memory_order_relaxed))task = -1;
+			atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+		}
+	}else{
+		atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+	}
+	return task;
+}
+
+//Thief side, returns -1 when empty or when another thread won the race
+int deque_steal(struct TaskDeque *d){
+	long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if(t>=b)return -1;
+	int task = atomic_load_explicit(&d->tasks[t&d->mask], memory_order_relaxed);
+	if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1, memory_order_seq_cst, memory_order_relaxed))return -1;
+	return task;
+}
+
+static inline void cpu_relax(){
+#if defined(__x86_64__)||defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+void phase_barrier_init(struct PhaseBarrier *b, int parties){
+	atomic_init(&b->remaining, parties);
+	atomic_init(&b->sense, 0);
+	b->parties = parties;
+	pthread_mutex_init(&b->mutex, NULL);
+	pthread_cond_init(&b->cond, NULL);
+}
+
+void phase_barrier_destroy(struct PhaseBarrier *b){
+	pthread_mutex_destroy(&b->mutex);
+	pthread_cond_destroy(&b->cond);
+}
+
+//Returns once the last thread to arrive has run serial(arg), 1 in that thread
+int phase_barrier_wait(struct PhaseBarrier *b, int *local_sense, void (*serial)(void *), void *arg){
+	int sense = !*local_sense;
+	*local_sense = sense;
+	if(atomic_fetch_sub_explicit(&b->remaining, 1, memory_order_acq_rel)==1){
+		serial(arg);
+		atomic_store_explicit(&b->remaining, b->parties, memory_order_relaxed);
+		pthread_mutex_lock(&b->mutex);
+		atomic_store_explicit(&b->sense, sense, memory_order_release);
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->mutex);
+		return 1;
+	}
+	for(int spin = 0; spin<BARRIER_SPINS; spin++){
+		if(atomic_load_explicit(&b->sense, memory_order_acquire)==sense)return 0;
+		cpu_relax();
+	}
+	pthread_mutex_lock(&b->mutex);
+	while(atomic_load_explicit(&b->sense, memory_order_acquire)!=sense)pthread_cond_wait(&b->cond, &b->mutex);
+	pthread_mutex_unlock(&b->mutex);
+	return 0;
+}
+
+/*
+ * Runs this worker's share of a tick: its own block of tasks first, then
+ * whatever it can steal from the others, starting with its neighbour.
+ */
+void worker_run_tick(struct Worker *w){
+	struct Simulation *sim = w->sim;
+	for(int task = w->last_task-1; task>=w->first_task; task--)deque_push(&w->deque, task);
+	int task;
+	while((task = deque_pop(&w->deque))>=0)run_segment_task(sim, task);
+	for(int k = 1; k<sim->worker_count; k++){
+		struct TaskDeque *victim = &sim->workers[(w->id+k)%sim->worker_count].deque;
+		while((task = deque_steal(victim))>=0)run_segment_task(sim, task);
+	}
+}
+
+int event_before(struct Event *a, struct Event *b){
+	if(a->tick!=b->tick)return a->tick<b->tick;
+	if(a->type!=b->type)return a->type<b->type;
+	return a->segment_id<b->segment_id;
+}
+
+void event_push(struct Simulation *sim, int at, int type, int segment_id){
+	if(sim->event_count==sim->event_capacity){
+		sim->event_capacity = sim->event_capacity?2*sim->event_capacity:16;
+		sim->event_heap = realloc(sim->event_heap, sim->event_capacity*sizeof(struct Event));
+	}
+	struct Event *heap = sim->event_heap;
+	int i = sim->event_count++;
+	heap[i].tick = at;
+	heap[i].type = type;
+	heap[i].segment_id = segment_id;
+	//Sift up
+	while(i>0&&event_before(&heap[i], &heap[(i-1)/2])){
+		struct Event e = heap[i];
+		heap[i] = heap[(i-1)/2];
+		heap[(i-1)/2] = e;
+		i = (i-1)/2;
+	}
+}
+
+struct Event event_pop(struct Simulation *sim){
+	struct Event *heap = sim->event_heap;
+	struct Event top = heap[0];
+	heap[0] = heap[--sim->event_count];
+	//Sift down
+	int i = 0;
+	for(;;){
+		int l = 2*i+1, r = 2*i+2, m = i;
+		if(l<sim->event_count&&event_before(&heap[l], &heap[m]))m=l;
+		if(r<sim->event_count&&event_before(&heap[r], &heap[m]))m=r;
+		if(m==i)break;
+		struct Event e = heap[i];
+		heap[i] = heap[m];
+		heap[m] = e;
+		i = m;
+	}
+	return top;
+}
+
+//Ticks until the next success of a per-tick Bernoulli(p) draw, at least 1
+int get_geometric(struct Simulation *sim, int segment_id, float p){
+	if(p>=1.0f)return 1;
+	if(p<=0.0f)return -1;
+	double u = 1.0-rng_uniform(&sim->slots[segment_id].rng);
+	double g = floor(log(u)/log(1.0-p));
+	//Far enough that no run reaches it, even one resumed with a longer -s
+	if(g>(1<<30))return 1<<30;
+	return 1+(int)g;
+}
+
+//Rounds an allocation up to whole cache lines for aligned_alloc
+void *alloc_lines(size_t size){
+	size = (size+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE;
+	void *p = aligned_alloc(CACHE_LINE, size);
+	memset(p, 0, size);
+	return p;
+}
+
+//Fresh per-worker stats for a run, the front end schedules the first dump
+void stats_init(struct Simulation *sim, int count){
+	free(sim->stats);
+	sim->stats = alloc_lines(count*sizeof(struct WorkerStats));
+	sim->stats_count = count;
+	sim->stats_next_dump = 0;
+}
+
+//Phase histograms of all workers merged into out[PHASE_COUNT]
+void stats_merge(struct Simulation *sim, struct Histogram *out){
+	memset(out, 0, PHASE_COUNT*sizeof(struct Histogram));
+	for(int w = 0; w<sim->stats_count; w++){
+		for(int p = 0; p<PHASE_COUNT; p++)hist_merge(&out[p], &sim->stats[w].phase[p]);
+	}
+}
+
+//One Prometheus summary per origin and per destination that saw trains
+void write_delay_summary(FILE *out, const char *metric, const char *help, struct DelayHistogram *by_origin, struct DelayHistogram *by_destination){
+	static const double quantiles[] = {0.5, 0.95, 0.99};
+	fprintf(out, "# HELP %s %s\n", metric, help);
+	fprintf(out, "# TYPE %s summary\n", metric);
+	for(int by = 0; by<2; by++){
+		const char *label = by==0?"origin":"destination";
+		int count = by==0?topology->segment_count:topology->place_count;
+		struct DelayHistogram *h = by==0?by_origin:by_destination;
+		for(int i = 0; i<count; i++){
+			if(h[i].count==0)continue;
+			for(int q = 0; q<3; q++)fprintf(out, "%s{%s=\"%s\",quantile=\"%g\"} %d\n", metric, label, topology->place_names[i], quantiles[q], delay_quantile(&h[i], quantiles[q]));
+			fprintf(out, "%s_sum{%s=\"%s\"} %llu\n", metric, label, topology->place_names[i], (unsigned long long)h[i].sum);
+			fprintf(out, "%s_count{%s=\"%s\"} %u\n", metric, label, topology->place_names[i], h[i].count);
+		}
+	}
+}
+
+/*
+ * Writes the phase timings as Prometheus summaries plus a few run gauges.
+ * Only called while no worker is recording, the file is replaced atomically
+ * so a collector never reads half of it.
+ */
+int stats_write(struct Simulation *sim, const char *path){
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	size_t length = strlen(path)+5;
+	char *temporary = malloc(length);
+	snprintf(temporary, length, "%s.tmp", path);
+	FILE *out = fopen(temporary, "w");
+	if(out==NULL){
+		free(temporary);
+		return LOG_OPEN_ERR;
+	}
+	struct Histogram *merged = malloc(PHASE_COUNT*sizeof(struct Histogram));
+	stats_merge(sim, merged);
+	fprintf(out, "# HELP metrosim_phase_seconds Wall time of each phase of a tick.\n");
+	fprintf(out, "# TYPE metrosim_phase_seconds summary\n");
+	for(int p = 0; p<PHASE_COUNT; p++){
+		if(merged[p].count==0)continue;
+		for(int q = 0; q<4; q++){
+			fprintf(out, "metrosim_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n", phase_names[p], quantiles[q], hist_quantile(&merged[p], quantiles[q])/1e9);
+		}
+		fprintf(out, "metrosim_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[p], merged[p].sum/1e9);
+		fprintf(out, "metrosim_phase_seconds_count{phase=\"%s\"} %llu\n", phase_names[p], (unsigned long long)merged[p].count);
+	}
+	fprintf(out, "# HELP metrosim_phase_max_seconds Longest recorded phase.\n");
+	fprintf(out, "# TYPE metrosim_phase_max_seconds gauge\n");
+	for(int p = 0; p<PHASE_COUNT; p++){
+		if(merged[p].count>0)fprintf(out, "metrosim_phase_max_seconds{phase=\"%s\"} %.9f\n", phase_names[p], merged[p].max/1e9);
+	}
+	//Per worker totals show a straggling worker
+	fprintf(out, "# HELP metrosim_worker_seconds_total Time each worker spent stepping segments and waiting.\n");
+	fprintf(out, "# TYPE metrosim_worker_seconds_total counter\n");
+	for(int w = 0; w<sim->stats_count; w++){
+		fprintf(out, "metrosim_worker_seconds_total{worker=\"%d\",phase=\"step\"} %.9f\n", w, sim->stats[w].phase[PHASE_STEP].sum/1e9);
+		fprintf(out, "metrosim_worker_seconds_total{worker=\"%d\",phase=\"barrier\"} %.9f\n", w, sim->stats[w].phase[PHASE_BARRIER].sum/1e9);
+	}
+	struct TrainStats *train = &sim->train_stats;
+	write_delay_summary(out, "metrosim_train_wait_ticks", "Ticks from arrival to release.", train->wait_by_origin, train->wait_by_destination);
+	write_delay_summary(out, "metrosim_train_tunnel_ticks", "Ticks from release to tunnel exit.", train->tunnel_by_origin, train->tunnel_by_destination);
+	fprintf(out, "# TYPE metrosim_tick gauge\nmetrosim_tick %d\n", sim->tick);
+	fprintf(out, "# TYPE metrosim_trains_arrived_total counter\nmetrosim_trains_arrived_total %d\n", count_arrivals(sim));
+	fprintf(out, "# TYPE metrosim_trains_released_total counter\nmetrosim_trains_released_total %d\n", sim->released_trains);
+	fprintf(out, "# TYPE metrosim_trains_waiting gauge\nmetrosim_trains_waiting %d\n", count_trains(sim));
+	fprintf(out, "# TYPE metrosim_blocked_ticks_total counter\nmetrosim_blocked_ticks_total %d\n", sim->blocked_ticks);
+	free(merged);
+	fclose(out);
+	int status = rename(temporary, path)==0?0:LOG_OPEN_ERR;
+	free(temporary);
+	return status;
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length){
+	const unsigned char *bytes = data;
+	for(size_t i = 0; i<length; i++){
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+//Hash of the names and section membership, a checkpoint only fits its own network
+uint64_t topology_hash(){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	//Name slots are only defined up to their terminator
+	for(int i = 0; i<topology->place_count; i++)hash = fnv1a(hash, topology->place_names[i], strlen(topology->place_names[i])+1);
+	for(int i = 0; i<topology->section_count; i++)hash = fnv1a(hash, topology->section_names[i], strlen(topology->section_names[i])+1);
+	return fnv1a(hash, topology->segment_section, topology->segment_count*sizeof(int));
+}
+
+int trace_error(const char *source, long line, const char *message){
+	if(line>0)printf("%s:%ld: %s\n", source, line, message);
+	else printf("%s %s\n", source, message);
+	return TRACE_ERR;
+}
+
+//Copies the next comma separated field of a CSV line, returns a pointer past it
+const char *csv_field(const char *p, const char *end, char *field, size_t size){
+	size_t n = 0;
+	while(p<end&&(*p==' '||*p=='\t'))p++;
+	while(p<end&&*p!=','&&*p!='\n'&&*p!='\r'){
+		if(n+1<size)field[n++] = *p;
+		p++;
+	}
+	while(n>0&&(field[n-1]==' '||field[n-1]=='\t'))n--;
+	field[n] = '\0';
+	if(p<end&&*p==',')p++;
+	return p;
+}
+
+/*
+ * Parses one CSV line "tick,origin,destination,length,broken" into r, with
+ * the places given by name. Returns 1 for a record, 0 for a blank or
+ * comment line and -1 on errors. *p is moved to the next line.
+ */
+int trace_parse_line(const char **p, const char *end, int *sorted, struct TraceRecord *r, const char **error){
+	const char *line_end = memchr(*p, '\n', end-*p);
+	if(line_end==NULL)line_end = end;
+	const char *q = *p;
+	*p = line_end<end?line_end+1:end;
+	while(q<line_end&&(*q==' '||*q=='\t'||*q=='\r'))q++;
+	if(q==line_end||*q=='#')return 0;
+	char field[5][NAME_LENGTH+8];
+	for(int f = 0; f<5; f++)q = csv_field(q, line_end, field[f], sizeof(field[f]));
+	char *tail;
+	long tick = strtol(field[0], &tail, 10);
+	if(*tail!='\0'||tick<0){
+		*error = "tick is not a number";
+		return -1;
+	}
+	int origin = find_name(topology->place_names, sorted, topology->place_count, field[1]);
+	if(origin<0||origin>=topology->segment_count){
+		*error = "origin is not a segment";
+		return -1;
+	}
+	int destination = find_name(topology->place_names, sorted, topology->place_count, field[2]);
+	if(destination<0){
+		*error = "unknown destination";
+		return -1;
+	}
+	long length = strtol(field[3], &tail, 10);
+	if(*tail!='\0'||length<1||length>127){
+		*error = "length must be 1 to 127";
+		return -1;
+	}
+	long broken = strtol(field[4], &tail, 10);
+	if(*tail!='\0'||(broken!=0&&broken!=1)){
+		*error = "broken must be 0 or 1";
+		return -1;
+	}
+	r->tick = tick;
+	r->origin = origin;
+	r->destination = destination;
+	r->length = length;
+	r->broken = broken;
+	r->reserved = 0;
+	return 1;
+}
+
+int compare_trace_records(const void *a, const void *b){
+	const struct TraceRecord *x = a, *y = b;
+	if(x->tick!=y->tick)return x->tick<y->tick?-1:1;
+	if(x->destination!=y->destination)return x->destination<y->destination?-1:1;
+	if(x->length!=y->length)return x->length<y->length?-1:1;
+	return x->broken-y->broken;
+}
+
+/*
+ * Converts a CSV trace into the binary layout in one buffer. The first pass
+ * counts the records of every origin, the second writes each into its
+ * origin's slice. A first line that does not start with a tick is taken
+ * as a column header.
+ */
+void *trace_from_csv(const char *text, size_t size, const char *path, size_t *out_size){
+	const char *end = text+size;
+	int *sorted = sorted_name_index(topology->place_names, topology->place_count);
+	uint64_t *counts = calloc(topology->segment_count+1, sizeof(uint64_t));
+	struct TraceRecord r;
+	const char *error = NULL;
+	const char *p = text;
+	//Column header
+	if(p<end&&(*p<'0'||*p>'9')&&*p!='#'){
+		const char *line_end = memchr(p, '\n', end-p);
+		p = line_end!=NULL?line_end+1:end;
+	}
+	const char *first = p;
+	long line = (first!=text)?1:0;
+	uint64_t total = 0;
+	while(p<end){
+		line++;
+		int status = trace_parse_line(&p, end, sorted, &r, &error);
+		if(status<0){
+			trace_error(path, line, error);
+			free(sorted);
+			free(counts);
+			return NULL;
+		}
+		if(status==1){
+			counts[r.origin+1]++;
+			total++;
+		}
+	}
+	size_t header_size = sizeof(struct TraceHeader)+(topology->segment_count+1)*sizeof(uint64_t);
+	*out_size = header_size+total*sizeof(struct TraceRecord);
+	char *data = malloc(*out_size);
+	struct TraceHeader *header = (struct TraceHeader *)data;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, TRACE_MAGIC, 8);
+	header->version = TRACE_VERSION;
+	header->record_size = sizeof(struct TraceRecord);
+	header->record_count = total;
+	header->topology_hash = topology_hash();
+	header->segment_count = topology->segment_count;
+	uint64_t *offsets = (uint64_t *)(data+sizeof(struct TraceHeader));
+	for(int i = 0; i<topology->segment_count; i++)counts[i+1] += counts[i];
+	memcpy(offsets, counts, (topology->segment_count+1)*sizeof(uint64_t));
+	struct TraceRecord *records = (struct TraceRecord *)(data+header_size);
+	for(p = first; p<end;){
+		if(trace_parse_line(&p, end, sorted, &r, &error)==1)records[counts[r.origin]++] = r;
+	}
+	//Recorded logs are usually in order already, only unordered slices are sorted
+	for(int i = 0; i<topology->segment_count; i++){
+		for(uint64_t k = offsets[i]+1; k<offsets[i+1]; k++){
+			if(records[k].tick<records[k-1].tick){
+				qsort(&records[offsets[i]], offsets[i+1]-offsets[i], sizeof(struct TraceRecord), compare_trace_records);
+				break;
+			}
+		}
+	}
+	free(sorted);
+	free(counts);
+	return data;
+}
+
+/*
+ * Checks a binary trace against the loaded network in one sequential pass,
+ * so replay can index records without further checks.
+ */
+int trace_check(struct Trace *t, const char *path){
+	const struct TraceHeader *header = t->data;
+	if(t->size<sizeof(*header)||header->version!=TRACE_VERSION||header->record_size!=sizeof(struct TraceRecord))return trace_error(path, 0, "is not a MetroSim trace");
+	if(header->segment_count!=(uint32_t)topology->segment_count||header->topology_hash!=topology_hash())return trace_error(path, 0, "was converted for a different network");
+	size_t header_size = sizeof(*header)+(header->segment_count+1)*sizeof(uint64_t);
+	if(t->size<header_size||(t->size-header_size)/sizeof(struct TraceRecord)<header->record_count)return trace_error(path, 0, "is truncated");
+	t->offsets = (const uint64_t *)((const char *)t->data+sizeof(*header));
+	t->records = (const struct TraceRecord *)((const char *)t->data+header_size);
+	if(t->offsets[0]!=0||t->offsets[header->segment_count]!=header->record_count)return trace_error(path, 0, "has a corrupt index");
+	for(uint32_t i = 0; i<header->segment_count; i++){
+		if(t->offsets[i+1]<t->offsets[i])return trace_error(path, 0, "has a corrupt index");
+		for(uint64_t k = t->offsets[i]; k<t->offsets[i+1]; k++){
+			const struct TraceRecord *r = &t->records[k];
+			if(r->origin!=i||r->destination>=topology->place_count||r->length<1||r->length>127||r->broken>1||(k>t->offsets[i]&&r->tick<r[-1].tick)){
+				return trace_error(path, 0, "has a corrupt record");
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Maps a trace file, binary traces are used in place and CSV traces are
+ * converted in memory first. Returns NULL after printing the reason.
+ */
+struct Trace *trace_load(const char *path){
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if(fd<0||fstat(fd, &st)!=0){
+		if(fd>=0)close(fd);
+		printf("Cannot open trace %s\n", path);
+		return NULL;
+	}
+	if(st.st_size==0){
+		close(fd);
+		trace_error(path, 0, "is empty");
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map==MAP_FAILED){
+		printf("Cannot map trace %s\n", path);
+		return NULL;
+	}
+	struct Trace *t = calloc(1, sizeof(struct Trace));
+	if(st.st_size>=8&&memcmp(map, TRACE_MAGIC, 8)==0){
+		//Every segment walks its own slice front to back
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		t->data = map;
+		t->size = st.st_size;
+		t->mapped = 1;
+	}else{
+		t->data = trace_from_csv(map, st.st_size, path, &t->size);
+		munmap(map, st.st_size);
+		if(t->data==NULL){
+			free(t);
+			return NULL;
+		}
+	}
+	if(trace_check(t, path)!=0){
+		trace_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void trace_free(struct Trace *t){
+	if(t==NULL)return;
+	if(t->mapped){
+		munmap(t->data, t->size);
+	}else{
+		free(t->data);
+	}
+	free(t);
+}
+
+//Writes a loaded trace in its binary form
+int trace_write(struct Trace *t, const char *path){
+	FILE *out = fopen(path, "wb");
+	if(out==NULL)return LOG_OPEN_ERR;
+	size_t written = fwrite(t->data, 1, t->size, out);
+	if(fclose(out)!=0||written!=t->size)return LOG_OPEN_ERR;
+	return 0;
+}
+
+void schedule_arrival(struct Simulation *sim, int segment_id, int from){
+	if(arrival_trace!=NULL){
+		//Next record, no earlier than the tick after the last arrival
+		uint64_t next = sim->slots[segment_id].trace_next;
+		if(next>=arrival_trace->offsets[segment_id+1])return;
+		int tick = arrival_trace->records[next].tick;
+		event_push(sim, tick>from?tick:from+1, EV_ARRIVAL, segment_id);
+		return;
+	}
+	int gap = get_geometric(sim, segment_id, segment_rate(sim, segment_id));
+	//Events past the end are kept so a checkpoint can be resumed with a longer run
+	if(gap>0)event_push(sim, from+gap, EV_ARRIVAL, segment_id);
+}
+
+//Marks a section for this tick's control step
+void touch_section(struct Simulation *sim, int section_id, int *dirty, int *dirty_count){
+	if(sim->sections[section_id].dirty)return;
+	sim->sections[section_id].dirty = 1;
+	dirty[(*dirty_count)++] = section_id;
+}
+
+/*
+ * Event driven counterpart of the tick engine. State only
+ * changes on arrivals, releases and tunnel clears, so control decisions are
+ * taken on ticks that had an event and idle ticks are skipped entirely.
+ * Only the sections touched by the tick's events take a control step.
+ * With timing on, event handling counts as the step phase and the control
+ * step as the decide phase.
+ * Release and clear times follow the tick engine: a release decided on tick t
+ * happens on t+1 and a train of duration d frees the tunnel for decisions d
+ * ticks after its release.
+ * Split into start, step and finish so the library can step it.
+ */
+void event_engine_start(struct Simulation *sim){
+	for(int i = 0; i<queue_count&&!sim->started; i++){
+		//First draw happens on tick 0
+		schedule_arrival(sim, i, -1);
+	}
+	sim->started = 1;
+	if(sim->dirty==NULL)sim->dirty = malloc(topology->section_count*sizeof(int));
+}
+
+//Handles the events of the next tick that has any and its control steps, 0 once none is due
+int event_engine_step(struct Simulation *sim){
+	if(sim->event_count==0||sim->event_heap[0].tick>sim->simulation_time)return 0;
+	int *dirty = sim->dirty;
+	int now = sim->event_heap[0].tick;
+	int dirty_count = 0;
+	uint64_t lap = phase_start();
+	sim->tick = now;
+	while(sim->event_count>0&&sim->event_heap[0].tick==now){
+		struct Event e = event_pop(sim);
+		int id = e.segment_id;
+		if(e.type==EV_TUNNEL_CLEAR){
+			struct Section *section = &sim->sections[id];
+			update_tunnel_tick(sim, section, -section->tunnel_ticks);
+			touch_section(sim, id, dirty, &dirty_count);
+			continue;
+		}
+		int section_id = topology->segment_section[id];
+		struct TrainQueue *queue = &sim->slots[id].queue;
+		if(e.type==EV_RELEASE){
+			struct Train t = queue_pop(queue);
+			t.departure_time = now;
+			int duration = enter_tunnel(sim, &t);
+			log_train_release(sim, &t);
+			event_push(sim, now+duration, EV_TUNNEL_CLEAR, section_id);
+		}else{
+			//Train draws are taken even when turned away, as in the tick engine
+			double draws[DRAWS_PER_TICK];
+			const struct TraceRecord *r = NULL;
+			if(arrival_trace!=NULL){
+				r = &arrival_trace->records[sim->slots[id].trace_next++];
+			}else{
+				rng_fill(&sim->slots[id].rng, draws+1, DRAWS_PER_TICK-1);
+			}
+			if(sim->sections[section_id].allow_trains==1&&sim->policy.admission->accept(sim, id, queue->count)){
+				struct Train t;
+				if(r!=NULL){
+					make_trace_train(sim, id, r, &t);
+				}else{
+					make_train(sim, id, draws, &t);
+				}
+				queue_push(queue, &t);
+				if(queue->count>sim->max_queue_length)sim->max_queue_length=queue->count;
+				log_train_arrival(sim, &t);
+			}
+			schedule_arrival(sim, id, now);
+		}
+		sim->queue_status[id] = queue->count;
+		sim->queue_leaders[id] = queue_front(queue);
+		touch_section(sim, section_id, dirty, &dirty_count);
+	}
+	lap = phase_lap(PHASE_STEP, lap);
+	//Control step, same rules as the main loop
+	for(int d = 0; d<dirty_count; d++){
+		int s = dirty[d];
+		struct Section *section = &sim->sections[s];
+		section->dirty = 0;
+		int num_trains = count_section_trains(sim, s);
+		int admit = sim->policy.admission->update(sim, s, num_trains);
+		if(admit==ADMIT_BLOCK&&section->allow_trains==1){
+			section->allow_trains = 0;
+			section->blocked_since = now;
+			log_event(sim, LOG_BLOCK, s, 0, num_trains, NULL);
+		}
+		if(admit==ADMIT_ALLOW&&section->allow_trains==0){
+			section->allow_trains = 1;
+			section->blocked_ticks += now-section->blocked_since;
+			sim->blocked_ticks += now-section->blocked_since;
+			log_event(sim, LOG_ALLOW, s, 0, num_trains, NULL);
+		}
+		section->releasing_segment_id = -1;
+		decide_releasing_queue(sim, s);
+		if(section->releasing_segment_id!=-1){
+			log_event(sim, LOG_SIGNAL, s, section->releasing_segment_id, sim->queue_leaders[section->releasing_segment_id].id, NULL);
+			event_push(sim, now+1, EV_RELEASE, section->releasing_segment_id);
+			//Hold further decisions until the release happens
+			section->can_release = 0;
+		}
+	}
+	if(sim->series!=NULL)series_record(sim);
+	phase_lap(PHASE_DECIDE, lap);
+	if(sim->decided!=NULL)sim->decided(sim);
+	if(sim->advanced!=NULL)sim->advanced(sim, now+1);
+	return 1;
+}
+
+//Closes the blocks still in force at the end of the run
+void event_engine_finish(struct Simulation *sim){
+	for(int s = 0; s<topology->section_count; s++){
+		struct Section *section = &sim->sections[s];
+		if(section->allow_trains==0){
+			section->blocked_ticks += sim->simulation_time-section->blocked_since;
+			sim->blocked_ticks += sim->simulation_time-section->blocked_since;
+		}
+	}
+	free(sim->dirty);
+	sim->dirty = NULL;
+	sim->tick = sim->simulation_time;
+	sim->finished = 1;
+}
+
+void run_event_engine(struct Simulation *sim){
+	event_engine_start(sim);
+	if(sim->timing){
+		stats_init(sim, 1);
+		thread_stats = &sim->stats[0];
+	}
+	while(event_engine_step(sim));
+	thread_stats = NULL;
+	event_engine_finish(sim);
+}
+
+struct Simulation *sim_create(const struct SimParams *params){
+	struct Simulation *sim = calloc(1, sizeof(struct Simulation));
+	//Slots and sections need cache line alignment, which calloc does not give
+	sim->slots = alloc_lines(queue_count*sizeof(struct SegmentSlot));
+	sim->sections = alloc_lines(topology->section_count*sizeof(struct Section));
+	sim->queue_status = calloc(queue_count, sizeof(int));
+	sim->queue_leaders = calloc(queue_count, sizeof(struct Train));
+	sim->train_stats.wait_by_origin = calloc(queue_count, sizeof(struct DelayHistogram));
+	sim->train_stats.tunnel_by_origin = calloc(queue_count, sizeof(struct DelayHistogram));
+	sim->train_stats.wait_by_destination = calloc(topology->place_count, sizeof(struct DelayHistogram));
+	sim->train_stats.tunnel_by_destination = calloc(topology->place_count, sizeof(struct DelayHistogram));
+	sim->task_count = (queue_count+TASK_SEGMENTS-1)/TASK_SEGMENTS;
+	sim->scratch = malloc(queue_count*sizeof(int));
+	for(int i = 0; i<queue_count; i++)queue_init(&sim->slots[i].queue);
+	sim_reset(sim, params);
+	return sim;
+}
+
+/*
+ * Mirrors every draw of a fresh run, so it is the antithetic twin of a run on
+ * the same seed: arrivals, destinations, lengths and breakdowns all move the
+ * other way, and the mean of the pair has a lower variance than two
+ * independent runs.
+ */
+void sim_antithetic(struct Simulation *sim){
+	for(int i = 0; i<queue_count; i++)sim->slots[i].rng.mirror = (1ULL<<53)-1;
+}
+
+/*
+ * Puts a simulation back before tick 0 with new parameters, keeping its
+ * buffers and queue capacity. Logs, hooks and timing are left as they are.
+ */
+void sim_reset(struct Simulation *sim, const struct SimParams *params){
+	sim->probability = params->probability;
+	sim->breakdown = params->breakdown;
+	sim->simulation_time = params->simulation_time;
+	sim->seed = params->seed;
+	sim->engine = params->engine;
+	sim->worker_limit = params->worker_limit;
+	sim->policy = params->policy;
+	sim->tick = 0;
+	sim->released_trains = 0;
+	sim->max_queue_length = 0;
+	sim->blocked_ticks = 0;
+	sim->busy_ticks = 0;
+	sim->next_checkpoint = 0;
+	sim->started = 0;
+	sim->finished = 0;
+	sim->event_count = 0;
+	if(sim->history!=NULL)history_reset(sim->history);
+	memset(&sim->train_stats.wait, 0, sizeof(struct DelayHistogram));
+	memset(&sim->train_stats.tunnel, 0, sizeof(struct DelayHistogram));
+	memset(sim->train_stats.wait_by_origin, 0, queue_count*sizeof(struct DelayHistogram));
+	memset(sim->train_stats.tunnel_by_origin, 0, queue_count*sizeof(struct DelayHistogram));
+	memset(sim->train_stats.wait_by_destination, 0, topology->place_count*sizeof(struct DelayHistogram));
+	memset(sim->train_stats.tunnel_by_destination, 0, topology->place_count*sizeof(struct DelayHistogram));
+	memset(sim->queue_status, 0, queue_count*sizeof(int));
+	memset(sim->queue_leaders, 0, queue_count*sizeof(struct Train));
+	struct Rng *streams = malloc(queue_count*sizeof(struct Rng));
+	rng_seed_streams(streams, queue_count, params->seed);
+	for(int i = 0; i<queue_count; i++){
+		struct SegmentSlot *slot = &sim->slots[i];
+		struct TrainQueue queue = slot->queue;
+		memset(slot, 0, sizeof(struct SegmentSlot));
+		slot->queue = queue;
+		slot->queue.head = 0;
+		slot->queue.count = 0;
+		slot->rng = streams[i];
+		if(arrival_trace!=NULL)slot->trace_next = arrival_trace->offsets[i];
+	}
+	free(streams);
+	memset(sim->sections, 0, topology->section_count*sizeof(struct Section));
+	for(int i = 0; i<topology->section_count; i++){
+		struct Section *section = &sim->sections[i];
+		section->releasing_segment_id = -1;
+		section->can_release = 1;
+		section->allow_trains = 1;
+		publish_control(section, 0);
+	}
+}
+
+void sim_destroy(struct Simulation *sim){
+	for(int i = 0; i<queue_count; i++)queue_free(&sim->slots[i].queue);
+	free(sim->slots);
+	free(sim->sections);
+	free(sim->queue_status);
+	free(sim->queue_leaders);
+	free(sim->train_stats.wait_by_origin);
+	free(sim->train_stats.tunnel_by_origin);
+	free(sim->train_stats.wait_by_destination);
+	free(sim->train_stats.tunnel_by_destination);
+	free(sim->event_heap);
+	free(sim->dirty);
+	free(sim->stats);
+	free(sim->scratch);
+	history_free(sim->history);
+	free(sim);
+}
+
+//Tick engine control step of one section: admission, then the next release
+void control_section(struct Simulation *sim, int s){
+	struct Section *section = &sim->sections[s];
+	if(section->allow_trains==0){
+		section->blocked_ticks++;
+		sim->blocked_ticks++;
+	}
+	int num_trains = count_section_trains(sim, s);
+	int admit = sim->policy.admission->update(sim, s, num_trains);
+	if(admit==ADMIT_BLOCK&&section->allow_trains==1){
+		section->allow_trains=0;
+		log_event(sim, LOG_BLOCK, s, 0, num_trains, NULL);
+	}
+	if(admit==ADMIT_ALLOW){
+		section->allow_trains=1;
+		log_event(sim, LOG_ALLOW, s, 0, num_trains, NULL);
+	}
+	section->releasing_segment_id = -1;
+	decide_releasing_queue(sim, s);
+	if(section->releasing_segment_id!=-1){
+		log_event(sim, LOG_SIGNAL, s, section->releasing_segment_id, sim->queue_leaders[section->releasing_segment_id].id, NULL);
+		sim_console(sim, section->can_release, "[CONTROL] Signalling segment %s to release train with ID %04u.", topology->place_names[section->releasing_segment_id], sim->queue_leaders[section->releasing_segment_id].id);
+	}else{
+		log_event(sim, LOG_BUSY, s, 0, 0, NULL);
+		sim_console(sim, section->can_release, "[CONTROL] Cannot release train, tunnel %s is busy.", topology->section_names[s]);
+	}
+}
+
+/*
+ * Controller phase of a tick, run by the last worker to reach the phase
+ * barrier. Walks every section once, so a tick costs time linear in the
+ * network size. The front end hooks run on the controller, between ticks.
+ */
+void control_phase(void *arg){
+	struct Simulation *sim = arg;
+	uint64_t start = phase_start();
+
+	collect_segments(sim);
+	for(int i = 0; i<queue_count; i++){
+		if(sim->queue_status[i]>sim->max_queue_length)sim->max_queue_length=sim->queue_status[i];
+	}
+	uint64_t lap = phase_lap(PHASE_COLLECT, start);
+	for(int s = 0; s<topology->section_count; s++)control_section(sim, s);
+	if(sim->series!=NULL)series_record(sim);
+	lap = phase_lap(PHASE_DECIDE, lap);
+	//Control time leaves out the hooks, the display and its pacing
+	uint64_t control = lap-start;
+	if(sim->decided!=NULL)sim->decided(sim);
+	if(sim->tick==sim->simulation_time){
+		if(thread_stats!=NULL)hist_record(&thread_stats->phase[PHASE_CONTROL], control);
+		sim->finished = 1;
+		return;
+	}
+	lap = phase_start();
+	sim->tick++;
+	if(sim_logging(sim)&&time(NULL)!=raw_time){
+		//Keep log timestamps current without a syscall per line
+		time(&raw_time);
+		time_data = localtime(&raw_time);
+	}
+	for(int s = 0; s<topology->section_count; s++){
+		update_tunnel_tick(sim, &sim->sections[s], -1);
+		publish_control(&sim->sections[s], 0);
+	}
+	if(thread_stats!=NULL)hist_record(&thread_stats->phase[PHASE_CONTROL], control+now_ns()-lap);
+	//Every other worker is parked at the barrier, so the hook sees a stable state
+	if(sim->advanced!=NULL)sim->advanced(sim, sim->tick);
+}
+
+/*
+ * With timing on, a worker's tick is split into its segment step and its
+ * wait at the barrier. The worker that runs the controller phase times its
+ * parts from inside control_phase and records no barrier wait.
+ */
+void *pool_worker(void *arg){
+	struct Worker *w = arg;
+	struct Simulation *sim = w->sim;
+	thread_stats = sim->timing?&sim->stats[w->id]:NULL;
+	while(!sim->finished){
+		uint64_t start = phase_start();
+		worker_run_tick(w);
+		uint64_t stepped = phase_lap(PHASE_STEP, start);
+		int serial = phase_barrier_wait(&sim->barrier, &w->sense, control_phase, sim);
+		if(!serial)phase_lap(PHASE_BARRIER, stepped);
+	}
+	thread_stats = NULL;
+	return NULL;
+}
+
+//Pool size for a run, its worker limit or one per core, never more than there are tasks
+int pool_size(struct Simulation *sim){
+	int count = sim->worker_limit;
+	if(count<=0)count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(count>sim->task_count)count = sim->task_count;
+	return count<1?1:count;
+}
+
+/*
+ * Lockstep engine on a fixed worker pool. Segments are split into blocks of
+ * TASK_SEGMENTS that every worker takes from its own deque, stealing from
+ * the others once it runs dry, and all workers meet at one phase barrier per
+ * tick. The calling thread is worker 0, so a single worker runs inline.
+ */
+void run_tick_engine(struct Simulation *sim){
+	sim->worker_count = pool_size(sim);
+	sim->workers = alloc_lines(sim->worker_count*sizeof(struct Worker));
+	sim->threads = calloc(sim->worker_count, sizeof(pthread_t));
+	if(sim->timing)stats_init(sim, sim->worker_count);
+	phase_barrier_init(&sim->barrier, sim->worker_count);
+	for(int i = 0; i<sim->worker_count; i++){
+		struct Worker *w = &sim->workers[i];
+		w->sim = sim;
+		w->id = i;
+		//Contiguous blocks, each worker starts on its own stretch of slots
+		w->first_task = (int)((long)sim->task_count*i/sim->worker_count);
+		w->last_task = (int)((long)sim->task_count*(i+1)/sim->worker_count);
+		deque_init(&w->deque, sim->task_count);
+	}
+	for(int i = 1; i<sim->worker_count; i++){
+		pthread_create(&sim->threads[i], NULL, pool_worker, &sim->workers[i]);
+	}
+	pool_worker(&sim->workers[0]);
+	for(int i = 1; i<sim->worker_count; i++){
+		pthread_join(sim->threads[i], NULL);
+	}
+	for(int i = 0; i<sim->worker_count; i++)free((void *)sim->workers[i].deque.tasks);
+	phase_barrier_destroy(&sim->barrier);
+	free(sim->workers);
+	free(sim->threads);
+	sim->workers = NULL;
+	sim->threads = NULL;
+}
+
+/*
+ * Buffers a region's record for the committer. Records are appended in
+ * tick order and published with appended, so the committer may read any
+ * record below it.
+ */
+void region_log_append(struct Region *r, struct LogRecord *record){
+	uint64_t appended = atomic_load_explicit(&r->appended, memory_order_relaxed);
+	int slot = (int)(appended%REGION_CHUNK_RECORDS);
+	if(slot==0&&appended>0){
+		struct RegionChunk *chunk = malloc(sizeof(struct RegionChunk));
+		chunk->next = NULL;
+		atomic_store_explicit(&r->tail->next, chunk, memory_order_release);
+		r->tail = chunk;
+	}
+	r->tail->records[slot] = *record;
+	atomic_store_explicit(&r->appended, appended+1, memory_order_release);
+}
+
+/*
+ * Order of the tick engine's logs: by tick, then releases, arrivals and
+ * control records, each in segment or section order. A section's control
+ * records all come from one region and keep its order.
+ */
+int compare_region_records(const void *a, const void *b){
+	const struct RegionRecord *x = a;
+	const struct RegionRecord *y = b;
+	if(x->record.tick!=y->record.tick)return x->record.tick<y->record.tick?-1:1;
+	int x_class = x->record.type==LOG_RELEASE?0:x->record.type==LOG_ARRIVAL?1:2;
+	int y_class = y->record.type==LOG_RELEASE?0:y->record.type==LOG_ARRIVAL?1:2;
+	if(x_class!=y_class)return x_class-y_class;
+	int x_index = x_class==2?x->record.destination:x->record.segment;
+	int y_index = y_class==2?y->record.destination:y->record.segment;
+	if(x_index!=y_index)return x_index-y_index;
+	return x->seq<y->seq?-1:x->seq>y->seq;
+}
+
+/*
+ * Writes every buffered record below tick gvt to the run's logs and frees
+ * the chunks that are used up. Called with the commit mutex held.
+ */
+void region_commit(struct RegionEngine *e, int gvt){
+	struct Simulation *sim = e->sim;
+	if(gvt<=atomic_load(&e->committed))return;
+	size_t count = 0;
+	for(int i = 0; i<e->region_count; i++){
+		struct Region *r = &e->regions[i];
+		uint64_t appended = atomic_load_explicit(&r->appended, memory_order_acquire);
+		while(r->consumed<appended){
+			//The record exists, so the region has linked the chunk holding it
+			if(r->consumed-r->head_first==REGION_CHUNK_RECORDS){
+				struct RegionChunk *used = r->head;
+				r->head = atomic_load_explicit(&used->next, memory_order_acquire);
+				r->head_first += REGION_CHUNK_RECORDS;
+				free(used);
+			}
+			struct LogRecord *record = &r->head->records[r->consumed-r->head_first];
+			if((int)record->tick>=gvt)break;
+			if(count==e->pending_capacity){
+				e->pending_capacity = e->pending_capacity>0?2*e->pending_capacity:REGION_CHUNK_RECORDS;
+				e->pending = realloc(e->pending, e->pending_capacity*sizeof(struct RegionRecord));
+			}
+			e->pending[count].record = *record;
+			e->pending[count++].seq = r->consumed++;
+		}
+	}
+	qsort(e->pending, count, sizeof(struct RegionRecord), compare_region_records);
+	//Stamped per engine, region engines of other simulations commit at the same time
+	if(time(NULL)!=e->stamp_time){
+		time(&e->stamp_time);
+		localtime_r(&e->stamp_time, &e->stamp);
+	}
+	for(size_t k = 0; k<count; k++){
+		struct LogRecord *r = &e->pending[k].record;
+		if(sim->event_log!=NULL){
+			r->seconds = (uint16_t)(e->stamp_time-sim->log_header.start_time);
+			event_log_append(sim->event_log, 0, r);
+		}else{
+			write_log_record(sim->train_log, sim->control_log, topology, &sim->log_header, r, &e->stamp);
+		}
+	}
+	atomic_store(&e->committed, gvt);
+}
+
+//Global virtual time, every region has finished the ticks below it
+int region_gvt(struct RegionEngine *e){
+	int gvt = INT_MAX;
+	for(int i = 0; i<e->region_count; i++){
+		int done = atomic_load_explicit(&e->regions[i].done, memory_order_acquire);
+		if(done<gvt)gvt = done;
+	}
+	return gvt;
+}
+
+/*
+ * The run as one region sees it. Per-segment and per-section state is
+ * shared, a region only touches its own. Totals, the lookahead scratch and
+ * the per-destination delays, which regions may share, start empty and are
+ * merged into the run at the end.
+ */
+struct Simulation *region_view(struct Simulation *sim, struct Region *r){
+	struct Simulation *view = malloc(sizeof(struct Simulation));
+	*view = *sim;
+	view->region = r;
+	view->released_trains = 0;
+	view->max_queue_length = 0;
+	view->blocked_ticks = 0;
+	view->busy_ticks = 0;
+	memset(&view->train_stats.wait, 0, sizeof(struct DelayHistogram));
+	memset(&view->train_stats.tunnel, 0, sizeof(struct DelayHistogram));
+	view->train_stats.wait_by_destination = calloc(topology->place_count, sizeof(struct DelayHistogram));
+	view->train_stats.tunnel_by_destination = calloc(topology->place_count, sizeof(struct DelayHistogram));
+	view->scratch = malloc(queue_count*sizeof(int));
+	if(sim->history!=NULL)view->history = history_create();
+	return view;
+}
+
+void region_merge(struct Simulation *sim, struct Simulation *view){
+	sim->released_trains += view->released_trains;
+	if(view->max_queue_length>sim->max_queue_length)sim->max_queue_length = view->max_queue_length;
+	sim->blocked_ticks += view->blocked_ticks;
+	sim->busy_ticks += view->busy_ticks;
+	delay_merge(&sim->train_stats.wait, &view->train_stats.wait);
+	delay_merge(&sim->train_stats.tunnel, &view->train_stats.tunnel);
+	for(int i = 0; i<topology->place_count; i++){
+		delay_merge(&sim->train_stats.wait_by_destination[i], &view->train_stats.wait_by_destination[i]);
+		delay_merge(&sim->train_stats.tunnel_by_destination[i], &view->train_stats.tunnel_by_destination[i]);
+	}
+	free(view->train_stats.wait_by_destination);
+	free(view->train_stats.tunnel_by_destination);
+	if(view->history!=NULL){
+		history_append_all(sim->history, view->history);
+		history_free(view->history);
+	}
+	free(view->scratch);
+	free(view);
+}
+
+//One tick of a region, the tick engine's step and control phase for its sections only
+void region_tick(struct Region *r){
+	struct Simulation *sim = r->view;
+	uint64_t lap = phase_start();
+	for(int k = 0; k<r->segment_count; k++)segment_step(sim, r->segments[k], segment_rate(sim, r->segments[k]));
+	lap = phase_lap(PHASE_STEP, lap);
+	for(int k = 0; k<r->segment_count; k++)collect_segment(sim, r->segments[k]);
+	for(int k = 0; k<r->segment_count; k++){
+		int i = r->segments[k];
+		if(sim->slots[i].has_arrived)log_train_arrival(sim, &sim->slots[i].arrived);
+		if(sim->queue_status[i]>sim->max_queue_length)sim->max_queue_length = sim->queue_status[i];
+	}
+	lap = phase_lap(PHASE_COLLECT, lap);
+	for(int k = 0; k<r->section_count; k++)control_section(sim, r->sections[k]);
+	phase_lap(PHASE_DECIDE, lap);
+}
+
+/*
+ * Runs a region to the end of the run. A logging region commits what GVT
+ * allows after each tick and, once it is REGION_WINDOW ticks ahead, waits
+ * for the slowest region, which counts as barrier time.
+ */
+void *region_worker(void *arg){
+	struct Region *r = arg;
+	struct RegionEngine *e = r->engine;
+	struct Simulation *sim = r->view;
+	int logging = sim_logging(e->sim);
+	thread_stats = sim->timing?&e->sim->stats[r->id]:NULL;
+	for(;;){
+		region_tick(r);
+		atomic_store_explicit(&r->done, sim->tick+1, memory_order_release);
+		if(sim->tick>=sim->simulation_time)break;
+		sim->tick++;
+		for(int k = 0; k<r->section_count; k++){
+			struct Section *section = &sim->sections[r->sections[k]];
+			update_tunnel_tick(sim, section, -1);
+			publish_control(section, 0);
+		}
+		if(!logging)continue;
+		uint64_t lap = phase_start();
+		for(;;){
+			int gvt = region_gvt(e);
+			if(gvt>atomic_load_explicit(&e->committed, memory_order_relaxed)&&pthread_mutex_trylock(&e->commit_mutex)==0){
+				region_commit(e, gvt);
+				pthread_mutex_unlock(&e->commit_mutex);
+			}
+			if(sim->tick-gvt<REGION_WINDOW)break;
+			sched_yield();
+		}
+		phase_lap(PHASE_BARRIER, lap);
+	}
+	thread_stats = NULL;
+	return NULL;
+}
+
+/*
+ * Deals whole sections out to the regions, largest first to the region
+ * with the fewest segments so far. Segments keep their section's order.
+ */
+void region_partition(struct RegionEngine *e){
+	int sections = topology->section_count;
+	int *order = malloc(sections*sizeof(int));
+	int *owner = malloc(sections*sizeof(int));
+	for(int s = 0; s<sections; s++)order[s] = s;
+	for(int a = 1; a<sections; a++){
+		int s = order[a], size = topology->section_offset[s+1]-topology->section_offset[s];
+		int b = a;
+		for(; b>0&&topology->section_offset[order[b-1]+1]-topology->section_offset[order[b-1]]<size; b--)order[b] = order[b-1];
+		order[b] = s;
+	}
+	for(int a = 0; a<sections; a++){
+		int s = order[a];
+		struct Region *least = &e->regions[0];
+		for(int i = 1; i<e->region_count; i++){
+			if(e->regions[i].segment_count<least->segment_count)least = &e->regions[i];
+		}
+		owner[s] = least->id;
+		least->section_count++;
+		least->segment_count += topology->section_offset[s+1]-topology->section_offset[s];
+	}
+	for(int i = 0; i<e->region_count; i++){
+		struct Region *r = &e->regions[i];
+		r->sections = malloc(r->section_count*sizeof(int));
+		r->segments = malloc(r->segment_count*sizeof(int));
+		r->section_count = 0;
+		r->segment_count = 0;
+	}
+	for(int s = 0; s<sections; s++){
+		struct Region *r = &e->regions[owner[s]];
+		r->sections[r->section_count++] = s;
+		for(int k = topology->section_offset[s]; k<topology->section_offset[s+1]; k++)r->segments[r->segment_count++] = topology->section_segments[k];
+	}
+	free(order);
+	free(owner);
+}
+
+/*
+ * Sections share no trains, so a region of whole sections needs nothing
+ * from the others and the run has no global barrier. Each region runs on
+ * its own thread, as many as the worker limit or cores allow but never
+ * more than there are sections, and the calling thread runs the first.
+ * Logs come out as the tick engine writes them. The per-tick front end
+ * hooks and the time series need every region on the same tick, so this
+ * engine does not call or write them.
+ */
+void run_region_engine(struct Simulation *sim){
+	struct RegionEngine *e = calloc(1, sizeof(struct RegionEngine));
+	e->sim = sim;
+	e->region_count = sim->worker_limit>0?sim->worker_limit:(int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(e->region_count>topology->section_count)e->region_count = topology->section_count;
+	if(e->region_count<1)e->region_count = 1;
+	e->regions = alloc_lines(e->region_count*sizeof(struct Region));
+	memset(e->regions, 0, e->region_count*sizeof(struct Region));
+	e->threads = calloc(e->region_count, sizeof(pthread_t));
+	atomic_init(&e->committed, sim->tick);
+	pthread_mutex_init(&e->commit_mutex, NULL);
+	if(sim->timing)stats_init(sim, e->region_count);
+	for(int i = 0; i<e->region_count; i++){
+		e->regions[i].id = i;
+		e->regions[i].engine = e;
+	}
+	region_partition(e);
+	for(int i = 0; i<e->region_count; i++){
+		struct Region *r = &e->regions[i];
+		atomic_init(&r->done, sim->tick);
+		r->head = r->tail = calloc(1, sizeof(struct RegionChunk));
+		r->view = region_view(sim, r);
+	}
+	for(int i = 1; i<e->region_count; i++)pthread_create(&e->threads[i], NULL, region_worker, &e->regions[i]);
+	region_worker(&e->regions[0]);
+	for(int i = 1; i<e->region_count; i++)pthread_join(e->threads[i], NULL);
+	if(sim_logging(sim))region_commit(e, sim->simulation_time+1);
+	for(int i = 0; i<e->region_count; i++){
+		struct Region *r = &e->regions[i];
+		region_merge(sim, r->view);
+		while(r->head!=NULL){
+			struct RegionChunk *next = r->head->next;
+			free(r->head);
+			r->head = next;
+		}
+		free(r->sections);
+		free(r->segments);
+	}
+	sim->tick = sim->simulation_time;
+	sim->finished = 1;
+	pthread_mutex_destroy(&e->commit_mutex);
+	free(e->pending);
+	free(e->threads);
+	free(e->regions);
+	free(e);
+}
+
+void run_simulation(struct Simulation *sim){
+	if(sim->engine==ENGINE_DES){
+		run_event_engine(sim);
+	}else if(sim->engine==ENGINE_REGIONS){
+		run_region_engine(sim);
+	}else{
+		run_tick_engine(sim);
+	}
+}
+
+/*
+ * libmetrosim API, see metrosim.h. A struct metrosim is a Simulation run
+ * headless and unlogged. Stepping the tick or region engine steps every
+ * segment on the calling thread, metrosim_run hands the rest of the run to
+ * the worker pool or the regions.
+ */
+struct metrosim{
+	struct Simulation *sim;
+};
+
+void metrosim_config_init(struct metrosim_config *config){
+	memset(config, 0, sizeof(*config));
+	config->probability = 0.5;
+	config->ticks = 10;
+	config->breakdown = BROKEN_PROBABILITY;
+	config->engine = METROSIM_ENGINE_TICK;
+}
+
+int metrosim_load_topology(const char *path){
+	struct Topology *t = (path!=NULL)?topology_load(path):topology_builtin();
+	if(t==NULL)return TOPOLOGY_ERR;
+	topology_free(topology);
+	topology = t;
+	queue_count = t->segment_count;
+	return 0;
+}
+
+struct metrosim *metrosim_create(const struct metrosim_config *config){
+	if(config->probability<0||config->probability>1||config->breakdown<0||config->breakdown>1||config->ticks<0)return NULL;
+	if(config->engine!=METROSIM_ENGINE_TICK&&config->engine!=METROSIM_ENGINE_DES&&config->engine!=METROSIM_ENGINE_REGIONS)return NULL;
+	//Loading the network here would race with other threads creating simulations
+	if(topology==NULL)return NULL;
+	struct SimParams params = {config->probability, config->ticks, config->seed, config->breakdown, {"longest/hysteresis", &release_policies[0], &admission_policies[0], DEFAULT_LOOKAHEAD, 0, 0, 0}, config->engine, config->workers};
+	if(config->release!=NULL&&parse_release(config->release, &params.policy)!=0)return NULL;
+	if(config->admission!=NULL&&parse_admission(config->admission, &params.policy)!=0)return NULL;
+	struct metrosim *m = calloc(1, sizeof(struct metrosim));
+	m->sim = sim_create(&params);
+	return m;
+}
+
+void metrosim_set_console(struct metrosim *m, metrosim_console_fn console, void *user){
+	m->sim->console = console;
+	m->sim->console_user = user;
+}
+
+int metrosim_step(struct metrosim *m){
+	struct Simulation *sim = m->sim;
+	if(sim->finished)return 0;
+	if(sim->engine==ENGINE_DES){
+		event_engine_start(sim);
+		event_engine_step(sim);
+		if(sim->event_count==0||sim->event_heap[0].tick>sim->simulation_time)event_engine_finish(sim);
+	}else{
+		for(int task = 0; task<sim->task_count; task++)run_segment_task(sim, task);
+		control_phase(sim);
+	}
+	return !sim->finished;
+}
+
+void metrosim_run(struct metrosim *m){
+	if(!m->sim->finished)run_simulation(m->sim);
+}
+
+void metrosim_stats(struct metrosim *m, struct metrosim_stats *stats){
+	struct Simulation *sim = m->sim;
+	int ticks = sim->tick;
+	if(sim->finished){
+		ticks = sim->simulation_time+1;
+	}else if(sim->engine==ENGINE_DES){
+		//Every tick before the next event has been simulated
+		ticks = 0;
+		if(sim->started)ticks = sim->event_count>0?sim->event_heap[0].tick:sim->simulation_time+1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	stats->tick = ticks;
+	stats->finished = sim->finished;
+	stats->arrived_trains = count_arrivals(sim);
+	stats->released_trains = sim->released_trains;
+	stats->waiting_trains = count_trains(sim);
+	stats->max_queue_length = sim->max_queue_length;
+	stats->blocked_ticks = sim->blocked_ticks;
+	if(ticks>0){
+		stats->throughput = (double)sim->released_trains/ticks;
+		stats->utilisation = (double)sim->busy_ticks/((double)topology->section_count*ticks);
+	}
+	stats->wait_p50 = delay_quantile(&sim->train_stats.wait, 0.5);
+	stats->wait_p95 = delay_quantile(&sim->train_stats.wait, 0.95);
+	stats->wait_p99 = delay_quantile(&sim->train_stats.wait, 0.99);
+	stats->tunnel_p50 = delay_quantile(&sim->train_stats.tunnel, 0.5);
+	stats->tunnel_p95 = delay_quantile(&sim->train_stats.tunnel, 0.95);
+	stats->tunnel_p99 = delay_quantile(&sim->train_stats.tunnel, 0.99);
+}
+
+void metrosim_destroy(struct metrosim *m){
+	sim_destroy(m->sim);
+	free(m);
+}
@@ -0,0 +1,97 @@
+/*
+ * libmetrosim, the MetroSim simulation core as a C library.
+ *
+ * A simulation is created from a config, advanced a tick at a time with
+ * metrosim_step or to its end with metrosim_run, and queried with
+ * metrosim_stats. The network is process-wide: load it before creating
+ * simulations, every simulation of the process runs on it, and do not load
+ * it again while any thread uses the library. Once it is loaded,
+ * metrosim_create, metrosim_destroy and the calls on separate simulations
+ * can run on separate threads. Calls on one simulation must not overlap.
+ */
+#ifndef METROSIM_H
+#define METROSIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METROSIM_ENGINE_TICK 0
+#define METROSIM_ENGINE_DES 1
+#define METROSIM_ENGINE_REGIONS 2
+
+//Console line colors
+#define METROSIM_WHITE 0
+#define METROSIM_GREEN 1
+#define METROSIM_RED 2
+#define METROSIM_YELLOW 3
+
+struct metrosim;
+
+struct metrosim_config{
+	//Arrival probability, segments with a 1-p rate take its complement
+	double probability;
+	//Last tick simulated, a run covers ticks 0 to ticks
+	int ticks;
+	uint64_t seed;
+	//Probability of a broken train
+	double breakdown;
+	//Policies as given to --release and --admission, NULL for the defaults
+	const char *release;
+	const char *admission;
+	//METROSIM_ENGINE_TICK, METROSIM_ENGINE_DES or METROSIM_ENGINE_REGIONS
+	int engine;
+	//Worker threads of the tick engine or regions of the region engine, 0 for one per core
+	int workers;
+};
+
+struct metrosim_stats{
+	//Ticks simulated so far
+	int tick;
+	int finished;
+	int arrived_trains;
+	int released_trains;
+	int waiting_trains;
+	int max_queue_length;
+	int blocked_ticks;
+	//Released trains per tick simulated
+	double throughput;
+	//Share of ticks the tunnels were busy
+	double utilisation;
+	//Queueing and tunnel delay quantiles in ticks
+	int wait_p50, wait_p95, wait_p99;
+	int tunnel_p50, tunnel_p95, tunnel_p99;
+};
+
+//Receives every console line of a simulation, called from its worker threads
+typedef void (*metrosim_console_fn)(int color, const char *line, void *user);
+
+//Defaults of the metro command line
+void metrosim_config_init(struct metrosim_config *config);
+
+//Loads the network from a topology file, NULL for the built-in map. 0 on success.
+//Not thread-safe, no simulation may exist or be created meanwhile.
+int metrosim_load_topology(const char *path);
+
+//NULL for an invalid config or when no network is loaded
+struct metrosim *metrosim_create(const struct metrosim_config *config);
+
+void metrosim_set_console(struct metrosim *m, metrosim_console_fn console, void *user);
+
+//Simulates one tick, the event engine skips to its next busy tick. 1 while ticks remain.
+int metrosim_step(struct metrosim *m);
+
+//Simulates the remaining ticks
+void metrosim_run(struct metrosim *m);
+
+void metrosim_stats(struct metrosim *m, struct metrosim_stats *stats);
+
+void metrosim_destroy(struct metrosim *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
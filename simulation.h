@@ -0,0 +1,888 @@
+/*
+ * Internals of the simulation core, shared by libmetrosim and the metro
+ * front end. Embedders use the API in metrosim.h instead.
+ */
+#ifndef METRO_SIMULATION_H
+#define METRO_SIMULATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrosim.h"
+
+//Error definitions
+#define LOG_OPEN_ERR -41
+#define LOG_FORMAT_ERR -42
+#define TOPOLOGY_ERR -51
+#define POLICY_ERR -61
+#define CHECKPOINT_ERR -71
+#define WHAT_IF_ERR -81
+#define TRACE_ERR -91
+
+//Color definitions
+#define WHITE_BLACK 0
+#define GREEN_BLACK 1
+#define RED_BLACK 2
+#define YELLOW_BLACK 3
+
+//Simulation definitions
+#define DRAWS_PER_TICK 4
+#define QUEUE_INITIAL_CAPACITY 16
+#define CACHE_LINE 64
+#define TASK_SEGMENTS 32
+#define BARRIER_SPINS 4096
+
+//Timing definitions, histogram buckets keep HIST_SUB_BITS significant bits
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS ((64-HIST_SUB_BITS+2)*(HIST_SUB/2))
+#define DELAY_SUB_BITS 4
+#define DELAY_SUB (1<<DELAY_SUB_BITS)
+#define DELAY_BUCKETS ((32-DELAY_SUB_BITS+2)*(DELAY_SUB/2))
+#define PHASE_STEP 0
+#define PHASE_BARRIER 1
+#define PHASE_CONTROL 2
+#define PHASE_COLLECT 3
+#define PHASE_DECIDE 4
+#define PHASE_SNAPSHOT 5
+#define PHASE_DRAW 6
+#define PHASE_CONSOLE 7
+#define PHASE_COUNT 8
+#define LENGTH_PROBABILITY 0.3
+#define BROKEN_PROBABILITY 0.1
+
+//Topology definitions
+#define NAME_LENGTH 16
+#define MAX_PLACES 65535
+#define DEFAULT_BLOCK_THRESHOLD 10
+#define RATE_FIXED 0
+#define RATE_P 1
+#define RATE_ONE_MINUS_P 2
+
+//Control word layout, published by the controller once per tick
+#define CONTROL_RELEASE_MASK 0xffff
+#define CONTROL_ALLOW (1<<16)
+#define CONTROL_FINISHED (1<<17)
+
+//Policy definitions
+#define ADMIT_KEEP 0
+#define ADMIT_BLOCK 1
+#define ADMIT_ALLOW 2
+#define DEFAULT_LOOKAHEAD 8
+#define POLICY_NAME_LENGTH 64
+#define POLICY_LIST_MAX 32
+#define RELEASE_POLICIES 4
+#define ADMISSION_POLICIES 2
+
+//Trace definitions
+#define TRACE_MAGIC "MSIMTRC1"
+#define TRACE_VERSION 1
+
+//Event log definitions
+#define LOG_MAGIC "MSIMLOG1"
+#define LOG_VERSION 2
+#define LOG_RING_CAPACITY 65536
+#define LOG_WRITE_BUFFER (1<<20)
+
+//Time series definitions
+#define SERIES_MAGIC "MSIMSER1"
+#define SERIES_VERSION 1
+#define SERIES_BLOCK_BYTES (4<<20)
+#define SERIES_BLOCK_ROWS_MAX 65536
+#define SERIES_NAME_LENGTH 32
+#define SERIES_INT32 1
+#define SERIES_UINT16 2
+#define SERIES_UINT8 3
+#define SERIES_UINT32 4
+#define LOG_ARRIVAL 0
+#define LOG_RELEASE 1
+#define LOG_START 2
+#define LOG_BLOCK 3
+#define LOG_ALLOW 4
+#define LOG_SIGNAL 5
+#define LOG_BUSY 6
+#define LOG_END 7
+#define CONSOLE_LINE_MAX 256
+#define ENGINE_TICK 0
+#define ENGINE_DES 1
+#define ENGINE_REGIONS 2
+#define ENGINES 3
+#define REGION_CHUNK_RECORDS 4096
+#define REGION_WINDOW 1024
+
+//Train history definitions
+#define HISTORY_MAGIC "MSIMHIS1"
+#define HISTORY_VERSION 1
+#define HISTORY_CHUNK_RECORDS 65536
+#define HISTORY_QUEUED UINT32_MAX
+
+//Event definitions, lower types run first within a tick
+#define EV_TUNNEL_CLEAR 0
+#define EV_RELEASE 1
+#define EV_ARRIVAL 2
+
+//Train struct, a length is at most 127 so it shares a byte with the broken flag
+struct Train{
+	uint32_t id;
+	int arrival_time;
+	int departure_time;
+	unsigned short origin;
+	unsigned short destination;
+	unsigned char length:7;
+	unsigned char broken:1;
+};
+
+/*
+ * Train history file, --history. The header is followed by the place name
+ * table and record_count records: the released trains in release order,
+ * then the trains still queued at the end with departure HISTORY_QUEUED.
+ * The region engine appends each region's released trains in turn, so
+ * release order only holds within a region there.
+ */
+struct HistoryHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t record_count;
+	uint64_t seed;
+	uint32_t segment_count;
+	uint32_t place_count;
+};
+
+//Packed history record of one train, its origin is (id-1)%segment_count
+struct TrainRecord{
+	uint32_t id;
+	uint32_t arrival_time;
+	uint32_t departure_time;
+	uint16_t destination;
+	uint8_t length:7;
+	uint8_t broken:1;
+	uint8_t reserved;
+};
+
+struct HistoryChunk{
+	struct HistoryChunk *next;
+	int count;
+	struct TrainRecord records[HISTORY_CHUNK_RECORDS];
+};
+
+/*
+ * Arena of train records, a list of fixed size chunks written by one thread
+ * at a time. Resetting it keeps the chunks, so a reused simulation records
+ * its trains without allocating.
+ */
+struct TrainHistory{
+	struct HistoryChunk *first;
+	struct HistoryChunk *current;
+	uint64_t count;
+};
+
+//Event struct for the event calendar, tunnel clears carry a section ID
+struct Event{
+	int tick;
+	int type;
+	int segment_id;
+};
+
+//Growable ring buffer of trains, capacity is a power of two
+struct TrainQueue{
+	struct Train *data;
+	int head;
+	int count;
+	int capacity;
+};
+
+//xoshiro256** generator state, one stream per segment. mirror flips the 53 bits of every uniform.
+struct Rng{
+	uint64_t s[4];
+	uint64_t mirror;
+};
+
+/*
+ * Binary arrival trace. The header is followed by segment_count+1 record
+ * offsets and the records, grouped by origin and in tick order within each
+ * origin, so every segment replays its own contiguous slice. Places are
+ * indices into the topology the trace was converted for.
+ */
+struct TraceHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t record_count;
+	uint64_t topology_hash;
+	uint32_t segment_count;
+	uint32_t reserved;
+};
+
+struct TraceRecord{
+	uint32_t tick;
+	uint16_t origin;
+	uint16_t destination;
+	uint8_t length;
+	uint8_t broken;
+	uint16_t reserved;
+};
+
+//A loaded trace, either a mapped file or a CSV converted in memory
+struct Trace{
+	void *data;
+	size_t size;
+	int mapped;
+	const uint64_t *offsets;
+	const struct TraceRecord *records;
+};
+
+//Binary event log file header
+struct LogHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	int64_t start_time;
+	uint64_t seed;
+	int32_t simulation_time;
+	float probability;
+	int32_t engine;
+	uint32_t place_count;
+	uint32_t section_count;
+	uint32_t reserved;
+};
+
+/*
+ * Fixed size binary event record. Segment and destination are place
+ * indices, control records keep their section index in destination and
+ * block/allow records the train count in train_id.
+ */
+struct LogRecord{
+	uint32_t tick;
+	uint32_t train_id;
+	uint16_t seconds;
+	uint16_t segment;
+	uint16_t destination;
+	uint8_t type;
+	uint8_t length:7;
+	uint8_t broken:1;
+};
+
+//Single producer ring drained by the writer thread
+struct LogRing{
+	struct LogRecord *records;
+	_Atomic uint64_t head;
+	char pad[56];
+	_Atomic uint64_t tail;
+};
+
+struct EventLog{
+	FILE *file;
+	int producers;
+	struct LogRing *rings;
+	pthread_t writer;
+	atomic_int stop;
+};
+
+/*
+ * Columnar time series file. The header and column table are followed by
+ * blocks of block_rows rows each, the last one possibly partly filled, and
+ * the block index, which starts at index_offset. Within a block column c
+ * starts block_rows*column.offset bytes in, as block_rows*width bytes. All
+ * rows are a multiple of 8 and blocks start 8 byte aligned, so every
+ * column of a mapped file is aligned. Columns are tick, the queue length of
+ * each segment (saturating at 65535), then for every section the train in
+ * its tunnel (0 for none), then its remaining tunnel ticks, can_release
+ * and allow_trains.
+ */
+struct SeriesHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t segment_count;
+	uint32_t section_count;
+	uint32_t column_count;
+	uint32_t block_rows;
+	uint64_t row_bytes;
+	uint64_t index_offset;
+	uint64_t block_count;
+	uint64_t row_count;
+};
+
+struct SeriesColumn{
+	char name[SERIES_NAME_LENGTH];
+	uint32_t type;
+	uint32_t width;
+	uint64_t offset;
+};
+
+struct SeriesBlock{
+	uint64_t offset;
+	int32_t first_tick;
+	int32_t last_tick;
+	uint32_t rows;
+	uint32_t reserved;
+};
+
+//One block is filled in memory and written whole
+struct SeriesWriter{
+	FILE *file;
+	struct SeriesHeader header;
+	struct SeriesColumn *columns;
+	char *block;
+	int rows;
+	struct SeriesBlock *index;
+	int index_capacity;
+	uint64_t offset;
+};
+
+/*
+ * Everything a segment thread writes, padded to whole cache lines so
+ * segments never share one. The segment fills in the train fields and then
+ * publishes queue_count with a release store, the controller reads it with
+ * an acquire load before touching the rest.
+ */
+struct SegmentSlot{
+	atomic_int queue_count;
+	int has_arrived;
+	int has_released;
+	int arrivals;
+	uint64_t trace_next;
+	struct Train leader;
+	struct Train arrived;
+	struct Train released;
+	struct Rng rng;
+	struct TrainQueue queue;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * Bottleneck section, a stretch of single track shared by its segments.
+ * Written by the controller only, segments read the published control word.
+ */
+struct Section{
+	atomic_uint control;
+	int releasing_segment_id;
+	int can_release;
+	int tunnel_ticks;
+	int allow_trains;
+	int blocked_since;
+	int dirty;
+	struct Train train_in_tunnel;
+	int released_trains;
+	int blocked_ticks;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * Network description, loaded once and shared read-only by every run.
+ * Places are the named stops: the first segment_count are entry segments
+ * with a queue, the rest are exits that only appear as destinations.
+ * Section membership and destination lists are offset arrays into flat
+ * index arrays, so walking a section or a distribution touches one block.
+ */
+struct Topology{
+	int segment_count;
+	int section_count;
+	int place_count;
+	int builtin;
+	char (*place_names)[NAME_LENGTH];
+	char (*section_names)[NAME_LENGTH];
+
+	//Per segment
+	int *rate_kind;
+	float *rate;
+	int *segment_section;
+	int *destination_offset;
+	int *destinations;
+	double *destination_cumulative;
+
+	//Per section
+	int *section_offset;
+	int *section_segments;
+	int *block_threshold;
+};
+
+//A name and its index, sorted to build name lookups
+struct NamedIndex{
+	const char *name;
+	int index;
+};
+
+/*
+ * Log-linear latency histogram in nanoseconds. Values below HIST_SUB get a
+ * bucket each, above that every power of two is split into HIST_SUB/2
+ * buckets, so quantiles are within about 3% of the recorded value.
+ */
+struct Histogram{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/*
+ * Compact histogram of train delays in ticks, same layout as Histogram with
+ * fewer sub-buckets. Exact below DELAY_SUB ticks and within about 6% above,
+ * so one fits in a kilobyte whatever the number of trains.
+ */
+struct DelayHistogram{
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[DELAY_BUCKETS];
+};
+
+/*
+ * Per-train statistics, written by the controller only. Wait is the time
+ * from arrival to release, tunnel the time from release to tunnel exit.
+ */
+struct TrainStats{
+	struct DelayHistogram wait;
+	struct DelayHistogram tunnel;
+	struct DelayHistogram *wait_by_origin;
+	struct DelayHistogram *tunnel_by_origin;
+	struct DelayHistogram *wait_by_destination;
+	struct DelayHistogram *tunnel_by_destination;
+};
+
+//Phase timings of one worker, only ever written by that worker
+struct WorkerStats{
+	struct Histogram phase[PHASE_COUNT];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct Simulation;
+
+//Picks the segment a section releases from next, -1 for none
+struct ReleasePolicy{
+	const char *name;
+	int (*choose)(struct Simulation *sim, int section_id);
+};
+
+/*
+ * Admission is decided per section from its train count and per segment
+ * from the segment's own queue. update returns ADMIT_BLOCK, ADMIT_ALLOW or
+ * ADMIT_KEEP for the section's allow flag.
+ */
+struct AdmissionPolicy{
+	const char *name;
+	int (*update)(struct Simulation *sim, int section_id, int num_trains);
+	int (*accept)(struct Simulation *sim, int segment_id, int queue_count);
+};
+
+//A release and admission policy with their parameters
+struct Policy{
+	char name[POLICY_NAME_LENGTH];
+	const struct ReleasePolicy *release;
+	const struct AdmissionPolicy *admission;
+	int lookahead;
+	int high;
+	int low;
+	int cap;
+};
+
+//Parameters of a run, the front end takes them from its command line
+struct SimParams{
+	float probability;
+	int simulation_time;
+	uint64_t seed;
+	float breakdown;
+	struct Policy policy;
+	int engine;
+	//Worker threads or regions, 0 for one per core
+	int worker_limit;
+};
+
+/*
+ * Chase-Lev work-stealing deque of segment tasks. The owner pushes and pops
+ * at the bottom, idle workers steal from the top. Indices only grow, the
+ * capacity covers every task of a tick so it never has to resize.
+ */
+struct TaskDeque{
+	atomic_long top;
+	char pad[CACHE_LINE-sizeof(atomic_long)];
+	atomic_long bottom;
+	_Atomic int *tasks;
+	long mask;
+};
+
+//Pool worker, worker 0 is the thread that runs the engine
+struct Worker{
+	struct Simulation *sim;
+	int id;
+	int sense;
+	int first_task;
+	int last_task;
+	struct TaskDeque deque;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * Sense reversing barrier, the last thread to arrive runs the serial phase
+ * before releasing the others. Waiters spin briefly and then sleep, so a
+ * paced interactive run does not burn a core per worker.
+ */
+struct PhaseBarrier{
+	atomic_int remaining;
+	atomic_int sense;
+	int parties;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/*
+ * Log records of a region in tick order, a list of chunks the region
+ * appends to and the committer frees once it has written them.
+ */
+struct RegionChunk{
+	struct RegionChunk *_Atomic next;
+	struct LogRecord records[REGION_CHUNK_RECORDS];
+};
+
+//A log record being committed, seq keeps a region's order within a tick
+struct RegionRecord{
+	struct LogRecord record;
+	uint64_t seq;
+};
+
+struct RegionEngine;
+
+/*
+ * A group of whole sections with their segments, advanced by its own thread
+ * without waiting for the others. view is the run as the region sees it:
+ * it shares the slots, sections and per-segment state of the run and keeps
+ * its own tick, totals and per-destination delays. done is the number of
+ * ticks the region has finished, written by the region only.
+ */
+struct Region{
+	atomic_int done;
+	_Atomic uint64_t appended;
+	struct RegionEngine *engine;
+	int id;
+	int *sections;
+	int section_count;
+	int *segments;
+	int segment_count;
+	struct RegionChunk *tail;
+	struct RegionChunk *head;
+	uint64_t head_first;
+	uint64_t consumed;
+	struct Simulation *view;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * Regions of a run. Records below GVT, the fewest ticks any region has
+ * finished, can no longer change, so they are merged into the logs in the
+ * tick engine's order and their chunks freed. Regions that log stay within
+ * REGION_WINDOW ticks of GVT to bound the records held.
+ */
+struct RegionEngine{
+	struct Simulation *sim;
+	struct Region *regions;
+	int region_count;
+	pthread_t *threads;
+	pthread_mutex_t commit_mutex;
+	atomic_int committed;
+	struct RegionRecord *pending;
+	size_t pending_capacity;
+	//Wall clock of the records being committed
+	time_t stamp_time;
+	struct tm stamp;
+};
+
+//Per-run simulation state, one per replication
+struct Simulation{
+	//Parameters
+	float probability;
+	float breakdown;
+	int simulation_time;
+	uint64_t seed;
+
+	//Segment owned state, one slot per segment
+	struct SegmentSlot *slots;
+
+	//Controller owned state, sections publish their decision to the segments
+	struct Section *sections;
+	int *queue_status;
+	struct Train *queue_leaders;
+	int tick;
+
+	//Summary vars
+	int released_trains;
+	int max_queue_length;
+	int blocked_ticks;
+	long long busy_ticks;
+	struct TrainStats train_stats;
+	//Released trains, NULL unless the history is kept
+	struct TrainHistory *history;
+
+	//Decision policies and scratch space for lookahead
+	struct Policy policy;
+	int *scratch;
+
+	//Next tick due for --checkpoint-every, set when the run is restored
+	int next_checkpoint;
+	//Arrivals are scheduled, restored runs come with their saved calendar
+	int started;
+
+	//Engine and --workers of the run, 0 workers for one per core
+	int engine;
+	int worker_limit;
+
+	//Worker pool, segments are stepped in blocks of TASK_SEGMENTS
+	struct Worker *workers;
+	int worker_count;
+	int task_count;
+	int finished;
+	pthread_t *threads;
+	struct PhaseBarrier barrier;
+
+	//Region of a region engine view, NULL for the run itself
+	struct Region *region;
+
+	//Per-worker phase timings, kept after the run when timing is set
+	int timing;
+	struct WorkerStats *stats;
+	int stats_count;
+	uint64_t stats_next_dump;
+
+	//Event calendar
+	struct Event *event_heap;
+	int event_count;
+	int event_capacity;
+	//Sections touched by the event engine's current tick
+	int *dirty;
+
+	//Logs, NULL disables logging
+	FILE *train_log;
+	FILE *control_log;
+	struct EventLog *event_log;
+	struct SeriesWriter *series;
+	struct LogHeader log_header;
+
+	//Front end hooks, NULL when unused. decided runs after each tick's
+	//decisions, advanced once the run has moved on to the next tick.
+	void (*decided)(struct Simulation *sim);
+	void (*advanced)(struct Simulation *sim, int tick);
+	metrosim_console_fn console;
+	void *console_user;
+};
+
+//Library state, shared by every simulation of the process
+extern int queue_count;
+extern time_t raw_time;
+extern struct tm *time_data;
+extern struct Topology *topology;
+extern struct Trace *arrival_trace;
+extern const struct ReleasePolicy release_policies[RELEASE_POLICIES];
+extern const struct AdmissionPolicy admission_policies[ADMISSION_POLICIES];
+extern const char *phase_names[PHASE_COUNT];
+extern const char *engine_names[ENGINES];
+extern __thread struct WorkerStats *thread_stats;
+extern const char *default_topology;
+
+static inline uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+//Log-linear bucket of v keeping bits significant bits
+static inline int log_bucket(uint64_t v, int bits){
+	if(v<(1ULL<<bits))return (int)v;
+	int shift = 63-__builtin_clzll(v)-bits+1;
+	return shift*(1<<(bits-1))+(int)(v>>shift);
+}
+
+static inline int hist_bucket(uint64_t v){
+	return log_bucket(v, HIST_SUB_BITS);
+}
+
+static inline void hist_record(struct Histogram *h, uint64_t v){
+	h->buckets[hist_bucket(v)]++;
+	h->count++;
+	h->sum+=v;
+	if(v>h->max)h->max = v;
+}
+
+//Start of a timed phase, free when timing is off
+static inline uint64_t phase_start(){
+	return thread_stats!=NULL?now_ns():0;
+}
+
+//Records the phase begun at start and returns the start of the next one
+static inline uint64_t phase_lap(int phase, uint64_t start){
+	if(thread_stats==NULL)return 0;
+	uint64_t now = now_ns();
+	hist_record(&thread_stats->phase[phase], now-start);
+	return now;
+}
+
+//Logs and time series
+void write_log_record(FILE *train, FILE *control, struct Topology *t, struct LogHeader *h, struct LogRecord *r, struct tm *tm);
+void *event_log_writer(void *arg);
+struct EventLog *event_log_open(const char *path, struct LogHeader *header, int producers);
+void event_log_append(struct EventLog *log, int producer, struct LogRecord *r);
+void event_log_close(struct EventLog *log);
+void series_column(struct SeriesWriter *w, int c, const char *prefix, const char *name, int type, int width, uint64_t *offset);
+struct SeriesWriter *series_open(const char *path);
+void series_flush(struct SeriesWriter *w);
+void series_record(struct Simulation *sim);
+int series_close(struct SeriesWriter *w);
+int sim_logging(struct Simulation *sim);
+void log_event(struct Simulation *sim, int type, int section_id, int segment_id, uint32_t train_id, struct Train *t);
+void log_train_arrival(struct Simulation *sim, struct Train *t);
+void log_train_release(struct Simulation *sim, struct Train *t);
+
+//Random streams and histograms
+uint64_t splitmix64(uint64_t *x);
+void rng_jump(struct Rng *rng);
+void rng_seed_streams(struct Rng *streams, int count, uint64_t seed);
+uint64_t log_bucket_value(int i, int bits);
+uint64_t hist_value(int i);
+void hist_merge(struct Histogram *dst, struct Histogram *src);
+uint64_t hist_quantile(struct Histogram *h, double q);
+void delay_merge(struct DelayHistogram *dst, struct DelayHistogram *src);
+int delay_quantile(struct DelayHistogram *h, double q);
+
+//Train queues
+void queue_init(struct TrainQueue *q);
+void queue_free(struct TrainQueue *q);
+void queue_push(struct TrainQueue *q, struct Train *t);
+struct Train queue_pop(struct TrainQueue *q);
+struct Train queue_front(struct TrainQueue *q);
+struct Train *queue_at(struct TrainQueue *q, int k);
+
+//Topology
+int find_name(char (*names)[NAME_LENGTH], int *sorted, int count, const char *name);
+int compare_names(const void *a, const void *b);
+int *sorted_name_index(char (*names)[NAME_LENGTH], int count);
+void *grow_array(void *data, int *capacity, int count, size_t size);
+void topology_free(struct Topology *t);
+int topology_error(const char *source, int line, const char *message, const char *token);
+struct Topology *topology_parse(char *text, const char *source);
+struct Topology *topology_load(const char *path);
+struct Topology *topology_builtin();
+
+//Trains
+float segment_rate(struct Simulation *sim, int segment_id);
+int draw_destination(int segment_id, double u);
+uint32_t get_train_id(struct Simulation *sim, int segment_id);
+int count_arrivals(struct Simulation *sim);
+void make_train(struct Simulation *sim, int segment_id, double *draws, struct Train *t);
+const struct TraceRecord *trace_due(struct Simulation *sim, int segment_id, int tick);
+void make_trace_train(struct Simulation *sim, int segment_id, const struct TraceRecord *r, struct Train *t);
+
+//Train history
+struct TrainHistory *history_create();
+void history_reset(struct TrainHistory *h);
+void history_append(struct TrainHistory *h, struct Train *t);
+void history_append_all(struct TrainHistory *dst, struct TrainHistory *src);
+void history_free(struct TrainHistory *h);
+void train_record(struct Train *t, uint32_t departure_time, struct TrainRecord *r);
+int history_write(struct Simulation *sim, const char *path);
+
+//Decision policies
+int tunnel_duration(struct Train *t);
+int release_longest(struct Simulation *sim, int section_id);
+int release_oldest(struct Simulation *sim, int section_id);
+int release_weighted(struct Simulation *sim, int section_id);
+int release_lookahead(struct Simulation *sim, int section_id);
+int admission_hysteresis_update(struct Simulation *sim, int section_id, int num_trains);
+int admission_hysteresis_accept(struct Simulation *sim, int segment_id, int queue_count);
+int admission_cap_update(struct Simulation *sim, int section_id, int num_trains);
+int admission_cap_accept(struct Simulation *sim, int segment_id, int queue_count);
+void policy_name(struct Policy *p);
+int parse_release(const char *spec, struct Policy *p);
+int parse_admission(const char *spec, struct Policy *p);
+
+//Tunnels and segments
+void decide_releasing_queue(struct Simulation *sim, int section_id);
+void record_departure(struct Simulation *sim, struct Train *t);
+void record_tunnel_exit(struct Simulation *sim, struct Train *t);
+void update_tunnel_tick(struct Simulation *sim, struct Section *section, int update);
+int enter_tunnel(struct Simulation *sim, struct Train *t);
+void publish_control(struct Section *section, unsigned int flags);
+void collect_segment(struct Simulation *sim, int segment_id);
+void collect_segments(struct Simulation *sim);
+void control_section(struct Simulation *sim, int section_id);
+int count_trains(struct Simulation *sim);
+int count_section_trains(struct Simulation *sim, int section_id);
+void sim_console(struct Simulation *sim, int color, const char *format, ...);
+void segment_step(struct Simulation *sim, int segment_id, float p);
+void run_segment_task(struct Simulation *sim, int task);
+
+//Worker pool
+void deque_init(struct TaskDeque *d, int capacity);
+void deque_push(struct TaskDeque *d, int task);
+int deque_pop(struct TaskDeque *d);
+int deque_steal(struct TaskDeque *d);
+void phase_barrier_init(struct PhaseBarrier *b, int parties);
+void phase_barrier_destroy(struct PhaseBarrier *b);
+int phase_barrier_wait(struct PhaseBarrier *b, int *local_sense, void (*serial)(void *), void *arg);
+void worker_run_tick(struct Worker *w);
+
+//Event calendar
+int event_before(struct Event *a, struct Event *b);
+void event_push(struct Simulation *sim, int at, int type, int segment_id);
+struct Event event_pop(struct Simulation *sim);
+int get_geometric(struct Simulation *sim, int segment_id, float p);
+
+//Statistics
+void *alloc_lines(size_t size);
+void stats_init(struct Simulation *sim, int count);
+void stats_merge(struct Simulation *sim, struct Histogram *out);
+void write_delay_summary(FILE *out, const char *metric, const char *help, struct DelayHistogram *by_origin, struct DelayHistogram *by_destination);
+int stats_write(struct Simulation *sim, const char *path);
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length);
+uint64_t topology_hash();
+
+//Arrival traces
+int trace_error(const char *source, long line, const char *message);
+const char *csv_field(const char *p, const char *end, char *field, size_t size);
+int trace_parse_line(const char **p, const char *end, int *sorted, struct TraceRecord *r, const char **error);
+int compare_trace_records(const void *a, const void *b);
+void *trace_from_csv(const char *text, size_t size, const char *path, size_t *out_size);
+int trace_check(struct Trace *t, const char *path);
+struct Trace *trace_load(const char *path);
+void trace_free(struct Trace *t);
+int trace_write(struct Trace *t, const char *path);
+
+//Event engine
+void schedule_arrival(struct Simulation *sim, int segment_id, int from);
+void touch_section(struct Simulation *sim, int section_id, int *dirty, int *dirty_count);
+void event_engine_start(struct Simulation *sim);
+int event_engine_step(struct Simulation *sim);
+void event_engine_finish(struct Simulation *sim);
+void run_event_engine(struct Simulation *sim);
+
+//Simulations and the tick engine
+struct Simulation *sim_create(const struct SimParams *params);
+void sim_reset(struct Simulation *sim, const struct SimParams *params);
+void sim_antithetic(struct Simulation *sim);
+void sim_destroy(struct Simulation *sim);
+void control_phase(void *arg);
+void *pool_worker(void *arg);
+int pool_size(struct Simulation *sim);
+void run_tick_engine(struct Simulation *sim);
+
+//Region engine
+void region_log_append(struct Region *r, struct LogRecord *record);
+int compare_region_records(const void *a, const void *b);
+void region_commit(struct RegionEngine *e, int gvt);
+int region_gvt(struct RegionEngine *e);
+struct Simulation *region_view(struct Simulation *sim, struct Region *r);
+void region_merge(struct Simulation *sim, struct Simulation *view);
+void region_tick(struct Region *r);
+void *region_worker(void *arg);
+void region_partition(struct RegionEngine *e);
+void run_region_engine(struct Simulation *sim);
+void run_simulation(struct Simulation *sim);
+
+#endif